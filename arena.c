@@ -0,0 +1,53 @@
+#include <stdlib.h>
+
+#include "arena.h"
+
+/* Size of a regular block; larger requests get a block of their own. */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+/* Round allocations up so that any type can be stored in them. */
+#define ARENA_ALIGN(n) (((n) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+/* Allocate memory from the arena. */
+void *arena_alloc(arena *a, size_t size) {
+	size = ARENA_ALIGN(size);
+
+	arena_block *b = a->blocks;
+	if (!b || b->size - b->used < size) {
+		size_t bsize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		b = malloc(sizeof(arena_block) + bsize);
+		if (!b)
+			return NULL;
+		b->size = bsize;
+		b->used = 0;
+		b->next = a->blocks;
+		a->blocks = b;
+	}
+
+	void *p = b->data + b->used;
+	b->used += size;
+	return p;
+}
+
+/* Release everything allocated from the arena, keeping one regular block. */
+void arena_reset(arena *a) {
+	arena_block *b = a->blocks, *next, *keep = NULL;
+	for (; b; b = next) {
+		next = b->next;
+		if (!keep && b->size == ARENA_BLOCK_SIZE) {
+			keep = b;
+			keep->used = 0;
+			keep->next = NULL;
+		} else {
+			free(b);
+		}
+	}
+	a->blocks = keep;
+}
+
+/* Release all of the arena's memory. */
+void arena_free(arena *a) {
+	arena_reset(a);
+	free(a->blocks);
+	a->blocks = NULL;
+}
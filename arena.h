@@ -0,0 +1,30 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/**
+ * A region allocator: memory is carved out of large blocks and released
+ * all at once, e.g. the strings built while processing one command line.
+ */
+typedef struct arena_block_t {
+	struct arena_block_t *next;
+	size_t size, used;
+	char data[];
+} arena_block;
+
+typedef struct arena_t {
+	arena_block *blocks;
+} arena;
+
+/* Allocate memory from the arena. Returns NULL if out of memory. */
+void *arena_alloc(arena *a, size_t size);
+
+/* Release everything allocated from the arena (keeping one block around
+ * for reuse). */
+void arena_reset(arena *a);
+
+/* Release all of the arena's memory. */
+void arena_free(arena *a);
+
+#endif
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Batch-mode throughput: run a generated script of builtin-only lines
+# through shsh (as a script file and on stdin) and through bash/dash.
+# Usage: bench/batch.sh [lines]   (run from the top of the tree)
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+LINES=${1:-200000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+for ((i = 0; i < LINES; i++)); do
+	echo "cd /tmp"
+done > "$SCRIPT"
+
+# run <label> <command...>: time a command, print lines per second
+run() {
+	local label=$1 start end
+	shift
+	start=$(date +%s%N)
+	"$@" > /dev/null
+	end=$(date +%s%N)
+	printf '%-18s %10d lines/s\n' "$label" $((LINES * 1000000000 / (end - start)))
+}
+
+run "shsh script" "$SHELL_BIN" "$SCRIPT"
+run "shsh stdin" sh -c '"$0" < "$1"' "$SHELL_BIN" "$SCRIPT"
+for sh in bash dash; do
+	command -v $sh > /dev/null && run "$sh script" $sh "$SCRIPT"
+done
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Compare the builtin cat/tee against coreutils' programs, run through shsh.
+# Usage: bench/cat_tee.sh [size in MiB]   (run from the top of the tree)
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+SIZE_MB=${1:-256}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$DIR/in"
+BYTES=$((SIZE_MB * 1024 * 1024))
+CAT=$(command -v cat)
+TEE=$(command -v tee)
+
+# run <label> <command line>: time one command line in shsh, print MB/s
+run() {
+	local start end
+	start=$(date +%s%N)
+	printf '%s\nexit\n' "$2" | "$SHELL_BIN" > /dev/null
+	end=$(date +%s%N)
+	printf '%-38s %6d MB/s\n' "$1" $((BYTES * 1000000000 / (end - start) / 1048576))
+}
+
+for impl in builtin coreutils; do
+	if [ $impl = builtin ]; then c=cat; t=tee; else c=$CAT; t=$TEE; fi
+	run "$impl: cat file > file" "$c $DIR/in > $DIR/out"
+	run "$impl: cat file | cat > file" "$c $DIR/in | $c > $DIR/out"
+	run "$impl: cat file | tee file > file" "$c $DIR/in | $t $DIR/out > $DIR/out2"
+	run "$impl: cat file | tee file | cat" "$c $DIR/in | $t $DIR/out | $c > $DIR/out2"
+done
@@ -0,0 +1,36 @@
+#!/bin/bash
+# Here-document throughput: a script with a multi-MB here-document body
+# piped into wc -c, run under shsh and bash/dash.  Also checks that every
+# byte arrives.
+# Usage: bench/heredoc.sh [MB]   (run from the top of the tree)
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+MB=${1:-16}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+LINE=$(printf '%099d' 0)
+NLINES=$((MB * 1024 * 1024 / 100))
+{
+	echo "wc -c <<END"
+	for ((i = 0; i < NLINES; i++)); do
+		echo "$LINE"
+	done
+	echo "END"
+} > "$SCRIPT"
+EXPECTED=$((NLINES * 100))
+
+# run <label> <shell>: time the script, print MB/s and check the count
+run() {
+	local label=$1 start end bytes
+	start=$(date +%s%N)
+	bytes=$("$2" "$SCRIPT")
+	end=$(date +%s%N)
+	[ "$bytes" -eq "$EXPECTED" ] || echo "$label: got $bytes bytes, expected $EXPECTED"
+	printf '%-8s %8d MB/s\n' "$label" $((EXPECTED * 1000 / (end - start)))
+}
+
+run shsh "$SHELL_BIN"
+for sh in bash dash; do
+	command -v $sh > /dev/null && run $sh $sh
+done
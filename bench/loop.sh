@@ -0,0 +1,32 @@
+#!/bin/bash
+# A loop of builtins, 'for i in $(seq N) ; do set -l x $i ; done', and 1000
+# rounds of /bin/true, run by shsh, bash and dash, to show that the body is
+# parsed once and only external commands fork.
+# Usage: bench/loop.sh [N]   (run from the top of the tree; the default is
+# 100000)
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+N=${1:-100000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+# run <shell> <script text>: print the wall time in ms
+run() {
+	local start end
+	printf '%s\n' "$2" > "$SCRIPT"
+	start=$(date +%s%N)
+	"$1" "$SCRIPT" > /dev/null
+	end=$(date +%s%N)
+	echo $(((end - start) / 1000000))
+}
+
+printf '%-8s  %14s  %18s\n' shell "builtins (ms)" "1000 forks (ms)"
+printf '%-8s  %14s  %18s\n' shsh \
+	"$(run "$SHELL_BIN" "for i in \$(seq $N) ; do set -l x \$i ; done")" \
+	"$(run "$SHELL_BIN" "for i in \$(seq 1000) ; do /bin/true ; done")"
+for sh in bash dash; do
+	command -v $sh > /dev/null || continue
+	printf '%-8s  %14s  %18s\n' $sh \
+		"$(run $sh "for i in \$(seq $N) ; do x=\$i ; done")" \
+		"$(run $sh "for i in \$(seq 1000) ; do /bin/true ; done")"
+done
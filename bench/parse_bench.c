@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../parser.h"
+#include "../vars.h"
+
+extern char **environ;
+
+/**
+ * Micro-benchmark of the front end: parse_line, unquote_tokens,
+ * construct_command and expand_command on a corpus of typical command
+ * lines, without running anything.  Prints the nanoseconds per line spent
+ * in each stage as one JSON object.
+ * Usage: bench/parse_bench [iterations]
+ */
+
+static char *corpus[] = {
+	"ls -l",
+	"cd /usr/local/src",
+	"grep -n TODO *.c | sort | uniq -c | sort -rn | head -20",
+	"make -j4 && ./shell < tests/input.txt > out.txt 2> err.txt",
+	"cat \"$HOME/.profile\" | grep -v \"^#\" | wc -l",
+	"set PATH $HOME/bin:/usr/local/bin:/usr/bin:/bin",
+	"tar czf backup.tar.gz src include docs ; echo done",
+	"find . -name \"*.o\" | xargs rm -f",
+	"echo \"user $USER in $PWD with shell $SHELL\"",
+	"sleep 10 & jobs",
+	"test -f config.h || ./configure --prefix=$HOME/.local",
+	"awk \"{ print \\$2 }\" data.csv | sort -u > keys.txt",
+};
+
+#define NCORPUS (sizeof(corpus) / sizeof(corpus[0]))
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+	long iterations = argc > 1 ? atol(argv[1]) : 200000;
+	double t_parse = 0, t_process = 0, t_construct = 0, t_expand = 0;
+	double t0, t1, t2, t3, t4;
+	char line[1024];
+	arena strings = { NULL };
+	long i, lines = 0;
+
+	setenv("USER", "bench", 0);
+	setenv("SHELL", "/bin/shsh", 0);
+	vars_init(environ);
+
+	for (i = 0; i < iterations; i++) {
+		char *text = corpus[i % NCORPUS];
+		strcpy(line, text);
+
+		t0 = now();
+		char **tokens = parse_line(line);
+		t1 = now();
+		unquote_tokens(tokens);
+		t2 = now();
+		command *cmd = construct_command(tokens, NULL);
+		t3 = now();
+		arena_reset(&strings);
+		expand_command(cmd, &strings);
+		t4 = now();
+
+		t_parse += t1 - t0;
+		t_process += t2 - t1;
+		t_construct += t3 - t2;
+		t_expand += t4 - t3;
+		lines++;
+
+		release_command(cmd);
+		free(tokens);
+	}
+	arena_free(&strings);
+
+	printf("{\"lines\": %ld, \"parse_line_ns\": %.1f, "
+	       "\"unquote_tokens_ns\": %.1f, \"construct_command_ns\": %.1f, "
+	       "\"expand_command_ns\": %.1f, \"total_ns\": %.1f}\n",
+	       lines, t_parse / lines, t_process / lines, t_construct / lines,
+	       t_expand / lines,
+	       (t_parse + t_process + t_construct + t_expand) / lines);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,34 @@
+#!/bin/bash
+# Pipeline throughput with the default pipe buffer and with SHSH_PIPE_SIZE:
+# 2- to 8-stage pipelines of head -c ... /dev/zero | /bin/cat | ... run by
+# shsh, timed with its own 'time' to get the context switches of the stages.
+# Usage: bench/pipe_size.sh [MB] [size]   (run from the top of the tree;
+# the defaults are 1024 and 1M)
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+MB=${1:-1024}
+SIZE=${2:-1M}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+# run <stages> <pipe size or "">: print MB/s and context switches
+run() {
+	local pipeline="head -c ${MB}M /dev/zero" i out real csw
+	for ((i = 1; i < $1; i++)); do
+		pipeline="$pipeline | /bin/cat"
+	done
+	{
+		[ -n "$2" ] && echo "set SHSH_PIPE_SIZE $2"
+		echo "time $pipeline > /dev/null"
+	} > "$SCRIPT"
+	out=$("$SHELL_BIN" "$SCRIPT" 2>&1)
+	real=$(echo "$out" | awk '$1 == "real" { sub("s", "", $2); print $2 }')
+	csw=$(echo "$out" | awk '$1 == "ctxsw" { print $2 + $4 }')
+	printf '%6d MB/s %9d ctxsw' \
+		"$(awk -v mb="$MB" -v t="$real" 'BEGIN { print int(mb / t) }')" "$csw"
+}
+
+printf '%-6s  %-26s  %-26s\n' stages default "SHSH_PIPE_SIZE=$SIZE"
+for ((n = 2; n <= 8; n++)); do
+	printf '%-6d  %s  %s\n' $n "$(run $n "")" "$(run $n "$SIZE")"
+done
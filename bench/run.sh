@@ -0,0 +1,84 @@
+#!/bin/bash
+# Benchmark suite behind 'make bench': front-end micro-benchmarks plus
+# spawn latency, pipeline throughput, && chains and batch scripts, run under
+# shsh and (when installed) bash and dash.  Prints one JSON object.
+# Usage: bench/run.sh [scale]   (run from the top of the tree; scale 1 is
+# the default size, use e.g. 0.1 for a quick run)
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+PARSE_BIN=${PARSE_BIN:-bench/parse_bench}
+SCALE=${1:-1}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# scaled <n>: n times the scale, at least 1
+scaled() {
+	awk -v n="$1" -v s="$SCALE" 'BEGIN { n = int(n * s); print n < 1 ? 1 : n }'
+}
+
+SPAWNS=$(scaled 2000)
+PIPE_MB=$(scaled 1024)
+STAGES=${STAGES:-4}
+CHAINS=$(scaled 20000)
+CHAIN_LEN=10
+LINES=$(scaled 200000)
+
+# The workloads, as scripts every shell can run
+for ((i = 0; i < SPAWNS; i++)); do
+	echo "/bin/true"
+done > "$DIR/spawn.sh"
+
+pipeline="head -c ${PIPE_MB}M /dev/zero"
+for ((i = 0; i < STAGES; i++)); do
+	pipeline="$pipeline | cat"
+done
+echo "$pipeline > /dev/null" > "$DIR/pipeline.sh"
+
+chain="cd ."
+for ((i = 1; i < CHAIN_LEN; i++)); do
+	chain="$chain && cd ."
+done
+for ((i = 0; i < CHAINS; i++)); do
+	echo "$chain"
+done > "$DIR/chain.sh"
+
+for ((i = 0; i < LINES; i++)); do
+	echo "cd /tmp"
+done > "$DIR/batch.sh"
+
+# elapsed <shell> <script>: run a script, print the time taken in ns
+elapsed() {
+	local start end
+	start=$(date +%s%N)
+	"$1" "$2" > /dev/null
+	end=$(date +%s%N)
+	echo $((end - start))
+}
+
+# results <shell>: the macro-benchmarks for one shell, as a JSON object
+results() {
+	local spawn pipe chain batch
+	spawn=$(elapsed "$1" "$DIR/spawn.sh")
+	pipe=$(elapsed "$1" "$DIR/pipeline.sh")
+	chain=$(elapsed "$1" "$DIR/chain.sh")
+	batch=$(elapsed "$1" "$DIR/batch.sh")
+	awk -v spawn="$spawn" -v pipe="$pipe" -v chain="$chain" \
+	    -v batch="$batch" -v spawns="$SPAWNS" -v mb="$PIPE_MB" \
+	    -v ops=$((CHAINS * CHAIN_LEN)) -v lines="$LINES" 'BEGIN {
+		printf "{\"spawn_us\": %.1f, \"pipeline_gb_s\": %.2f, ", \
+		       spawn / spawns / 1000, mb / 1024 / (pipe / 1e9)
+		printf "\"and_chain_ns\": %.0f, \"batch_lines_s\": %.0f}", \
+		       chain / ops, lines / (batch / 1e9)
+	}'
+}
+
+printf '{\n  "config": {"spawns": %d, "pipeline_mb": %d, "stages": %d, ' \
+       "$SPAWNS" "$PIPE_MB" "$STAGES"
+printf '"chains": %d, "chain_length": %d, "batch_lines": %d},\n' \
+       "$CHAINS" "$CHAIN_LEN" "$LINES"
+printf '  "parse": %s,\n' "$("$PARSE_BIN" $((LINES * 2)))"
+printf '  "shsh": %s' "$(results "$SHELL_BIN")"
+for sh in bash dash; do
+	command -v $sh > /dev/null && printf ',\n  "%s": %s' $sh "$(results $sh)"
+done
+printf '\n}\n'
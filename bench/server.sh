@@ -0,0 +1,35 @@
+#!/bin/bash
+# Daemon mode against a fresh shell per command: the same command is run
+# N times by bench/server_load over 1, 16 and 128 connections to a
+# 'shell --listen' server, and N times as 'shell -c' (one process each,
+# the way a service without the server would run it).
+# Usage: bench/server.sh [N] [command]   (run from the top of the tree,
+# after 'make shell bench/server_load'; the defaults are 2000 and "echo hi")
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+LOAD_BIN=${LOAD_BIN:-bench/server_load}
+N=${1:-2000}
+COMMAND=${2:-echo hi}
+DIR=$(mktemp -d)
+SOCK="$DIR/sock"
+
+"$SHELL_BIN" --listen "$SOCK" &
+SERVER=$!
+trap 'kill $SERVER; rm -rf "$DIR"' EXIT
+while [ ! -S "$SOCK" ]; do
+	sleep 0.01
+done
+
+for clients in 1 16 128; do
+	"$LOAD_BIN" "$SOCK" $clients $((N / clients)) "$COMMAND"
+done
+
+start=$(date +%s%N)
+for ((i = 0; i < N; i++)); do
+	"$SHELL_BIN" -c "$COMMAND" > /dev/null
+done
+end=$(date +%s%N)
+printf '{"fresh_process": true, "requests": %d, "seconds": %.3f, "requests_per_s": %.0f, "mean_us": %.1f}\n' \
+	$N "$(awk -v ns=$((end - start)) 'BEGIN { print ns / 1e9 }')" \
+	"$(awk -v ns=$((end - start)) -v n=$N 'BEGIN { print n / (ns / 1e9) }')" \
+	"$(awk -v ns=$((end - start)) -v n=$N 'BEGIN { print ns / n / 1e3 }')"
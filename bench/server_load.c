@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "../server.h"
+
+/**
+ * Load generator for the shell's daemon mode: opens a number of
+ * connections to the server and keeps one request in flight on each (a new
+ * one goes out as soon as the response comes back), until every connection
+ * has sent its share.  Prints the throughput and the latency percentiles
+ * as JSON.
+ * Usage: bench/server_load SOCKET CLIENTS REQUESTS COMMAND
+ *        (REQUESTS per client; the output is captured)
+ */
+
+typedef struct client_t {
+	int fd;
+	int left;                  /* Requests still to send */
+	long long sent_at;         /* When the request in flight went out */
+	char *buf;                 /* The response so far */
+	size_t used, size;
+} client;
+
+static char *request;
+static size_t request_len;
+
+/* The time, in nanoseconds. */
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Send the request on a client's connection (it is small enough to go out
+ * whole).  Returns -1 on error. */
+static int send_request(client *c) {
+	c->sent_at = now_ns();
+	c->used = 0;
+	c->left--;
+	return send(c->fd, request, request_len, MSG_NOSIGNAL) ==
+	       (ssize_t)request_len ? 0 : -1;
+}
+
+/* Whether the response has come in whole. */
+static int response_done(client *c) {
+	char *nl = memchr(c->buf, '\n', c->used);
+	size_t out_len, err_len;
+	int status;
+	if (!nl || sscanf(c->buf, "%d %zu %zu", &status, &out_len, &err_len) != 3)
+		return 0;
+	return c->used >= (size_t)(nl + 1 - c->buf) + out_len + err_len;
+}
+
+static int compare(const void *a, const void *b) {
+	long long x = *(long long *)a, y = *(long long *)b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int nclients, per_client, i;
+
+	if (argc != 5 || (nclients = atoi(argv[2])) < 1 ||
+		(per_client = atoi(argv[3])) < 1 ||
+		strlen(argv[1]) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "usage: %s SOCKET CLIENTS REQUESTS COMMAND\n",
+		        argv[0]);
+		return 2;
+	}
+	strcpy(addr.sun_path, argv[1]);
+	request_len = strlen(argv[4]) + SERVER_HEADER_MAX;
+	request = malloc(request_len);
+	request_len = snprintf(request, request_len, "%s %zu\n%s",
+	                       SERVER_CAPTURE, strlen(argv[4]), argv[4]);
+
+	long long total = (long long)nclients * per_client, done = 0;
+	long long *latencies = malloc(total * sizeof(long long));
+	client *clients = calloc(nclients, sizeof(client));
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (!latencies || !clients || epfd == -1) {
+		perror("server_load");
+		return 1;
+	}
+
+	long long start = now_ns();
+	for (i = 0; i < nclients; ++i) {
+		client *c = &clients[i];
+		c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (c->fd == -1 ||
+			connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+			perror(argv[1]);
+			return 1;
+		}
+		c->size = 4096;
+		c->buf = malloc(c->size);
+		c->left = per_client;
+		struct epoll_event ev = { EPOLLIN, { .ptr = c } };
+		if (!c->buf || epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1 ||
+			send_request(c) == -1) {
+			perror("server_load");
+			return 1;
+		}
+	}
+
+	int failed = 0;
+	while (done < total) {
+		struct epoll_event events[64];
+		int n = epoll_wait(epfd, events, 64, -1);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			perror("epoll_wait");
+			return 1;
+		}
+		for (i = 0; i < n; ++i) {
+			client *c = events[i].data.ptr;
+			if (c->used == c->size) {
+				c->size *= 2;
+				if (!(c->buf = realloc(c->buf, c->size))) {
+					perror("realloc");
+					return 1;
+				}
+			}
+			ssize_t got = recv(c->fd, c->buf + c->used, c->size - c->used, 0);
+			if (got <= 0) {
+				fprintf(stderr, "server_load: connection closed\n");
+				return 1;
+			}
+			c->used += got;
+			if (!response_done(c))
+				continue;
+			if (atoi(c->buf) != 0)
+				failed++;
+			latencies[done++] = now_ns() - c->sent_at;
+			if (c->left > 0 && send_request(c) == -1) {
+				perror("send");
+				return 1;
+			}
+		}
+	}
+	double seconds = (now_ns() - start) / 1e9;
+
+	qsort(latencies, total, sizeof(long long), compare);
+	printf("{\"clients\": %d, \"requests\": %lld, \"failed\": %d, "
+	       "\"seconds\": %.3f, \"requests_per_s\": %.0f, \"p50_us\": %.1f, "
+	       "\"p99_us\": %.1f, \"max_us\": %.1f}\n",
+	       nclients, total, failed, seconds, total / seconds,
+	       latencies[total / 2] / 1e3, latencies[total * 99 / 100] / 1e3,
+	       latencies[total - 1] / 1e3);
+	return 0;
+}
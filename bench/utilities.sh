@@ -0,0 +1,41 @@
+#!/bin/bash
+# Script lines made only of echo, printf, test/[, true, false and :, with
+# and without redirections, run by shsh, bash and dash (and by an earlier
+# shsh build given as OLD_SHELL, where they were external programs).
+# Usage: bench/utilities.sh [N]   (run from the top of the tree; N lines,
+# 20000 by default)
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+N=${1:-20000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+lines=(
+	"echo hello world"
+	"printf \"%s=%d\\n\" x 42"
+	"test -d /tmp"
+	"[ abc = abc ]"
+	"true"
+	"false"
+	": > $DIR/empty"
+	"echo appended >> $DIR/log"
+)
+for ((i = 0; i < N; i++)); do
+	echo "${lines[i % ${#lines[@]}]}"
+done > "$DIR/script.sh"
+
+# run <shell>: print the time taken in ms, and per line in us
+run() {
+	local start end
+	start=$(date +%s%N)
+	"$1" "$DIR/script.sh" > /dev/null 2>&1
+	end=$(date +%s%N)
+	printf '%8d ms %8.1f us/line' $(((end - start) / 1000000)) \
+		"$(awk -v ns=$((end - start)) -v n="$N" 'BEGIN { print ns / n / 1000 }')"
+}
+
+printf '%-10s %s\n' shsh "$(run "$SHELL_BIN")"
+[ -n "$OLD_SHELL" ] && printf '%-10s %s\n' "old shsh" "$(run "$OLD_SHELL")"
+for sh in bash dash; do
+	command -v $sh > /dev/null && printf '%-10s %s\n' $sh "$(run $sh)"
+done
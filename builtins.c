@@ -0,0 +1,893 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "builtins.h"
+#include "vars.h"
+
+/* If we write to any files, make sure that we set the permissions to 644. */
+#define MODE_644 (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+/* How much to move per system call. */
+#define COPY_CHUNK (1 << 20)
+/* Buffer size for the plain read/write fallback. */
+#define BUFFER_SIZE (128 * 1024)
+
+/* Whether an error means "this kind of copy is not supported here", as
+ * opposed to a real I/O error. */
+#define UNSUPPORTED(e) ((e) == EINVAL || (e) == ENOSYS || (e) == EXDEV || \
+                        (e) == EOPNOTSUPP || (e) == EBADF)
+
+/* Write all of a buffer, retrying short writes. */
+int write_all(int fd, char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Copy the rest of 'in' to 'out' through a buffer. */
+static long long copy_read_write(int in, int out) {
+	char *buf = malloc(BUFFER_SIZE);
+	long long total = 0;
+	ssize_t n;
+
+	if (!buf)
+		return -1;
+	while ((n = read(in, buf, BUFFER_SIZE)) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			total = -1;
+			break;
+		}
+		if (write_all(out, buf, n) == -1) {
+			total = -1;
+			break;
+		}
+		total += n;
+	}
+	free(buf);
+	return total;
+}
+
+/**
+ * Copy all data from one descriptor to another.  The kernel moves the data
+ * whenever it can: copy_file_range between regular files, splice when one
+ * side is a pipe and sendfile from a regular file.  Each one is tried until
+ * the kernel refuses it, then we move on to the next, ending with a plain
+ * read/write loop.  All of them use the file offsets, so a copy can pick up
+ * where the previous method stopped.
+ */
+long long copy_fd(int in, int out) {
+	struct stat sin, sout;
+	long long total = 0;
+	ssize_t n;
+
+	if (fstat(in, &sin) == -1 || fstat(out, &sout) == -1)
+		return -1;
+
+	/* Regular file to regular file: copy_file_range (may share extents). */
+	if (S_ISREG(sin.st_mode) && S_ISREG(sout.st_mode)) {
+		while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0)
+			total += n;
+		if (n == 0)
+			return total;
+		if (!UNSUPPORTED(errno))
+			return -1;
+	}
+
+	/* A pipe on either side: splice pages straight across. */
+	if (S_ISFIFO(sin.st_mode) || S_ISFIFO(sout.st_mode)) {
+		while ((n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE)) > 0)
+			total += n;
+		if (n == 0)
+			return total;
+		if (errno != EINTR && !UNSUPPORTED(errno))
+			return -1;
+	}
+
+	/* From a regular file to anything else: sendfile. */
+	if (S_ISREG(sin.st_mode)) {
+		while ((n = sendfile(out, in, NULL, COPY_CHUNK)) > 0)
+			total += n;
+		if (n == 0)
+			return total;
+		if (!UNSUPPORTED(errno))
+			return -1;
+	}
+
+	n = copy_read_write(in, out);
+	return n == -1 ? -1 : total + n;
+}
+
+/**
+ * cat [file...]
+ * Concatenates the files (or stdin, given no files or "-") to stdout.
+ */
+int execute_cat(char **words, int fds[3]) {
+	int i, ret = EXIT_SUCCESS;
+
+	if (!words[1] && copy_fd(fds[0], fds[1]) == -1) {
+		dprintf(fds[2], "cat: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	for (i = 1; words[i]; ++i) {
+		int fd = strcmp(words[i], "-") ? open(words[i], O_RDONLY | O_CLOEXEC) : fds[0];
+		if (fd == -1 || copy_fd(fd, fds[1]) == -1) {
+			dprintf(fds[2], "cat: %s: %s\n", words[i], strerror(errno));
+			ret = EXIT_FAILURE;
+		}
+		if (fd != -1 && fd != fds[0])
+			close(fd);
+	}
+	return ret;
+}
+
+/**
+ * Parse a size like "65536", "256K" or "1M" (K, M and G are powers of
+ * 1024).  Returns -1 if it is not one.
+ */
+static long parse_size(char *s) {
+	char *end;
+	long size = strtol(s, &end, 10);
+	if (end == s || size <= 0)
+		return -1;
+	switch (*end) {
+		case 'g': case 'G': size <<= 10; /* fall through */
+		case 'm': case 'M': size <<= 10; /* fall through */
+		case 'k': case 'K': size <<= 10; end++;
+	}
+	return *end ? -1 : size;
+}
+
+/* The most an unprivileged process may ask for with F_SETPIPE_SZ */
+static long pipe_max_size(void) {
+	long max = -1;
+	FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+	if (f) {
+		if (fscanf(f, "%ld", &max) != 1)
+			max = -1;
+		fclose(f);
+	}
+	return max;
+}
+
+/**
+ * The buffer size for new pipes from SHSH_PIPE_SIZE, capped at the system's
+ * pipe-max-size, or 0 for the kernel's default.  The setting is only parsed
+ * again when it changes.
+ */
+static int pipe_size(void) {
+	static char *setting;
+	static int size;
+	char *value = var_get("SHSH_PIPE_SIZE");
+
+	if (!value) {
+		free(setting);
+		setting = NULL;
+		return size = 0;
+	}
+	if (setting && !strcmp(setting, value))
+		return size;
+	free(setting);
+	setting = strdup(value);
+
+	long wanted = parse_size(value), max = pipe_max_size();
+	if (wanted == -1)
+		fprintf(stderr, "SHSH_PIPE_SIZE: %s: not a size\n", value);
+	if (max > 0 && wanted > max)
+		wanted = max;
+	return size = (wanted > 0 && wanted <= (1L << 30)) ? wanted : 0;
+}
+
+/* Make a close-on-exec pipe, with the buffer size from SHSH_PIPE_SIZE. */
+int make_pipe(int pfd[2]) {
+	if (pipe2(pfd, O_CLOEXEC) == -1)
+		return -1;
+	int size = pipe_size();
+	/* Past the per-user limit of pipe pages, keep the default size. */
+	if (size)
+		fcntl(pfd[1], F_SETPIPE_SZ, size);
+	return 0;
+}
+
+/**
+ * Copy stdin to stdout and to one file without copying through user space:
+ * tee(2) duplicates each chunk into the stdout pipe (or a scratch pipe that
+ * is then spliced out, if stdout is a file), and splice then moves the same
+ * chunk from stdin into the file.  Returns 0 when done, 1 if the kernel
+ * refused before anything was copied, and -1 on error.
+ */
+static int tee_splice(int in, int out, int file) {
+	struct stat sout;
+	int scratch[2] = { -1, -1 };
+	int target = out, ret = 0;
+	long long total = 0;
+
+	if (fstat(out, &sout) == -1)
+		return -1;
+	if (!S_ISFIFO(sout.st_mode)) {
+		if (make_pipe(scratch) == -1)
+			return -1;
+		target = scratch[1];
+	}
+
+	while (1) {
+		ssize_t m = tee(in, target, COPY_CHUNK, 0), n;
+		if (m == 0)
+			break;
+		if (m == -1) {
+			if (errno == EINTR)
+				continue;
+			ret = (total == 0 && UNSUPPORTED(errno)) ? 1 : -1;
+			break;
+		}
+
+		/* Push the duplicate out of the scratch pipe. */
+		ssize_t left;
+		for (left = m; target != out && left > 0; left -= n) {
+			n = splice(scratch[0], NULL, out, NULL, left, SPLICE_F_MOVE);
+			if (n <= 0)
+				goto fail;
+		}
+		/* Then consume the original into the file. */
+		for (left = m; left > 0; left -= n) {
+			n = splice(in, NULL, file, NULL, left, SPLICE_F_MOVE);
+			if (n <= 0)
+				goto fail;
+		}
+		total += m;
+	}
+	goto out;
+
+fail:
+	ret = -1;
+out:
+	if (scratch[0] != -1) {
+		close(scratch[0]);
+		close(scratch[1]);
+	}
+	return ret;
+}
+
+/* Copy stdin to stdout and all the files through a buffer. */
+static int tee_read_write(int in, int out, int *files, int nfiles) {
+	char *buf = malloc(BUFFER_SIZE);
+	ssize_t n;
+	int i, ret = 0;
+
+	if (!buf)
+		return -1;
+	while ((n = read(in, buf, BUFFER_SIZE)) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			ret = -1;
+			break;
+		}
+		if (write_all(out, buf, n) == -1)
+			ret = -1;
+		for (i = 0; i < nfiles; ++i) {
+			if (files[i] != -1 && write_all(files[i], buf, n) == -1)
+				ret = -1;
+		}
+		if (ret == -1)
+			break;
+	}
+	free(buf);
+	return ret;
+}
+
+/**
+ * tee [-a] [file...]
+ * Copies stdin to stdout and to each of the files (appending with -a).
+ */
+int execute_tee(char **words, int fds[3]) {
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	int i = 1, nfiles = 0, ret = EXIT_SUCCESS;
+
+	if (words[1] && !strcmp(words[1], "-a")) {
+		flags = (flags & ~O_TRUNC) | O_APPEND;
+		i++;
+	}
+
+	char **names = words + i;
+	for (; words[i]; ++i)
+		nfiles++;
+	int *files = malloc(sizeof(int) * (nfiles ? nfiles : 1));
+	if (!files) {
+		dprintf(fds[2], "tee: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < nfiles; ++i) {
+		files[i] = open(names[i], flags, MODE_644);
+		if (files[i] == -1) {
+			dprintf(fds[2], "tee: %s: %s\n", names[i], strerror(errno));
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	/* With no files, tee is just cat. */
+	int err;
+	if (nfiles == 0) {
+		err = copy_fd(fds[0], fds[1]) == -1 ? -1 : 0;
+	} else {
+		/* The zero-copy path needs stdin to be a pipe, stdout to be a
+		 * pipe or a file, and moves data into a single regular file. */
+		struct stat sin, sout, sfile;
+		err = 1;
+		if (nfiles == 1 && files[0] != -1 &&
+			fstat(fds[0], &sin) == 0 && S_ISFIFO(sin.st_mode) &&
+			fstat(fds[1], &sout) == 0 &&
+			(S_ISFIFO(sout.st_mode) || S_ISREG(sout.st_mode)) &&
+			fstat(files[0], &sfile) == 0 && S_ISREG(sfile.st_mode))
+			err = tee_splice(fds[0], fds[1], files[0]);
+		if (err == 1)
+			err = tee_read_write(fds[0], fds[1], files, nfiles);
+	}
+	if (err == -1) {
+		dprintf(fds[2], "tee: %s\n", strerror(errno));
+		ret = EXIT_FAILURE;
+	}
+
+	for (i = 0; i < nfiles; ++i) {
+		if (files[i] != -1)
+			close(files[i]);
+	}
+	free(files);
+	return ret;
+}
+
+/* Size of the buffer a builtin gathers its output in */
+#define OUTPUT_BUFFER 4096
+
+/* Output of a builtin, gathered so that it goes out in as few writes as
+ * possible (a line of echo in one). */
+typedef struct output_t {
+	int fd;
+	int error;                  /* errno of a failed write, or 0 */
+	size_t used;
+	char buf[OUTPUT_BUFFER];
+} output;
+
+/* Start gathering output for a descriptor. */
+static void output_init(output *o, int fd) {
+	o->fd = fd;
+	o->error = 0;
+	o->used = 0;
+}
+
+/* Write out what has been gathered. */
+static void output_flush(output *o) {
+	if (o->used && !o->error && write_all(o->fd, o->buf, o->used) == -1)
+		o->error = errno;
+	o->used = 0;
+}
+
+/* Add some bytes to the output. */
+static void output_put(output *o, char *s, size_t len) {
+	if (o->used + len > OUTPUT_BUFFER)
+		output_flush(o);
+	if (len >= OUTPUT_BUFFER) {
+		if (!o->error && write_all(o->fd, s, len) == -1)
+			o->error = errno;
+		return;
+	}
+	memcpy(o->buf + o->used, s, len);
+	o->used += len;
+}
+
+/* Add a character to the output. */
+static void output_char(output *o, char c) {
+	if (o->used == OUTPUT_BUFFER)
+		output_flush(o);
+	o->buf[o->used++] = c;
+}
+
+/* Value of an octal or hex digit, or -1. */
+static int digit_value(char c, int base) {
+	int v = (c >= '0' && c <= '9') ? c - '0' :
+	        (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+	        (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+	return v < base ? v : -1;
+}
+
+/**
+ * Read one backslash escape, like echo -e and printf: \a \b \e \f \n \r \t
+ * \v \\, \0nnn or \nnn in octal and \xHH in hex.  s points after the
+ * backslash.  Stores the character in *c and returns where the escape ends;
+ * an unknown escape is taken as the backslash alone.  \c (stop all output)
+ * returns NULL.
+ */
+static char *read_escape(char *s, char *c) {
+	static char *from = "abefnrtv\\", *to = "\a\b\033\f\n\r\t\v\\";
+	char *known = *s ? strchr(from, *s) : NULL;
+	int i, v, n = 0;
+
+	if (known) {
+		*c = to[known - from];
+		return s + 1;
+	}
+	if (*s == 'c')
+		return NULL;
+	if (*s == 'x' && digit_value(s[1], 16) != -1) {
+		for (i = 1; i <= 2 && (v = digit_value(s[i], 16)) != -1; i++)
+			n = n * 16 + v;
+		*c = n;
+		return s + i;
+	}
+	if (digit_value(*s, 8) != -1) {
+		/* \0 may be followed by three more digits */
+		if (*s == '0')
+			s++;
+		for (i = 0; i < 3 && (v = digit_value(s[i], 8)) != -1; i++)
+			n = n * 8 + v;
+		*c = n;
+		return s + i;
+	}
+	*c = '\\';
+	return s;
+}
+
+/* Add a string to the output with its escapes read.  Returns 1 if it had
+ * a \c, after which nothing more is to be written. */
+static int output_escaped(output *o, char *s) {
+	char c;
+	while (*s) {
+		if (*s != '\\') {
+			output_char(o, *s++);
+			continue;
+		}
+		if (!(s = read_escape(s + 1, &c)))
+			return 1;
+		output_char(o, c);
+	}
+	return 0;
+}
+
+/**
+ * echo [-n] [-e | -E] [word...]
+ * Writes the words, separated by spaces, and a newline (unless -n).  With
+ * -e backslash escapes in the words are read, as by printf.
+ */
+int execute_echo(char **words, int fds[3]) {
+	int i = 1, newline = 1, escapes = 0, first;
+	output o;
+
+	/* Options are words made of only these letters, like in bash. */
+	for (; words[i] && words[i][0] == '-' && words[i][1] &&
+	       strspn(words[i] + 1, "neE") == strlen(words[i] + 1); ++i) {
+		char *opt;
+		for (opt = words[i] + 1; *opt; ++opt) {
+			if (*opt == 'n')
+				newline = 0;
+			else
+				escapes = (*opt == 'e');
+		}
+	}
+
+	output_init(&o, fds[1]);
+	for (first = i; words[i]; ++i) {
+		if (i > first)
+			output_char(&o, ' ');
+		if (!escapes) {
+			output_put(&o, words[i], strlen(words[i]));
+		} else if (output_escaped(&o, words[i])) {
+			newline = 0;
+			break;
+		}
+	}
+	if (newline)
+		output_char(&o, '\n');
+	output_flush(&o);
+	if (o.error) {
+		dprintf(fds[2], "echo: write error: %s\n", strerror(o.error));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* The number of an argument of printf: decimal, 0x hex, 0 octal, or the
+ * character after a quote ('A is 65).  Sets *bad if it is not a number. */
+static long long printf_number(char *s, int *bad) {
+	char *end;
+	if (*s == '\'' || *s == '"')
+		return (unsigned char)s[1];
+	errno = 0;
+	long long n = strtoll(s, &end, 0);
+	if (*s && (*end || errno))
+		*bad = 1;
+	return n;
+}
+
+/* Format one conversion with snprintf into the output. */
+static void output_format(output *o, char *spec, ...) {
+	char small[256], *buf = small;
+	va_list ap;
+
+	va_start(ap, spec);
+	int n = vsnprintf(small, sizeof(small), spec, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if ((size_t)n >= sizeof(small)) {
+		if (!(buf = malloc(n + 1)))
+			return;
+		va_start(ap, spec);
+		vsnprintf(buf, n + 1, spec, ap);
+		va_end(ap);
+	}
+	output_put(o, buf, n);
+	if (buf != small)
+		free(buf);
+}
+
+/**
+ * Write a printf format once, taking arguments from *args as conversions
+ * need them (an empty string or 0 when there are none left).  Returns -1
+ * if the format is bad, 1 if output was stopped by \c, else 0.  *bad is set
+ * if an argument was not a number.
+ */
+static int printf_once(output *o, char *format, char ***args, int *bad,
+                       int err) {
+	char *s = format, c;
+
+	while (*s) {
+		if (*s == '\\') {
+			if (!(s = read_escape(s + 1, &c)))
+				return 1;
+			output_char(o, c);
+			continue;
+		}
+		if (*s != '%') {
+			output_char(o, *s++);
+			continue;
+		}
+		if (s[1] == '%') {
+			output_char(o, '%');
+			s += 2;
+			continue;
+		}
+
+		/* Copy the flags, width and precision into a spec for snprintf,
+		 * with room for the 'll' of integer conversions. */
+		char spec[64];
+		size_t len = strspn(s + 1, "-+ #0");
+		len += strspn(s + 1 + len, "0123456789");
+		if (s[1 + len] == '.') {
+			len++;
+			len += strspn(s + 1 + len, "0123456789");
+		}
+		char conv = s[1 + len];
+		if (!conv || !strchr("diouxXcsbeEfFgGaA", conv) ||
+			len + 5 > sizeof(spec)) {
+			dprintf(err, "printf: %.*s: invalid format\n", (int)len + 2, s);
+			return -1;
+		}
+		spec[0] = '%';
+		memcpy(spec + 1, s + 1, len);
+		s += len + 2;
+
+		char *arg = **args ? *(*args)++ : NULL;
+		if (strchr("diouxX", conv)) {
+			/* These take a long long; unsigned ones convert from it. */
+			int wrong = 0;
+			long long n = arg ? printf_number(arg, &wrong) : 0;
+			spec[len + 1] = 'l';
+			spec[len + 2] = 'l';
+			spec[len + 3] = conv;
+			spec[len + 4] = '\0';
+			output_format(o, spec, n);
+			if (wrong) {
+				dprintf(err, "printf: %s: invalid number\n", arg);
+				*bad = 1;
+			}
+			continue;
+		}
+		spec[len + 2] = '\0';
+		if (strchr("eEfFgGaA", conv)) {
+			char *end;
+			double d = arg ? strtod(arg, &end) : 0.0;
+			if (arg && (!*arg || *end)) {
+				dprintf(err, "printf: %s: invalid number\n", arg);
+				*bad = 1;
+			}
+			spec[len + 1] = conv;
+			output_format(o, spec, d);
+		} else if (conv == 'c' && arg) {
+			spec[len + 1] = 'c';
+			output_format(o, spec, *arg);
+		} else if (conv == 's' || !arg) {
+			spec[len + 1] = 's';
+			output_format(o, spec, arg ? arg : "");
+		} else {
+			/* %b: a string with escapes, read into a copy (which only
+			 * gets shorter). */
+			char *copy = malloc(strlen(arg) + 1), *d = copy, *from = arg;
+			int stop = 0;
+			if (!copy)
+				return -1;
+			while (*from) {
+				if (*from != '\\') {
+					*d++ = *from++;
+				} else if (!(from = read_escape(from + 1, d++))) {
+					stop = 1;
+					d--;
+					break;
+				}
+			}
+			*d = '\0';
+			spec[len + 1] = 's';
+			output_format(o, spec, copy);
+			free(copy);
+			if (stop)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * printf format [argument...]
+ * Writes the arguments as the format says, like printf(1): the format is
+ * used again as long as there are arguments left.
+ */
+int execute_printf(char **words, int fds[3]) {
+	if (!words[1]) {
+		dprintf(fds[2], "printf: usage: printf format [argument...]\n");
+		return EXIT_FAILURE;
+	}
+
+	char **args = words + 2;
+	int bad = 0, ret;
+	output o;
+	output_init(&o, fds[1]);
+	do {
+		char **before = args;
+		ret = printf_once(&o, words[1], &args, &bad, fds[2]);
+		/* A format without conversions would never use them up. */
+		if (args == before)
+			break;
+	} while (ret == 0 && *args);
+	output_flush(&o);
+
+	if (o.error) {
+		dprintf(fds[2], "printf: write error: %s\n", strerror(o.error));
+		return EXIT_FAILURE;
+	}
+	return (ret == -1 || bad) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* A test expression being evaluated */
+typedef struct test_t {
+	char **args;
+	int n, pos;
+	int error;                  /* Set on a syntax error */
+	int *fds;
+	char *name;                 /* test or [, for error messages */
+} test;
+
+static int test_or(test *t);
+
+/* Report a bad test expression (only the first problem). */
+static int test_error(test *t, char *what, char *arg) {
+	if (!t->error)
+		dprintf(t->fds[2], "%s: %s%s%s\n", t->name, arg ? arg : "",
+		        arg ? ": " : "", what);
+	t->error = 1;
+	return 0;
+}
+
+/* Read an integer operand of -eq and the like. */
+static long long test_integer(test *t, char *s) {
+	char *end;
+	errno = 0;
+	long long n = strtoll(s, &end, 10);
+	while (*end == ' ' || *end == '\t')
+		end++;
+	if (!*s || *end || errno)
+		test_error(t, "integer expression expected", s);
+	return n;
+}
+
+/* Whether a word is a unary operator of test. */
+static int test_unary(char *op) {
+	return op[0] == '-' && op[1] && !op[2] &&
+	       strchr("bcdefghLkprsStuwxOGnz", op[1]);
+}
+
+/* Evaluate a unary operator on a file or string. */
+static int test_file(test *t, char *op, char *arg) {
+	struct stat st;
+	int ok;
+
+	switch (op[1]) {
+		case 'n':
+			return *arg != '\0';
+		case 'z':
+			return *arg == '\0';
+		case 't': {
+			/* The command's own stdin/stdout/stderr, redirections and all */
+			int fd = test_integer(t, arg);
+			return isatty((fd >= 0 && fd <= 2) ? t->fds[fd] : fd);
+		}
+		case 'r':
+			return access(arg, R_OK) == 0;
+		case 'w':
+			return access(arg, W_OK) == 0;
+		case 'x':
+			return access(arg, X_OK) == 0;
+		case 'h':
+		case 'L':
+			return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+	}
+	if (stat(arg, &st) == -1)
+		return 0;
+	switch (op[1]) {
+		case 'b': ok = S_ISBLK(st.st_mode); break;
+		case 'c': ok = S_ISCHR(st.st_mode); break;
+		case 'd': ok = S_ISDIR(st.st_mode); break;
+		case 'f': ok = S_ISREG(st.st_mode); break;
+		case 'p': ok = S_ISFIFO(st.st_mode); break;
+		case 'S': ok = S_ISSOCK(st.st_mode); break;
+		case 's': ok = st.st_size > 0; break;
+		case 'g': ok = (st.st_mode & S_ISGID) != 0; break;
+		case 'u': ok = (st.st_mode & S_ISUID) != 0; break;
+		case 'k': ok = (st.st_mode & S_ISVTX) != 0; break;
+		case 'O': ok = st.st_uid == geteuid(); break;
+		case 'G': ok = st.st_gid == getegid(); break;
+		default:  ok = 1; break;         /* -e */
+	}
+	return ok;
+}
+
+/* Compare the modification times of two files (-nt, -ot), or whether they
+ * are the same file (-ef).  A missing file is older than any other. */
+static int test_files(char *op, char *a, char *b) {
+	struct stat sa, sb;
+	int ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+
+	if (!strcmp(op, "-ef"))
+		return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+	if (!ha || !hb)
+		return !strcmp(op, "-nt") ? ha && !hb : hb && !ha;
+	long long diff = (sa.st_mtim.tv_sec - sb.st_mtim.tv_sec) * 1000000000LL +
+	                 (sa.st_mtim.tv_nsec - sb.st_mtim.tv_nsec);
+	return !strcmp(op, "-nt") ? diff > 0 : diff < 0;
+}
+
+/* Evaluate a binary operator, or return -1 if op is not one. */
+static int test_binary(test *t, char *a, char *op, char *b) {
+	static char *ints[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+	int i;
+
+	if (!strcmp(op, "=") || !strcmp(op, "=="))
+		return !strcmp(a, b);
+	if (!strcmp(op, "!="))
+		return strcmp(a, b) != 0;
+	if (!strcmp(op, "-nt") || !strcmp(op, "-ot") || !strcmp(op, "-ef"))
+		return test_files(op, a, b);
+	for (i = 0; i < 6; i++) {
+		if (!strcmp(op, ints[i])) {
+			long long x = test_integer(t, a), y = test_integer(t, b);
+			switch (i) {
+				case 0: return x == y;
+				case 1: return x != y;
+				case 2: return x < y;
+				case 3: return x <= y;
+				case 4: return x > y;
+				default: return x >= y;
+			}
+		}
+	}
+	return -1;
+}
+
+/**
+ * primary := '(' or ')' | word binary word | unary word | word
+ * A binary operator is looked for first, so that "= = =" and "-f = x" are
+ * comparisons; a word on its own is true if it is not empty.
+ */
+static int test_primary(test *t) {
+	int left = t->n - t->pos, result;
+	char **a = t->args + t->pos;
+
+	if (left <= 0)
+		return test_error(t, "argument expected", NULL);
+	if (left >= 3 && (result = test_binary(t, a[0], a[1], a[2])) != -1) {
+		t->pos += 3;
+		return result;
+	}
+	if (left >= 2 && test_unary(a[0])) {
+		t->pos += 2;
+		return test_file(t, a[0], a[1]);
+	}
+	if (left >= 2 && !strcmp(a[0], "(")) {
+		t->pos++;
+		result = test_or(t);
+		if (t->pos >= t->n || strcmp(t->args[t->pos], ")"))
+			return test_error(t, "')' expected", NULL);
+		t->pos++;
+		return result;
+	}
+	t->pos++;
+	return *a[0] != '\0';
+}
+
+/* not := '!' not | primary */
+static int test_not(test *t) {
+	if (t->n - t->pos >= 2 && !strcmp(t->args[t->pos], "!")) {
+		t->pos++;
+		return !test_not(t);
+	}
+	return test_primary(t);
+}
+
+/* and := not ('-a' not)* */
+static int test_and(test *t) {
+	int result = test_not(t);
+	while (t->pos < t->n && !strcmp(t->args[t->pos], "-a")) {
+		t->pos++;
+		result = test_not(t) && result;
+	}
+	return result;
+}
+
+/* or := and ('-o' and)* */
+static int test_or(test *t) {
+	int result = test_and(t);
+	while (t->pos < t->n && !strcmp(t->args[t->pos], "-o")) {
+		t->pos++;
+		result = test_and(t) || result;
+	}
+	return result;
+}
+
+/**
+ * test expression, or [ expression ]
+ * Evaluates a conditional expression: file tests (-e, -f, -d, -r...),
+ * string tests (-n, -z, =, !=), integer comparisons (-eq, -lt...), file
+ * comparisons (-nt, -ot, -ef), combined with !, -a, -o and ( ).  There is
+ * no < or >: the parser takes those for redirections.
+ * Returns 0 if it is true, 1 if it is false and 2 if it is not valid.
+ */
+int execute_test(char **words, int fds[3]) {
+	test t = { words + 1, 0, 0, 0, fds, words[0] };
+
+	while (t.args[t.n])
+		t.n++;
+	if (!strcmp(words[0], "[")) {
+		if (t.n == 0 || strcmp(t.args[t.n - 1], "]")) {
+			dprintf(fds[2], "[: missing ']'\n");
+			return 2;
+		}
+		t.n--;
+	}
+	/* No expression is false. */
+	if (t.n == 0)
+		return EXIT_FAILURE;
+
+	int result = test_or(&t);
+	if (!t.error && t.pos < t.n)
+		test_error(&t, "too many arguments", t.args[t.pos]);
+	if (t.error)
+		return 2;
+	return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
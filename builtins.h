@@ -0,0 +1,38 @@
+#ifndef __BUILTINS_H__
+#define __BUILTINS_H__
+
+/**
+ * Builtin versions of common utilities.  They run inside the shell (or in
+ * the forked copy of it that runs a pipeline stage), and do their I/O on
+ * the descriptors given in fds[0..2] (stdin, stdout, stderr), which already
+ * have the command's redirections applied.
+ */
+
+/* Copy all data from one descriptor to another, zero-copy when possible.
+ * Returns the number of bytes copied, or -1 on error. */
+long long copy_fd(int in, int out);
+
+/* Write all of a buffer, retrying short writes.  Returns -1 on error. */
+int write_all(int fd, char *buf, size_t len);
+
+/* Make a close-on-exec pipe, with the buffer size set by SHSH_PIPE_SIZE
+ * (e.g. 1M; at most /proc/sys/fs/pipe-max-size).  Returns -1 on error. */
+int make_pipe(int pfd[2]);
+
+/* cat [file...]: concatenate files (or stdin) to stdout. */
+int execute_cat(char **words, int fds[3]);
+
+/* tee [-a] [file...]: copy stdin to stdout and to every file. */
+int execute_tee(char **words, int fds[3]);
+
+/* echo [-n] [-e | -E] [word...]: write the words and a newline. */
+int execute_echo(char **words, int fds[3]);
+
+/* printf format [argument...]: write the arguments as the format says. */
+int execute_printf(char **words, int fds[3]);
+
+/* test expression, or [ expression ]: evaluate a condition.  Returns 0 if
+ * it holds, 1 if not and 2 if the expression is not valid. */
+int execute_test(char **words, int fds[3]);
+
+#endif
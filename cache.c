@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "parser.h"
+
+/**
+ * A hash table of parsed lines, chained through a list in order of use so
+ * that the least recently used line can be dropped when the cache is full.
+ */
+
+/* How many lines are kept */
+#define CACHE_SIZE 512
+
+/* Number of buckets; must be a power of two. */
+#define CACHE_BUCKETS 1024
+
+typedef struct cache_entry_t {
+	struct cache_entry_t *next;          /* In the same bucket */
+	struct cache_entry_t *newer, *older; /* In the order of use */
+	size_t hash;
+	command *cmd;
+	char **tokens;                       /* What cmd was built from */
+	char *text;                          /* What the tokens point into */
+	long long parse_ns;                  /* How long parsing it took */
+	unsigned hits;
+	size_t len;
+	char line[];                         /* The line, as it was read */
+} cache_entry;
+
+static cache_entry *buckets[CACHE_BUCKETS];
+static cache_entry *newest, *oldest;
+static size_t nentries;
+
+/* For the cache builtin */
+static unsigned long long hits, misses;
+static long long saved_ns;
+
+/* When the last line that was not found was looked up */
+static long long miss_start;
+
+/* The time, in nanoseconds. */
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* FNV-1a hash of the first len characters of a string. */
+static size_t hash_line(char *s, size_t len) {
+	size_t h = 2166136261u;
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Take an entry out of the order of use. */
+static void unlink_entry(cache_entry *e) {
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		newest = e->older;
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		oldest = e->newer;
+}
+
+/* Put an entry in front, as the most recently used. */
+static void link_newest(cache_entry *e) {
+	e->newer = NULL;
+	e->older = newest;
+	if (newest)
+		newest->newer = e;
+	else
+		oldest = e;
+	newest = e;
+}
+
+/* Drop an entry and free its tree. */
+static void drop(cache_entry *e) {
+	cache_entry **p = &buckets[e->hash & (CACHE_BUCKETS - 1)];
+	while (*p != e)
+		p = &(*p)->next;
+	*p = e->next;
+	unlink_entry(e);
+
+	release_command(e->cmd);
+	free(e->tokens);
+	free(e->text);
+	free(e);
+	nentries--;
+}
+
+/* Find the tree of a line. */
+command *cache_lookup(char *line, size_t len) {
+	long long start = now_ns();
+	size_t h = hash_line(line, len);
+	cache_entry *e;
+
+	for (e = buckets[h & (CACHE_BUCKETS - 1)]; e; e = e->next) {
+		if (e->hash == h && e->len == len && !memcmp(e->line, line, len)) {
+			if (e != newest) {
+				unlink_entry(e);
+				link_newest(e);
+			}
+			e->hits++;
+			hits++;
+			saved_ns += e->parse_ns - (now_ns() - start);
+			return e->cmd;
+		}
+	}
+	misses++;
+	miss_start = start;
+	return NULL;
+}
+
+/* Remember the tree of a line that was just parsed. */
+int cache_insert(char *line, size_t len, char *text, char **tokens,
+                 command *cmd) {
+	cache_entry *e = malloc(sizeof(cache_entry) + len + 1);
+	if (!e)
+		return -1;
+	if (nentries >= CACHE_SIZE)
+		drop(oldest);
+
+	memcpy(e->line, line, len);
+	e->line[len] = '\0';
+	e->len = len;
+	e->hash = hash_line(line, len);
+	e->cmd = cmd;
+	e->tokens = tokens;
+	e->text = text;
+	e->parse_ns = now_ns() - miss_start;
+	e->hits = 0;
+
+	size_t b = e->hash & (CACHE_BUCKETS - 1);
+	e->next = buckets[b];
+	buckets[b] = e;
+	link_newest(e);
+	nentries++;
+	return 0;
+}
+
+/**
+ * Shows how well the cache of parsed lines works, or empties it:
+ * For example: words[0] = 'cache'
+ *              words[1] = '-l'    (optional; list the lines, the most
+ *                                  recently used first)
+ *              words[1] = '-c'    (optional; forget the lines, except the
+ *                                  one being run, and the counts)
+ */
+int execute_cache(char **words) {
+	if (words == NULL ||
+		words[0] == NULL ||
+		strcmp(words[0], "cache"))
+		return EXIT_FAILURE;
+
+	if (words[1] && !strcmp(words[1], "-c")) {
+		/* The line being run is the newest; its words are still in use. */
+		while (oldest && oldest != newest)
+			drop(oldest);
+		hits = misses = 0;
+		saved_ns = 0;
+		return EXIT_SUCCESS;
+	}
+	if (words[1] && !strcmp(words[1], "-l")) {
+		cache_entry *e;
+		printf("hits\tline\n");
+		for (e = newest; e; e = e->older)
+			printf("%4u\t%s\n", e->hits, e->line);
+		return EXIT_SUCCESS;
+	}
+	if (words[1]) {
+		fprintf(stderr, "cache: usage: cache [-l | -c]\n");
+		return EXIT_FAILURE;
+	}
+
+	unsigned long long lookups = hits + misses;
+	printf("lines     %zu of %d\n", nentries, CACHE_SIZE);
+	printf("hits      %llu\n", hits);
+	printf("misses    %llu\n", misses);
+	printf("hit rate  %.1f%%\n", lookups ? 100.0 * hits / lookups : 0.0);
+	printf("saved     %.3f ms of parsing\n", saved_ns / 1e6);
+	return EXIT_SUCCESS;
+}
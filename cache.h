@@ -0,0 +1,30 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+
+#include "shell.h"
+
+/**
+ * The parsed command lines most recently run, by their raw text: a line
+ * that comes up again skips parse_line, unquote_tokens and
+ * construct_command.  The trees are kept unexpanded (expand_command makes
+ * the copy that runs), so they stay right when variables change.
+ */
+
+/* Find the tree of a line (len characters, before parsing).  Returns NULL
+ * if it is not cached; cache_insert is then expected for the same line,
+ * once it is parsed. */
+command *cache_lookup(char *line, size_t len);
+
+/* Remember the tree of a line that was looked up.  The cache takes over
+ * the tree, the tokens it was built from and the text they point into, and
+ * frees them when the line is dropped (the one least recently used goes
+ * first).  Returns -1, with nothing taken over, if out of memory. */
+int cache_insert(char *line, size_t len, char *text, char **tokens,
+                 command *cmd);
+
+/* Builtin */
+int execute_cache(char **words);
+
+#endif
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "server.h"
+
+/**
+ * Client for the shell's daemon mode (shell --listen PATH):
+ *
+ *     client [-q] SOCKET command...    run one command
+ *     client [-q] SOCKET               run each line of stdin, in turn
+ *
+ * The output of the commands is printed here (with -q it stays with the
+ * server), and the exit status is that of the last command.  The lines
+ * from stdin go over one connection, so a cd or set carries over to the
+ * lines after it.
+ */
+
+/* Send all of a buffer.  Returns -1 on error. */
+static int send_all(int fd, char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Copy len bytes of a response to a stream.  Returns -1 if it ended
+ * early. */
+static int copy_out(FILE *from, size_t len, FILE *to) {
+	char buf[65536];
+	while (len > 0) {
+		size_t n = fread(buf, 1, len < sizeof(buf) ? len : sizeof(buf), from);
+		if (n == 0)
+			return -1;
+		fwrite(buf, 1, n, to);
+		len -= n;
+	}
+	fflush(to);
+	return 0;
+}
+
+/* Send a request and print its response.  Returns the exit status of the
+ * command, or -1 if the connection failed. */
+static int request(int fd, FILE *responses, char *mode, char *text,
+                   size_t len) {
+	char header[SERVER_HEADER_MAX];
+	int n = snprintf(header, sizeof(header), "%s %zu\n", mode, len);
+	if (send_all(fd, header, n) == -1 || send_all(fd, text, len) == -1) {
+		perror("send");
+		return -1;
+	}
+
+	int status;
+	size_t out_len, err_len;
+	if (!fgets(header, sizeof(header), responses) ||
+		sscanf(header, "%d %zu %zu", &status, &out_len, &err_len) != 3 ||
+		copy_out(responses, out_len, stdout) == -1 ||
+		copy_out(responses, err_len, stderr) == -1) {
+		fprintf(stderr, "client: connection closed by the server\n");
+		return -1;
+	}
+	return status;
+}
+
+int main(int argc, char **argv) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char *mode = SERVER_CAPTURE;
+	int i = 1, status = 0;
+
+	if (argc > i && !strcmp(argv[i], "-q")) {
+		mode = SERVER_RUN;
+		i++;
+	}
+	if (argc <= i) {
+		fprintf(stderr, "usage: %s [-q] SOCKET [command...]\n", argv[0]);
+		return 2;
+	}
+	if (strlen(argv[i]) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", argv[i]);
+		return 2;
+	}
+	strcpy(addr.sun_path, argv[i++]);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror(addr.sun_path);
+		return EXIT_FAILURE;
+	}
+	FILE *responses = fdopen(fd, "r");
+	if (!responses) {
+		perror("fdopen");
+		return EXIT_FAILURE;
+	}
+
+	if (argc > i) {
+		/* The words of the command, joined by spaces */
+		size_t len = 0;
+		int j;
+		for (j = i; j < argc; ++j)
+			len += strlen(argv[j]) + 1;
+		char *text = malloc(len);
+		if (!text) {
+			perror("malloc");
+			return EXIT_FAILURE;
+		}
+		text[0] = '\0';
+		for (j = i; j < argc; ++j) {
+			strcat(text, argv[j]);
+			if (j < argc - 1)
+				strcat(text, " ");
+		}
+		status = request(fd, responses, mode, text, strlen(text));
+		free(text);
+	} else {
+		char *line = NULL;
+		size_t size = 0;
+		ssize_t len;
+		while ((len = getline(&line, &size, stdin)) != -1) {
+			if (len > 0 && line[len - 1] == '\n')
+				line[--len] = '\0';
+			status = request(fd, responses, mode, line, len);
+			if (status == -1)
+				break;
+		}
+		free(line);
+	}
+	fclose(responses);
+	return status == -1 ? EXIT_FAILURE : status;
+}
@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "complete.h"
+#include "vars.h"
+
+/**
+ * Tab completion.  Command names are looked up in a trie of the builtins
+ * and of every executable in $PATH.  The trie is built on first use and
+ * then kept up to date cheaply: before each completion, the directories
+ * in PATH are stat'ed, and only those whose mtime has changed (or that
+ * are new in PATH) are read again; the names a directory provided before
+ * are taken out and the new ones put in.  Directories are read with
+ * getdents64 in large batches, so a directory costs a few system calls
+ * plus one fstatat per entry to check that it is an executable file.
+ */
+
+/* Search path used when PATH is not set, same as execvp. */
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+/* Buffer for getdents64 */
+#define DIRENT_BUFFER (32 * 1024)
+
+/* Names that complete as commands without being in PATH: the builtins, the
+ * pin/nice/ionice prefixes and the keywords */
+static char *builtin_names[] = {
+	"bg", "break", "cache", "cat", "cd", "continue", "do", "done", "echo",
+	"elif", "else", "exit", "false", "fg", "fi", "for", "hash", "history",
+	"if", "ionice", "jobs", "nice", "parallel", "pin", "printf", "set", "tee",
+	"test", "then", "time", "true", "unset", "until", "wait", "while", NULL
+};
+
+/* A trie node: one character of a name.  Children are kept in a sorted
+ * list, so candidates come out in order. */
+typedef struct trie_node_t {
+	char c;
+	unsigned count;              /* How many sources have the name ending
+	                              * here (directories, builtins) */
+	struct trie_node_t *child, *next;
+} trie_node;
+
+/* A directory in PATH, with the executables it had when last read */
+typedef struct path_dir_t {
+	char *path;
+	struct timespec mtime;
+	int scanned;
+	char **names;
+	size_t nnames;
+} path_dir;
+
+static trie_node root;
+static int have_builtins;
+static char *cached_path;        /* The PATH the directories came from */
+static path_dir *dirs;
+static size_t ndirs;
+
+/* Add delta to the count of a name in the trie, adding nodes as needed. */
+static void trie_add(char *name, int delta) {
+	trie_node *node = &root;
+	for (; *name; name++) {
+		trie_node **link = &node->child;
+		while (*link && (*link)->c < *name)
+			link = &(*link)->next;
+		if (!*link || (*link)->c != *name) {
+			trie_node *n = calloc(1, sizeof(trie_node));
+			if (!n)
+				return;
+			n->c = *name;
+			n->next = *link;
+			*link = n;
+		}
+		node = *link;
+	}
+	node->count += delta;
+}
+
+/* Find the node for a prefix, or NULL if no name starts with it. */
+static trie_node *trie_find(char *prefix, size_t len) {
+	trie_node *node = &root;
+	size_t i;
+	for (i = 0; i < len && node; i++) {
+		for (node = node->child; node && node->c != prefix[i];
+		     node = node->next)
+			;
+	}
+	return node;
+}
+
+/* Add a candidate (a copy of len bytes of name, plus a suffix). */
+static void add_candidate(completions *c, char *name, size_t len,
+                          char *suffix) {
+	if (c->count == c->capacity) {
+		size_t newcap = c->capacity ? 2 * c->capacity : 64;
+		char **grown = realloc(c->names, newcap * sizeof(char*));
+		if (!grown)
+			return;
+		c->names = grown;
+		c->capacity = newcap;
+	}
+	size_t slen = strlen(suffix);
+	char *s = malloc(len + slen + 1);
+	if (!s)
+		return;
+	memcpy(s, name, len);
+	memcpy(s + len, suffix, slen + 1);
+	c->names[c->count++] = s;
+}
+
+/* Collect every name below a node; buf holds the name so far. */
+static void trie_collect(trie_node *node, char **buf, size_t len,
+                         size_t *size, completions *c) {
+	if (node->count > 0)
+		add_candidate(c, *buf, len, "");
+	for (node = node->child; node; node = node->next) {
+		if (len + 1 >= *size) {
+			char *grown = realloc(*buf, *size * 2);
+			if (!grown)
+				return;
+			*buf = grown;
+			*size *= 2;
+		}
+		(*buf)[len] = node->c;
+		trie_collect(node, buf, len + 1, size, c);
+	}
+}
+
+/**
+ * Read a directory with getdents64, calling fn for each entry (other than
+ * . and ..) whose name starts with prefix.  Returns -1 if it can't be
+ * opened.
+ */
+static int scan_dir(char *path, char *prefix, size_t plen,
+                    void (*fn)(int dirfd, struct dirent64 *d, void *arg),
+                    void *arg) {
+	int fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	char *buf = malloc(DIRENT_BUFFER);
+	ssize_t n;
+	while (buf && (n = getdents64(fd, buf, DIRENT_BUFFER)) > 0) {
+		ssize_t off;
+		for (off = 0; off < n; ) {
+			struct dirent64 *d = (struct dirent64*)(buf + off);
+			off += d->d_reclen;
+			if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+				continue;
+			if (!strncmp(d->d_name, prefix, plen))
+				fn(fd, d, arg);
+		}
+	}
+	free(buf);
+	close(fd);
+	return 0;
+}
+
+/* Remember an entry of a PATH directory if it is an executable file. */
+static void add_executable(int dirfd, struct dirent64 *d, void *arg) {
+	path_dir *dir = arg;
+	struct stat st;
+
+	if (d->d_type != DT_REG && d->d_type != DT_LNK && d->d_type != DT_UNKNOWN)
+		return;
+	if (fstatat(dirfd, d->d_name, &st, 0) == -1 ||
+		!S_ISREG(st.st_mode) || !(st.st_mode & 0111))
+		return;
+
+	if ((dir->nnames & (dir->nnames - 1)) == 0) {
+		/* The array doubles whenever the count reaches a power of 2. */
+		size_t newcap = dir->nnames ? 2 * dir->nnames : 16;
+		char **grown = realloc(dir->names, newcap * sizeof(char*));
+		if (!grown)
+			return;
+		dir->names = grown;
+	}
+	char *name = strdup(d->d_name);
+	if (name)
+		dir->names[dir->nnames++] = name;
+}
+
+/* Take a directory's names out of the trie and forget them. */
+static void forget_dir(path_dir *dir) {
+	size_t i;
+	for (i = 0; i < dir->nnames; i++) {
+		trie_add(dir->names[i], -1);
+		free(dir->names[i]);
+	}
+	free(dir->names);
+	dir->names = NULL;
+	dir->nnames = 0;
+	dir->scanned = 0;
+}
+
+/* Follow changes to PATH: keep the directories that are still in it, and
+ * forget the others. */
+static void update_path(void) {
+	char *path = var_get("PATH");
+	if (!path)
+		path = DEFAULT_PATH;
+	if (cached_path && !strcmp(cached_path, path))
+		return;
+
+	/* Split the new PATH, reusing what we know about each directory. */
+	size_t n = 1, i, j;
+	char *p;
+	for (p = path; *p; p++)
+		n += (*p == ':');
+	path_dir *newdirs = calloc(n, sizeof(path_dir));
+	char *copy = strdup(path);
+	if (!newdirs || !copy) {
+		free(newdirs);
+		free(copy);
+		return;
+	}
+
+	char *dir = path;
+	for (i = 0; i < n; i++) {
+		char *end = strchrnul(dir, ':');
+		for (j = 0; j < ndirs; j++) {
+			if (dirs[j].path && strlen(dirs[j].path) == (size_t)(end - dir) &&
+				!strncmp(dirs[j].path, dir, end - dir)) {
+				newdirs[i] = dirs[j];
+				dirs[j].path = NULL;
+				break;
+			}
+		}
+		if (j == ndirs)
+			newdirs[i].path = strndup(dir, end - dir);
+		dir = end + 1;
+	}
+
+	for (j = 0; j < ndirs; j++) {
+		if (dirs[j].path) {
+			forget_dir(&dirs[j]);
+			free(dirs[j].path);
+		}
+	}
+	free(dirs);
+	dirs = newdirs;
+	ndirs = n;
+	free(cached_path);
+	cached_path = copy;
+}
+
+/* Bring the trie up to date with the directories in PATH. */
+static void refresh_commands(void) {
+	size_t i;
+
+	if (!have_builtins) {
+		for (i = 0; builtin_names[i]; i++)
+			trie_add(builtin_names[i], 1);
+		have_builtins = 1;
+	}
+	update_path();
+
+	for (i = 0; i < ndirs; i++) {
+		path_dir *dir = &dirs[i];
+		struct stat st;
+		if (!dir->path)
+			continue;
+		if (stat(*dir->path ? dir->path : ".", &st) == -1) {
+			if (dir->scanned)
+				forget_dir(dir);
+			continue;
+		}
+		if (dir->scanned && st.st_mtim.tv_sec == dir->mtime.tv_sec &&
+			st.st_mtim.tv_nsec == dir->mtime.tv_nsec)
+			continue;
+
+		/* New or changed: read it again. */
+		forget_dir(dir);
+		scan_dir(dir->path, "", 0, add_executable, dir);
+		size_t j;
+		for (j = 0; j < dir->nnames; j++)
+			trie_add(dir->names[j], 1);
+		dir->mtime = st.st_mtim;
+		dir->scanned = 1;
+	}
+}
+
+/* Complete a command name from the trie. */
+static void complete_command(char *word, size_t len, completions *c) {
+	refresh_commands();
+	trie_node *node = trie_find(word, len);
+	if (!node)
+		return;
+
+	size_t size = len + 64;
+	char *buf = malloc(size);
+	if (!buf)
+		return;
+	memcpy(buf, word, len);
+	trie_collect(node, &buf, len, &size, c);
+	free(buf);
+}
+
+/* What a file name completion needs to know while scanning */
+typedef struct file_scan_t {
+	completions *c;
+	char *dir;               /* The directory part of the word */
+	size_t dirlen;
+	int hidden;              /* Whether to include dot files */
+} file_scan;
+
+/* Add a directory entry as a candidate (with a / for directories). */
+static void add_file(int dirfd, struct dirent64 *d, void *arg) {
+	file_scan *scan = arg;
+	int is_dir = d->d_type == DT_DIR;
+	struct stat st;
+
+	if (d->d_name[0] == '.' && !scan->hidden)
+		return;
+	if (d->d_type == DT_LNK || d->d_type == DT_UNKNOWN)
+		is_dir = fstatat(dirfd, d->d_name, &st, 0) == 0 &&
+		         S_ISDIR(st.st_mode);
+
+	size_t nlen = strlen(d->d_name);
+	char *name = malloc(scan->dirlen + nlen + 1);
+	if (!name)
+		return;
+	memcpy(name, scan->dir, scan->dirlen);
+	memcpy(name + scan->dirlen, d->d_name, nlen + 1);
+	add_candidate(scan->c, name, scan->dirlen + nlen, is_dir ? "/" : "");
+	free(name);
+}
+
+/* Order candidates by name, for listing. */
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char**)a, *(char**)b);
+}
+
+/* Complete a file name, reading its directory once. */
+static void complete_file(char *word, size_t len, completions *c) {
+	char *slash = memrchr(word, '/', len);
+	size_t dirlen = slash ? (size_t)(slash - word + 1) : 0;
+	char *dir = strndup(word, dirlen);
+	char *prefix = word + dirlen;
+	size_t plen = len - dirlen;
+	if (!dir)
+		return;
+
+	/* Hidden files only show up when asked for. */
+	file_scan scan = { c, dir, dirlen, plen > 0 && *prefix == '.' };
+	scan_dir(dir, prefix, plen, add_file, &scan);
+	free(dir);
+	qsort(c->names, c->count, sizeof(char*), compare_names);
+}
+
+/* Find the completions of the last word of a line. */
+size_t complete_word(char *line, size_t len, completions *c) {
+	size_t start = len;
+	memset(c, 0, sizeof(*c));
+
+	while (start > 0 && line[start - 1] != ' ' && line[start - 1] != '\t')
+		start--;
+	c->word_start = start;
+
+	/* It names a command if it comes first, or after an operator. */
+	size_t before = start;
+	while (before > 0 && (line[before - 1] == ' ' || line[before - 1] == '\t'))
+		before--;
+	int command = before == 0 || strchr("|&;", line[before - 1]) ||
+	              (before >= 4 && !strncmp(line + before - 4, "time", 4) &&
+	               (before == 4 || line[before - 5] == ' '));
+
+	if (command && !memchr(line + start, '/', len - start))
+		complete_command(line + start, len - start, c);
+	else
+		complete_file(line + start, len - start, c);
+	return c->count;
+}
+
+/* Release the candidates. */
+void completions_free(completions *c) {
+	size_t i;
+	for (i = 0; i < c->count; i++)
+		free(c->names[i]);
+	free(c->names);
+	memset(c, 0, sizeof(*c));
+}
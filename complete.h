@@ -0,0 +1,21 @@
+#ifndef __COMPLETE_H__
+#define __COMPLETE_H__
+
+#include <stddef.h>
+
+/* The candidates for completing the word at the end of a line */
+typedef struct completions_t {
+	char **names;            /* Whole words, sorted; directories end in / */
+	size_t count, capacity;
+	size_t word_start;       /* Where the word begins in the line */
+} completions;
+
+/* Find the completions of the last word of a line: a command name (from
+ * the builtins and $PATH) if it is in command position, otherwise a file
+ * name.  Returns the number of candidates. */
+size_t complete_word(char *line, size_t len, completions *c);
+
+/* Release the candidates. */
+void completions_free(completions *c);
+
+#endif
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "vars.h"
+
+/**
+ * A table from command names to the absolute path they resolved to in
+ * $PATH, filled the first time each name is used.  Names that were not
+ * found are cached too (with a NULL path), so a missing command costs one
+ * PATH walk instead of one per attempt.
+ */
+
+/* Search path used when PATH is not set, same as execvp. */
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+/* Initial number of buckets; must be a power of two. */
+#define INITIAL_BUCKETS 64
+
+typedef struct hash_entry_t {
+	char *name;
+	char *path;                 /* NULL if the command was not found */
+	unsigned hits;
+	struct hash_entry_t *next;
+} hash_entry;
+
+static hash_entry **buckets;
+static size_t nbuckets, nentries;
+
+/* Whether the PATH that filled the table has relative entries, in which
+ * case the results depend on the current directory. */
+static int relative_path;
+
+/* FNV-1a hash of a string. */
+static size_t hash_string(char *s) {
+	size_t h = 2166136261u;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Double the number of buckets and rehash all the entries. */
+static void grow(void) {
+	size_t newsize = nbuckets ? nbuckets * 2 : INITIAL_BUCKETS;
+	hash_entry **newbuckets = calloc(newsize, sizeof(hash_entry*));
+	if (!newbuckets)
+		return;
+
+	size_t i;
+	for (i = 0; i < nbuckets; ++i) {
+		hash_entry *e = buckets[i], *next;
+		for (; e; e = next) {
+			next = e->next;
+			size_t b = hash_string(e->name) & (newsize - 1);
+			e->next = newbuckets[b];
+			newbuckets[b] = e;
+		}
+	}
+	free(buckets);
+	buckets = newbuckets;
+	nbuckets = newsize;
+}
+
+/* Walk $PATH looking for an executable called name. */
+static char *search_path(char *name) {
+	char *path = var_get("PATH");
+	if (!path)
+		path = DEFAULT_PATH;
+
+	size_t namelen = strlen(name);
+	char *dir = path;
+	while (1) {
+		char *end = strchrnul(dir, ':');
+		size_t dirlen = end - dir;
+		char *full = malloc(dirlen + namelen + 2);
+		if (!full)
+			return NULL;
+
+		/* An empty entry means the current directory. */
+		if (dirlen == 0 || *dir != '/')
+			relative_path = 1;
+		if (dirlen) {
+			memcpy(full, dir, dirlen);
+			full[dirlen++] = '/';
+		}
+		memcpy(full + dirlen, name, namelen + 1);
+
+		struct stat st;
+		if (stat(full, &st) == 0 && S_ISREG(st.st_mode) &&
+			access(full, X_OK) == 0)
+			return full;
+		free(full);
+
+		if (!*end)
+			return NULL;
+		dir = end + 1;
+	}
+}
+
+/* Resolve a command name to the path to execute, using the PATH cache. */
+char *hash_lookup(char *name) {
+	if (strchr(name, '/'))
+		return name;
+
+	size_t h = hash_string(name);
+	hash_entry *e;
+	if (nbuckets) {
+		for (e = buckets[h & (nbuckets - 1)]; e; e = e->next) {
+			if (!strcmp(e->name, name)) {
+				e->hits++;
+				return e->path;
+			}
+		}
+	}
+
+	/* Not cached yet: search PATH and remember the result. */
+	char *path = search_path(name);
+	if (nentries >= nbuckets)
+		grow();
+	e = malloc(sizeof(hash_entry));
+	if (!e || !nbuckets || !(e->name = strdup(name))) {
+		/* Out of memory: still hand back the result, just don't cache it. */
+		free(e);
+		return path;
+	}
+	e->path = path;
+	e->hits = 1;
+	size_t b = h & (nbuckets - 1);
+	e->next = buckets[b];
+	buckets[b] = e;
+	nentries++;
+	return path;
+}
+
+/* Drop the cached entry for a command name. */
+int hash_forget(char *name) {
+	if (!nbuckets)
+		return 0;
+
+	hash_entry **p = &buckets[hash_string(name) & (nbuckets - 1)];
+	for (; *p; p = &(*p)->next) {
+		if (!strcmp((*p)->name, name)) {
+			hash_entry *e = *p;
+			*p = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
+			nentries--;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Empty the cache. */
+void hash_clear(void) {
+	size_t i;
+	for (i = 0; i < nbuckets; ++i) {
+		hash_entry *e = buckets[i], *next;
+		for (; e; e = next) {
+			next = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
+		}
+		buckets[i] = NULL;
+	}
+	nentries = 0;
+	relative_path = 0;
+}
+
+/* Empty the cache if the PATH it was filled from has relative entries. */
+void hash_cwd_changed(void) {
+	if (relative_path)
+		hash_clear();
+}
+
+/* Print the cached commands, with the number of times each was used. */
+void hash_print(void) {
+	if (!nentries) {
+		printf("hash: hash table empty\n");
+		return;
+	}
+
+	printf("hits\tcommand\n");
+	size_t i;
+	for (i = 0; i < nbuckets; ++i) {
+		hash_entry *e;
+		for (e = buckets[i]; e; e = e->next) {
+			if (e->path)
+				printf("%4u\t%s\n", e->hits, e->path);
+			else
+				printf("%4u\t%s (not found)\n", e->hits, e->name);
+		}
+	}
+}
@@ -0,0 +1,20 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+/* Resolve a command name to the path to execute, using the PATH cache.
+ * Names containing a slash are returned as they are; NULL if not found. */
+char *hash_lookup(char *name);
+
+/* Drop the cached entry for a command name. Returns 1 if there was one. */
+int hash_forget(char *name);
+
+/* Empty the cache, e.g. after PATH has changed. */
+void hash_clear(void);
+
+/* Empty the cache if PATH has relative entries (called after a cd). */
+void hash_cwd_changed(void);
+
+/* Print the cached commands, with the number of times each was used. */
+void hash_print(void);
+
+#endif
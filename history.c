@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "history.h"
+#include "builtins.h"
+#include "vars.h"
+
+/**
+ * Command history, shared by all the user's shells through one file
+ * ($SHSH_HISTFILE, or ~/.shsh_history).  Each line is appended with a
+ * single write on an O_APPEND descriptor, so shells running at the same
+ * time interleave whole lines.  Nothing is read at startup: the first
+ * 'history' command maps the file, together with an index of where every
+ * line starts (the same name with .idx added).  The index only covers a
+ * prefix of the file, and lines added after it (by any shell) are found by
+ * scanning just that tail; when the tail gets long, the index is rewritten
+ * (to a temporary file, renamed over the old one).
+ */
+
+/* Lines past the end of the index before it is rewritten */
+#define INDEX_SLACK 1024
+
+/* Size of the output buffer of the history builtin */
+#define OUTPUT_BUFFER (64 * 1024)
+
+#define INDEX_MAGIC "SHSHIDX1"
+
+typedef struct index_header_t {
+	char magic[8];
+	uint64_t covered;        /* Bytes of the history file indexed */
+	uint64_t count;          /* Offsets that follow */
+} index_header;
+
+static char *hist_path;          /* NULL until first needed */
+static int hist_fd = -1;         /* For appending */
+
+static char *map;                /* The history file, up to covered */
+static size_t map_size;
+static size_t covered;           /* Bytes of complete lines in map */
+
+static void *index_map;          /* The index file */
+static size_t index_size;
+static uint64_t *indexed;        /* Line offsets from the index file */
+static size_t nindexed;
+
+static uint64_t *tail;           /* Line offsets found after the index */
+static size_t ntail, tail_capacity;
+static size_t nsaved;            /* Of those, how many were last saved */
+
+/* Work out where the history lives. Returns NULL if there is nowhere. */
+static char *history_path(void) {
+	if (hist_path)
+		return hist_path;
+
+	char *file = var_get("SHSH_HISTFILE");
+	if (file && *file) {
+		hist_path = strdup(file);
+	} else {
+		char *home = var_get("HOME");
+		if (!home || asprintf(&hist_path, "%s/.shsh_history", home) == -1)
+			hist_path = NULL;
+	}
+	return hist_path;
+}
+
+/* Add a command line to the history file. */
+void history_add(char *line, size_t len) {
+	if (len == 0 || !history_path())
+		return;
+	if (hist_fd == -1) {
+		hist_fd = open(hist_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+		               0600);
+		if (hist_fd == -1)
+			return;
+	}
+
+	/* One write, so that the line stays in one piece. */
+	struct iovec iov[2] = { { line, len }, { "\n", 1 } };
+	if (writev(hist_fd, iov, 2) == -1)
+		return;
+}
+
+/* Forget the mapped index (e.g. if it doesn't match the file). */
+static void drop_index(void) {
+	if (index_map)
+		munmap(index_map, index_size);
+	index_map = NULL;
+	indexed = NULL;
+	nindexed = 0;
+}
+
+/* Map the index file, if there is a valid one. */
+static void load_index(char *path, size_t file_size) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1)
+		return;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(index_header)) {
+		index_size = st.st_size;
+		index_map = mmap(NULL, index_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (index_map == MAP_FAILED)
+			index_map = NULL;
+	}
+	close(fd);
+	if (!index_map)
+		return;
+
+	index_header *h = index_map;
+	if (memcmp(h->magic, INDEX_MAGIC, 8) || h->covered > file_size ||
+		index_size != sizeof(index_header) + h->count * sizeof(uint64_t)) {
+		drop_index();
+		return;
+	}
+	indexed = (uint64_t*)(h + 1);
+	nindexed = h->count;
+}
+
+/* Write the index for everything found so far, replacing the old one. */
+static void save_index(char *path) {
+	char *tmp;
+	if (asprintf(&tmp, "%s.%d", path, (int)getpid()) == -1)
+		return;
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd != -1) {
+		index_header h;
+		memcpy(h.magic, INDEX_MAGIC, 8);
+		h.covered = covered;
+		h.count = nindexed + ntail;
+		int ok = write_all(fd, (char*)&h, sizeof(h)) == 0 &&
+			write_all(fd, (char*)indexed, nindexed * sizeof(uint64_t)) == 0 &&
+			write_all(fd, (char*)tail, ntail * sizeof(uint64_t)) == 0;
+		close(fd);
+		if (!ok || rename(tmp, path) == -1)
+			unlink(tmp);
+	}
+	free(tmp);
+}
+
+/* Note where a line starts. */
+static int add_offset(uint64_t offset) {
+	if (ntail == tail_capacity) {
+		size_t newcap = tail_capacity ? 2 * tail_capacity : INDEX_SLACK;
+		uint64_t *grown = realloc(tail, newcap * sizeof(uint64_t));
+		if (!grown)
+			return -1;
+		tail = grown;
+		tail_capacity = newcap;
+	}
+	tail[ntail++] = offset;
+	return 0;
+}
+
+/**
+ * Bring the view of the history up to date: map the file as it is now, and
+ * find the lines that were added since it was last looked at (or since the
+ * index was written).  Returns -1 if there is no history.
+ */
+static int history_load(void) {
+	if (!history_path())
+		return -1;
+
+	int fd = open(hist_path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	size_t size = st.st_size;
+	if (map && size == map_size) {
+		close(fd);
+		return 0;
+	}
+
+	char *index_path = NULL;
+	if (asprintf(&index_path, "%s.idx", hist_path) == -1)
+		index_path = NULL;
+	if (!map && index_path)
+		load_index(index_path, size);
+
+	/* Map the file as it is now. */
+	if (map)
+		munmap(map, map_size);
+	map = NULL;
+	map_size = 0;
+	if (size > 0) {
+		map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			map = NULL;
+	}
+	close(fd);
+	if (!map) {
+		drop_index();
+		ntail = nsaved = covered = 0;
+		free(index_path);
+		return size > 0 ? -1 : 0;
+	}
+	map_size = size;
+
+	/* If the file was cut short or replaced, start from scratch. */
+	if (!covered && index_map)
+		covered = ((index_header*)index_map)->covered;
+	if (covered > size || (covered && map[covered - 1] != '\n')) {
+		drop_index();
+		ntail = nsaved = covered = 0;
+	}
+
+	/* Index the complete lines after what we have seen. */
+	size_t start = covered;
+	char *nl;
+	while (start < size && (nl = memchr(map + start, '\n', size - start))) {
+		if (add_offset(start) == -1)
+			break;
+		start = nl - map + 1;
+	}
+	covered = start;
+
+	if (ntail >= nsaved + INDEX_SLACK && index_path) {
+		save_index(index_path);
+		nsaved = ntail;
+	}
+	free(index_path);
+	return 0;
+}
+
+/* Number of lines in the history. */
+static size_t history_count(void) {
+	return nindexed + ntail;
+}
+
+/* Find line i (from 0): where it starts and how long it is. */
+static char *history_entry(size_t i, size_t *len) {
+	uint64_t start = i < nindexed ? indexed[i] : tail[i - nindexed];
+	uint64_t end = i + 1 < history_count() ?
+		(i + 1 < nindexed ? indexed[i + 1] : tail[i + 1 - nindexed]) : covered;
+	*len = end - start - 1;
+	return map + start;
+}
+
+/* Number of lines in the history, as it is now (see history.h). */
+size_t history_lines(void) {
+	return history_load() == -1 ? 0 : history_count();
+}
+
+/* Line i of the history (see history.h). */
+char *history_line(size_t i, size_t *len) {
+	return history_entry(i, len);
+}
+
+/* Search the history backwards from a line (see history.h). */
+long history_find(char *text, size_t n, size_t before) {
+	size_t i, len;
+	for (i = before; i-- > 0; ) {
+		char *line = history_entry(i, &len);
+		if (memmem(line, len, text, n))
+			return i;
+	}
+	return -1;
+}
+
+/* A buffered writer for the output of the builtin. */
+typedef struct output_t {
+	int fd;
+	size_t len;
+	char buf[OUTPUT_BUFFER];
+} output;
+
+/* Write out what has been buffered. */
+static void output_flush(output *out) {
+	if (out->len)
+		write_all(out->fd, out->buf, out->len);
+	out->len = 0;
+}
+
+/* Print one history entry, with its number. */
+static void print_entry(output *out, size_t i) {
+	size_t len;
+	char *line = history_entry(i, &len);
+	if (out->len + len + 32 > OUTPUT_BUFFER) {
+		output_flush(out);
+		if (len + 32 > OUTPUT_BUFFER) {
+			dprintf(out->fd, "%6zu  %.*s\n", i + 1, (int)len, line);
+			return;
+		}
+	}
+	out->len += sprintf(out->buf + out->len, "%6zu  ", i + 1);
+	memcpy(out->buf + out->len, line, len);
+	out->len += len;
+	out->buf[out->len++] = '\n';
+}
+
+/* Clear the history, for every shell. */
+static int history_clear(int fds[3]) {
+	char *index_path;
+	if (!history_path())
+		return EXIT_SUCCESS;
+	if (truncate(hist_path, 0) == -1 && errno != ENOENT) {
+		dprintf(fds[2], "history: %s: %s\n", hist_path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (asprintf(&index_path, "%s.idx", hist_path) != -1) {
+		unlink(index_path);
+		free(index_path);
+	}
+	drop_index();
+	if (map)
+		munmap(map, map_size);
+	map = NULL;
+	map_size = covered = ntail = nsaved = 0;
+	return EXIT_SUCCESS;
+}
+
+/* Shows, searches or clears the history:
+ * For example: words[0] = 'history'
+ *              words[1] = '-s'      (optional: search for...)
+ *              words[2] = 'make'    (...lines containing this)
+ *              words[3] = '20'      (optional: at most this many)
+ */
+int execute_history(char **words, int fds[3]) {
+	char *pattern = NULL;
+	size_t limit = (size_t)-1, i, n;
+
+	if (words[1] && !strcmp(words[1], "-c"))
+		return history_clear(fds);
+	if (words[1] && !strcmp(words[1], "-s")) {
+		if (!words[2]) {
+			dprintf(fds[2], "history: -s: missing text to search for\n");
+			return 2;
+		}
+		pattern = words[2];
+		words += 2;
+	}
+	if (words[1])
+		limit = strtoul(words[1], NULL, 10);
+
+	if (history_load() == -1)
+		return EXIT_SUCCESS;
+	n = history_count();
+
+	output *out = malloc(sizeof(output));
+	if (!out) {
+		dprintf(fds[2], "history: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	out->fd = fds[1];
+	out->len = 0;
+
+	if (pattern) {
+		/* Newest first, like a reverse search. */
+		size_t plen = strlen(pattern), found = 0;
+		for (i = n; i-- > 0 && found < limit; ) {
+			size_t len;
+			char *line = history_entry(i, &len);
+			if (memmem(line, len, pattern, plen)) {
+				print_entry(out, i);
+				found++;
+			}
+		}
+	} else {
+		for (i = n > limit ? n - limit : 0; i < n; i++)
+			print_entry(out, i);
+	}
+	output_flush(out);
+	free(out);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,27 @@
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <stddef.h>
+
+/* Add a command line to the history file (shared by all shells of the
+ * user), if it isn't empty. */
+void history_add(char *line, size_t len);
+
+/* For the line editor: the number of lines in the history, brought up to
+ * date first (0 if there is none). */
+size_t history_lines(void);
+
+/* Line i of the history (from 0, the oldest), with its length; i must be
+ * below what history_lines last returned.  The text is not NUL-terminated
+ * and is only valid until the history is brought up to date again. */
+char *history_line(size_t i, size_t *len);
+
+/* The newest line before line 'before' that contains text, or -1. */
+long history_find(char *text, size_t n, size_t before);
+
+/* history [n]: list the history (or the last n entries);
+ * history -s text [n]: search it, newest first;
+ * history -c: clear it. */
+int execute_history(char **words, int fds[3]);
+
+#endif
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "input.h"
+
+/* Size of the reads from the input; the buffer doubles if a line is longer. */
+#define INPUT_CHUNK (64 * 1024)
+
+/* Read command lines from a file descriptor. */
+void input_from_fd(input *in, int fd) {
+	in->fd = fd;
+	in->buf = NULL;
+	in->start = in->end = in->size = 0;
+	in->eof = 0;
+}
+
+/* Read command lines from a string. */
+int input_from_string(input *in, char *s) {
+	size_t len = strlen(s);
+	input_from_fd(in, -1);
+	in->buf = malloc(len + 1);
+	if (!in->buf)
+		return -1;
+	memcpy(in->buf, s, len + 1);
+	in->end = in->size = len;
+	in->eof = 1;
+	return 0;
+}
+
+/**
+ * Read more data into the buffer, after moving what is left to the front
+ * (and growing the buffer if it is still too full to take a whole chunk).
+ * Returns the number of bytes read, 0 at EOF and -1 on error.
+ */
+static ssize_t fill(input *in) {
+	if (in->start > 0) {
+		memmove(in->buf, in->buf + in->start, in->end - in->start);
+		in->end -= in->start;
+		in->start = 0;
+	}
+
+	/* Keep one byte spare to terminate the last line. */
+	if (in->size - in->end < INPUT_CHUNK + 1) {
+		size_t newsize = in->size ? in->size : INPUT_CHUNK + 1;
+		while (newsize - in->end < INPUT_CHUNK + 1)
+			newsize *= 2;
+		char *newbuf = realloc(in->buf, newsize);
+		if (!newbuf)
+			return -1;
+		in->buf = newbuf;
+		in->size = newsize;
+	}
+
+	ssize_t n;
+	do {
+		n = read(in->fd, in->buf + in->end, in->size - in->end - 1);
+	} while (n == -1 && errno == EINTR);
+	if (n > 0)
+		in->end += n;
+	else
+		in->eof = 1;
+	return n;
+}
+
+/* Get the next line, without its newline. */
+char *input_read_line(input *in, size_t *len) {
+	size_t scanned = in->start;
+	char *nl;
+
+	while (!(nl = scanned < in->end ?
+	         memchr(in->buf + scanned, '\n', in->end - scanned) : NULL)) {
+		if (in->eof) {
+			/* The last line may have no newline at all. */
+			if (in->start == in->end)
+				return NULL;
+			nl = in->buf + in->end;
+			break;
+		}
+		/* Don't scan the same bytes again after the buffer moves. */
+		scanned = in->end - in->start;
+		if (fill(in) == -1) {
+			perror("read");
+			return NULL;
+		}
+		/* fill() moved the unconsumed data to the front */
+		scanned += in->start;
+	}
+
+	char *line = in->buf + in->start;
+	*nl = '\0';
+	*len = nl - line;
+	in->start = (nl - in->buf) + (nl < in->buf + in->end);
+	return line;
+}
+
+/* Release the input's buffer and close its descriptor. */
+void input_close(input *in) {
+	if (in->fd > 0)
+		close(in->fd);
+	free(in->buf);
+	in->buf = NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef __INPUT_H__
+#define __INPUT_H__
+
+#include <stddef.h>
+
+/**
+ * A source of command lines: a file descriptor that is read in large
+ * chunks, or a string (for -c).  Lines are split out of the buffer in
+ * place, so reading a line costs no copy.
+ */
+typedef struct input_t {
+	int fd;                  /* Descriptor to read from, -1 for a string */
+	char *buf;               /* Data read but not consumed yet */
+	size_t start, end, size; /* Unconsumed data is buf[start..end) */
+	int eof;                 /* Nothing more to read from fd */
+} input;
+
+/* Read command lines from a file descriptor. */
+void input_from_fd(input *in, int fd);
+
+/* Read command lines from a string. Returns -1 if out of memory. */
+int input_from_string(input *in, char *s);
+
+/* Get the next line, without its newline. The line is valid until the
+ * next call; NULL at the end of the input (or on a read error). */
+char *input_read_line(input *in, size_t *len);
+
+/* Release the input's buffer and close its descriptor (if not stdin). */
+void input_close(input *in);
+
+#endif
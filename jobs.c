@@ -0,0 +1,586 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "jobs.h"
+#include "parser.h"
+#include "trace.h"
+
+/**
+ * The job table.  Background jobs (and stopped foreground jobs) are kept
+ * here until they finish and have been reported.  SIGCHLD is blocked and
+ * read from a signalfd instead, so between commands the shell only has
+ * to call waitpid when a child has actually changed state.  Foreground
+ * commands are always waited for by pid, so they are never mistaken for
+ * a background job (or the other way around).
+ */
+
+/* States of a job, and of each of its processes */
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_DONE    2
+
+/* Finished jobs kept around for 'wait'/'jobs' when nobody is told about
+ * them (non-interactive shells); beyond this, the oldest are forgotten. */
+#define MAX_DONE_JOBS 1024
+
+typedef struct job_t {
+	int id;
+	pid_t pgid;              /* -1 if in the shell's process group */
+	pid_t *pids;
+	int *states;             /* State of each process */
+	int npids;
+	int status;              /* Exit status of the last process */
+	int notified;            /* Whether the current state was reported */
+	char *text;              /* The command, for listing */
+	struct job_t *next;
+} job;
+
+static job *jobs;                /* The table, in order of job number */
+static int ndone;                /* Number of finished jobs in the table */
+static int sigfd = -1;           /* Where SIGCHLD arrives */
+static int job_control;          /* Whether jobs get their own process groups */
+static int interactive_shell;
+static pid_t shell_pgid;
+static int tty = -1;
+
+/* Where the resources used by reaped children are added up, for 'time' */
+static struct rusage *usage;
+
+/* Signals the interactive shell ignores, but its children must not. */
+static int job_signals[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU };
+#define NJOB_SIGNALS (sizeof(job_signals) / sizeof(int))
+
+/* Set up the job table and the SIGCHLD reaper. */
+void jobs_init(int interactive) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigfd == -1)
+		perror("signalfd");
+
+	interactive_shell = interactive;
+	if (!interactive || !isatty(fileno(stdin)))
+		return;
+
+	/* Wait until we are in the foreground, then take our own process
+	 * group and the terminal. */
+	tty = fileno(stdin);
+	while (tcgetpgrp(tty) != (shell_pgid = getpgrp()))
+		kill(-shell_pgid, SIGTTIN);
+
+	unsigned i;
+	for (i = 0; i < NJOB_SIGNALS; ++i)
+		signal(job_signals[i], SIG_IGN);
+
+	shell_pgid = getpid();
+	if (setpgid(shell_pgid, shell_pgid) == -1 && errno != EPERM) {
+		perror("setpgid");
+		return;
+	}
+	tcsetpgrp(tty, shell_pgid);
+	job_control = 1;
+}
+
+/* Prepare a process group for a new job. */
+process_group *job_group(process_group *group, int foreground) {
+	if (!job_control)
+		return NULL;
+	group->pgid = 0;
+	group->foreground = foreground;
+	return group;
+}
+
+/* Set up the signals and process group of a forked child. */
+void job_child_setup(process_group *group) {
+	if (group) {
+		setpgid(0, group->pgid);
+		/* SIGTTOU is still ignored, so we may take the terminal. */
+		if (group->foreground)
+			tcsetpgrp(tty, getpgrp());
+	}
+
+	/* The child is not the shell: it has no jobs of its own, and gets
+	 * the default signal handling back. */
+	unsigned i;
+	for (i = 0; i < NJOB_SIGNALS; ++i)
+		signal(job_signals[i], SIG_DFL);
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	if (sigfd != -1)
+		close(sigfd);
+	sigfd = -1;
+	jobs = NULL;
+	ndone = 0;
+	job_control = 0;
+	interactive_shell = 0;
+}
+
+/* Set up the spawn attributes for a process launched with posix_spawn. */
+void job_spawn_setup(posix_spawnattr_t *attr,
+                     posix_spawn_file_actions_t *actions, process_group *group) {
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	sigset_t mask;
+	unsigned i;
+
+	/* Unblock SIGCHLD and reset the signals we ignore. */
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(attr, &mask);
+	for (i = 0; i < NJOB_SIGNALS; ++i)
+		sigaddset(&mask, job_signals[i]);
+	posix_spawnattr_setsigdefault(attr, &mask);
+
+	if (group) {
+		flags |= POSIX_SPAWN_SETPGROUP;
+		posix_spawnattr_setpgroup(attr, group->pgid);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+		/* Hand over the terminal in the child, before it can read it. */
+		if (group->foreground)
+			posix_spawn_file_actions_addtcsetpgrp_np(actions, tty);
+#endif
+	}
+	posix_spawnattr_setflags(attr, flags);
+}
+
+/* Record in the parent that a process of a job was launched. */
+void job_launched(process_group *group, pid_t pid) {
+	if (!group || pid <= 0)
+		return;
+	if (group->pgid == 0)
+		group->pgid = pid;
+	/* Also done in the child; whichever runs first wins the race. */
+	setpgid(pid, group->pgid);
+	if (group->foreground)
+		tcsetpgrp(tty, group->pgid);
+}
+
+/* Turn a wait status into an exit status. */
+static int exit_status(int status) {
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+/* State of a job as a whole: stopped if any process is stopped, done when
+ * all of them are. */
+static int job_state(job *j) {
+	int i, state = JOB_DONE;
+	for (i = 0; i < j->npids; ++i) {
+		if (j->states[i] == JOB_STOPPED)
+			return JOB_STOPPED;
+		if (j->states[i] == JOB_RUNNING)
+			state = JOB_RUNNING;
+	}
+	return state;
+}
+
+/* Add a job to the end of the table. */
+static job *job_add(pid_t *pids, int n, process_group *group, command *c,
+                    int state) {
+	job *j = calloc(1, sizeof(job));
+	if (!j)
+		return NULL;
+	j->pids = malloc(n * sizeof(pid_t));
+	j->states = malloc(n * sizeof(int));
+	if (!j->pids || !j->states) {
+		free(j->pids);
+		free(j->states);
+		free(j);
+		return NULL;
+	}
+
+	int i;
+	for (i = 0; i < n; ++i) {
+		j->pids[i] = pids[i];
+		j->states[i] = pids[i] > 0 ? state : JOB_DONE;
+	}
+	j->npids = n;
+	j->pgid = group ? group->pgid : -1;
+	j->status = EXIT_FAILURE;
+	j->text = command_string(c);
+	if (job_state(j) == JOB_DONE)
+		ndone++;
+
+	/* Number the job one past the last one. */
+	job **p = &jobs;
+	j->id = 1;
+	for (; *p; p = &(*p)->next)
+		j->id = (*p)->id + 1;
+	*p = j;
+	return j;
+}
+
+/* Remove a job from the table. */
+static void job_remove(job *j) {
+	job **p;
+	for (p = &jobs; *p; p = &(*p)->next) {
+		if (*p == j) {
+			*p = j->next;
+			break;
+		}
+	}
+	if (job_state(j) == JOB_DONE)
+		ndone--;
+	free(j->pids);
+	free(j->states);
+	free(j->text);
+	free(j);
+}
+
+/* Record a change of state of the i'th process of a job. */
+static void job_set_state(job *j, int i, int status) {
+	int before = job_state(j);
+	if (WIFSTOPPED(status)) {
+		j->states[i] = JOB_STOPPED;
+	} else if (WIFCONTINUED(status)) {
+		j->states[i] = JOB_RUNNING;
+	} else {
+		j->states[i] = JOB_DONE;
+		if (i == j->npids - 1)
+			j->status = exit_status(status);
+	}
+	int after = job_state(j);
+	if (after != before) {
+		j->notified = 0;
+		if (after == JOB_DONE)
+			ndone++;
+	}
+}
+
+/* Describe the state of a job, the way 'jobs' shows it. */
+static void job_print(job *j) {
+	char *state;
+	char buf[32];
+	switch (job_state(j)) {
+		case JOB_RUNNING:
+			state = "Running";
+			break;
+		case JOB_STOPPED:
+			state = "Stopped";
+			break;
+		default:
+			if (j->status) {
+				snprintf(buf, sizeof(buf), "Exit %d", j->status);
+				state = buf;
+			} else {
+				state = "Done";
+			}
+			break;
+	}
+	printf("[%d]%c  %-22s %s\n", j->id, j->next ? ' ' : '+', state,
+	       j->text ? j->text : "");
+	j->notified = 1;
+}
+
+/* Reap the children in the table that have changed state, if the signalfd
+ * says there are any, and forget finished jobs that nobody is going to be
+ * told about.  Each is waited for by pid: other children ($(...) and the
+ * workers of parallel and the server) are left to whoever waits for them. */
+void jobs_reap(void) {
+	struct signalfd_siginfo info;
+	int got = 0, status, i;
+	job *j, *next;
+
+	if (!jobs)
+		return;
+	while (sigfd != -1 && read(sigfd, &info, sizeof(info)) == sizeof(info))
+		got = 1;
+	if (!got && sigfd != -1)
+		return;
+
+	for (j = jobs; j; j = j->next) {
+		for (i = 0; i < j->npids; ++i) {
+			if (j->states[i] != JOB_DONE &&
+				waitpid(j->pids[i], &status,
+				        WNOHANG | WUNTRACED | WCONTINUED) > 0)
+				job_set_state(j, i, status);
+		}
+	}
+
+	for (j = jobs; j && !interactive_shell && ndone > MAX_DONE_JOBS; j = next) {
+		next = j->next;
+		if (job_state(j) == JOB_DONE)
+			job_remove(j);
+	}
+}
+
+/* Reap children and report finished jobs. */
+void jobs_update(void) {
+	jobs_reap();
+	if (!interactive_shell)
+		return;
+
+	job *j, *next;
+	for (j = jobs; j; j = next) {
+		next = j->next;
+		if (!j->notified) {
+			job_print(j);
+			if (job_state(j) == JOB_DONE)
+				job_remove(j);
+		}
+	}
+}
+
+/* Add up the resources used by the children reaped from now on. */
+struct rusage *job_collect_usage(struct rusage *total) {
+	struct rusage *previous = usage;
+	usage = total;
+	return previous;
+}
+
+/* Add one child's resource usage to the total being collected. */
+static void add_usage(struct rusage *ru) {
+	timeradd(&usage->ru_utime, &ru->ru_utime, &usage->ru_utime);
+	timeradd(&usage->ru_stime, &ru->ru_stime, &usage->ru_stime);
+	if (ru->ru_maxrss > usage->ru_maxrss)
+		usage->ru_maxrss = ru->ru_maxrss;
+	usage->ru_nvcsw += ru->ru_nvcsw;
+	usage->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/* waitpid, counting the resources of the child if it has exited. */
+pid_t job_waitpid(pid_t pid, int *status, int options) {
+	struct rusage ru;
+	pid_t ret = wait4(pid, status, options, &ru);
+	if (ret > 0 && usage && (WIFEXITED(*status) || WIFSIGNALED(*status)))
+		add_usage(&ru);
+	return ret;
+}
+
+/* Wait for the processes of a job by pid. With untraced, also return when
+ * the job is stopped. */
+static void job_wait(job *j, int untraced) {
+	int i, status;
+	for (i = 0; i < j->npids; ++i) {
+		while (j->states[i] != JOB_DONE &&
+		       !(untraced && j->states[i] == JOB_STOPPED)) {
+			pid_t pid = job_waitpid(j->pids[i], &status,
+			                        untraced ? WUNTRACED : 0);
+			if (pid == -1) {
+				if (errno == EINTR)
+					continue;
+				/* Already reaped elsewhere; nothing more to learn. */
+				j->states[i] = JOB_DONE;
+				break;
+			}
+			job_set_state(j, i, status);
+		}
+		if (untraced && j->states[i] == JOB_STOPPED)
+			return;
+	}
+}
+
+/* Wait for the processes of a foreground job. */
+int job_wait_foreground(pid_t *pids, int n, process_group *group, command *c) {
+	int i, status = EXIT_FAILURE, st;
+	long long start = trace_now();
+
+	for (i = 0; i < n; ++i) {
+		if (pids[i] <= 0) {
+			status = EXIT_FAILURE;
+			continue;
+		}
+		pid_t pid;
+		int options = group ? WUNTRACED : 0;
+		while ((pid = job_waitpid(pids[i], &st, options)) == -1 &&
+		       errno == EINTR)
+			;
+		if (pid == -1) {
+			perror("waitpid");
+			status = EXIT_FAILURE;
+		} else if (WIFSTOPPED(st)) {
+			break;
+		} else {
+			status = exit_status(st);
+		}
+	}
+
+	if (i < n) {
+		/* Stopped: the rest of the job goes into the job table. */
+		job *j = job_add(pids + i, n - i, group, c, JOB_RUNNING);
+		if (j) {
+			j->states[0] = JOB_STOPPED;
+			printf("\n");
+			job_print(j);
+		}
+		status = 128 + SIGTSTP;
+	}
+
+	/* Take the terminal back. */
+	if (group && group->foreground)
+		tcsetpgrp(tty, shell_pgid);
+	trace_span("wait", "jobs", start, NULL);
+	return status;
+}
+
+/* Put the processes of a job that was started with & into the job table. */
+int job_add_background(pid_t *pids, int n, process_group *group, command *c) {
+	job *j = job_add(pids, n, group, c, JOB_RUNNING);
+	if (!j)
+		return -1;
+	if (interactive_shell)
+		printf("[%d] %d\n", j->id, pids[n - 1]);
+	j->notified = 1;
+	return j->id;
+}
+
+/* Find a job from a %n (or %%, %+) or a pid argument. With no argument,
+ * the current job: the most recent one. */
+static job *find_job(char *arg) {
+	job *j, *last = NULL;
+	int i;
+
+	if (!arg || !strcmp(arg, "%%") || !strcmp(arg, "%+")) {
+		for (j = jobs; j; j = j->next)
+			last = j;
+		return last;
+	}
+	if (arg[0] == '%') {
+		int id = atoi(arg + 1);
+		for (j = jobs; j; j = j->next) {
+			if (j->id == id)
+				return j;
+		}
+		return NULL;
+	}
+	pid_t pid = atoi(arg);
+	for (j = jobs; j; j = j->next) {
+		for (i = 0; i < j->npids; ++i) {
+			if (j->pids[i] == pid)
+				return j;
+		}
+	}
+	return NULL;
+}
+
+/* Lists the jobs:
+ * For example: words[0] = 'jobs'
+ *              words[1] = '-l'  (optional; also show the process ids)
+ */
+int execute_jobs(char **words) {
+	int pids = words[1] && !strcmp(words[1], "-l");
+	job *j, *next;
+	int i;
+
+	jobs_reap();
+	for (j = jobs; j; j = next) {
+		next = j->next;
+		job_print(j);
+		if (pids) {
+			for (i = 0; i < j->npids; ++i)
+				printf("      %d\n", j->pids[i]);
+		}
+		if (job_state(j) == JOB_DONE)
+			job_remove(j);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Waits for jobs to finish:
+ * For example: words[0] = 'wait'     (wait for all running jobs)
+ *              words[1] = '%1'       (or a pid; the status of that job
+ *                                     is returned)
+ */
+int execute_wait(char **words) {
+	job *j, *next;
+	int i, status = EXIT_SUCCESS;
+
+	if (!words[1]) {
+		for (j = jobs; j; j = next) {
+			next = j->next;
+			if (job_state(j) == JOB_STOPPED)
+				continue;
+			job_wait(j, 0);
+			job_remove(j);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	for (i = 1; words[i]; ++i) {
+		j = find_job(words[i]);
+		if (!j) {
+			fprintf(stderr, "wait: %s: no such job\n", words[i]);
+			status = 127;
+			continue;
+		}
+		job_wait(j, 0);
+		status = j->status;
+		job_remove(j);
+	}
+	return status;
+}
+
+/* Continues a stopped job in the foreground:
+ * For example: words[0] = 'fg'
+ *              words[1] = '%1'  (optional; by default the current job)
+ */
+int execute_fg(char **words) {
+	if (!job_control) {
+		fprintf(stderr, "fg: no job control\n");
+		return EXIT_FAILURE;
+	}
+	job *j = find_job(words[1]);
+	if (!j) {
+		fprintf(stderr, "fg: %s: no such job\n", words[1] ? words[1] : "current");
+		return EXIT_FAILURE;
+	}
+
+	printf("%s\n", j->text ? j->text : "");
+	fflush(stdout);
+	tcsetpgrp(tty, j->pgid);
+	kill(-j->pgid, SIGCONT);
+	int i;
+	for (i = 0; i < j->npids; ++i) {
+		if (j->states[i] == JOB_STOPPED)
+			j->states[i] = JOB_RUNNING;
+	}
+
+	job_wait(j, 1);
+	tcsetpgrp(tty, shell_pgid);
+
+	int status = j->status;
+	if (job_state(j) == JOB_STOPPED) {
+		printf("\n");
+		job_print(j);
+		status = 128 + SIGTSTP;
+	} else {
+		job_remove(j);
+	}
+	return status;
+}
+
+/* Continues a stopped job in the background:
+ * For example: words[0] = 'bg'
+ *              words[1] = '%1'  (optional; by default the current job)
+ */
+int execute_bg(char **words) {
+	if (!job_control) {
+		fprintf(stderr, "bg: no job control\n");
+		return EXIT_FAILURE;
+	}
+	job *j = find_job(words[1]);
+	if (!j) {
+		fprintf(stderr, "bg: %s: no such job\n", words[1] ? words[1] : "current");
+		return EXIT_FAILURE;
+	}
+
+	kill(-j->pgid, SIGCONT);
+	int i;
+	for (i = 0; i < j->npids; ++i) {
+		if (j->states[i] == JOB_STOPPED)
+			j->states[i] = JOB_RUNNING;
+	}
+	j->notified = 1;
+	printf("[%d]+ %s &\n", j->id, j->text ? j->text : "");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,70 @@
+#ifndef __JOBS_H__
+#define __JOBS_H__
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <spawn.h>
+
+#include "shell.h"
+
+/**
+ * Where a launched process goes when job control is on: the process group
+ * of its job (0 until the first process of the job starts one), and
+ * whether that job gets the terminal.  Launch functions take NULL when
+ * processes should simply stay in the shell's group.
+ */
+typedef struct process_group_t {
+	pid_t pgid;
+	int foreground;
+} process_group;
+
+/* Set up the job table and the SIGCHLD reaper; with interactive set (and
+ * a terminal), turn on job control. */
+void jobs_init(int interactive);
+
+/* Prepare a process group for a new job, or return NULL if job control
+ * is off. */
+process_group *job_group(process_group *group, int foreground);
+
+/* Set up the signals and process group of a forked child. */
+void job_child_setup(process_group *group);
+
+/* Set up the spawn attributes (signals, process group, terminal) for a
+ * process launched with posix_spawn. */
+void job_spawn_setup(posix_spawnattr_t *attr,
+                     posix_spawn_file_actions_t *actions, process_group *group);
+
+/* Record in the parent that a process of a job was launched. */
+void job_launched(process_group *group, pid_t pid);
+
+/* Wait for the processes of a foreground job, and return the exit status
+ * of the last one.  If the job is stopped (Ctrl-Z), it is moved into the
+ * job table instead. */
+int job_wait_foreground(pid_t *pids, int n, process_group *group, command *c);
+
+/* Add up the resources used by the children reaped from now on (by the
+ * waits here and job_waitpid) into total, or stop with NULL.  Returns the
+ * previous total. */
+struct rusage *job_collect_usage(struct rusage *total);
+
+/* waitpid, also counting the resources the child used (see above). */
+pid_t job_waitpid(pid_t pid, int *status, int options);
+
+/* Put the processes of a job that was started with & into the job table. */
+int job_add_background(pid_t *pids, int n, process_group *group, command *c);
+
+/* Reap any children that have exited or stopped (without blocking); the
+ * finished jobs are reported by the next jobs_update. */
+void jobs_reap(void);
+
+/* Reap any children that have exited or stopped (without blocking), and
+ * report finished jobs when interactive. */
+void jobs_update(void);
+
+/* Builtins */
+int execute_jobs(char **words);
+int execute_wait(char **words);
+int execute_fg(char **words);
+int execute_bg(char **words);
+
+#endif
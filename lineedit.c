@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <errno.h>
+
+#include "lineedit.h"
+#include "complete.h"
+#include "prompt.h"
+#include "history.h"
+
+/**
+ * A small line editor for interactive shells: the terminal is put into
+ * non-canonical mode while a line is read, so that the shell sees Tab.
+ * Editing happens at the end of the line: Backspace, Ctrl-U (erase the
+ * line), Ctrl-W (erase a word), Ctrl-C (discard the line), Ctrl-L (clear
+ * the screen) and Ctrl-D (end of input on an empty line).  Tab completes
+ * the last word as far as it is unambiguous; when it can't go further, it
+ * lists the candidates.  Up and Down step through the history, and Ctrl-R
+ * searches it backwards as the text is typed (Ctrl-R again for an older
+ * match, Ctrl-G to go back to the line); the lines are read from the
+ * history's index, so nothing is loaded up front.
+ */
+
+/* Initial size of the line buffer; it doubles whenever it fills up. */
+#define INITIAL_LINE 256
+
+/* Width used to lay out lists of candidates */
+#define SCREEN_WIDTH 80
+
+/* Longest text a history search takes */
+#define SEARCH_MAX 256
+
+
+static char *buf;
+static size_t len, size;
+
+static long entry = -1;          /* The history line shown, or -1 */
+static size_t nlines;            /* Lines in the history when it was opened */
+static char *typed;              /* The line being typed, while browsing */
+static size_t typed_len;
+
+/* Write a string to the terminal. */
+static void put(char *s, size_t n) {
+	while (n > 0) {
+		ssize_t w = write(STDOUT_FILENO, s, n);
+		if (w == -1 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return;
+		s += w;
+		n -= w;
+	}
+}
+
+/* Make room for n more bytes (and a NUL). Returns -1 if out of memory. */
+static int reserve(size_t n) {
+	if (len + n + 1 <= size)
+		return 0;
+	size_t newsize = size ? size : INITIAL_LINE;
+	while (len + n + 1 > newsize)
+		newsize *= 2;
+	char *grown = realloc(buf, newsize);
+	if (!grown)
+		return -1;
+	buf = grown;
+	size = newsize;
+	return 0;
+}
+
+/* Add text to the line and echo it. */
+static void insert(char *s, size_t n) {
+	if (reserve(n) == -1)
+		return;
+	memcpy(buf + len, s, n);
+	len += n;
+	put(s, n);
+}
+
+/* Erase the last n bytes of the line from the screen and the buffer. */
+static void erase(size_t n) {
+	while (n-- > 0 && len > 0) {
+		/* Take a whole UTF-8 character off. */
+		do {
+			len--;
+		} while (len > 0 && (buf[len] & 0xc0) == 0x80);
+		put("\b \b", 3);
+	}
+}
+
+/* Print the prompt and the line again (e.g. after a list of candidates). */
+static void redraw(void) {
+	put("\r\033[K", 4);
+	print_prompt();
+	put(buf, len);
+}
+
+/* Replace the line with a copy of some text. */
+static void set_line(char *s, size_t n) {
+	len = 0;
+	if (reserve(n) == -1)
+		return;
+	memcpy(buf, s, n);
+	len = n;
+}
+
+/* Step to an older (step -1) or newer (+1) line of the history; past the
+ * newest one is the line that was being typed. */
+static void browse(int step) {
+	size_t n;
+	if (entry == -1) {
+		if (step > 0 || (nlines = history_lines()) == 0) {
+			put("\a", 1);
+			return;
+		}
+		free(typed);
+		typed = malloc(len + 1);
+		typed_len = typed ? len : 0;
+		if (typed)
+			memcpy(typed, buf, len);
+		entry = nlines;
+	}
+	if (entry + step < 0) {
+		put("\a", 1);
+		return;
+	}
+	entry += step;
+	if ((size_t)entry == nlines) {
+		entry = -1;
+		set_line(typed, typed_len);
+	} else {
+		char *line = history_line(entry, &n);
+		set_line(line, n);
+	}
+	redraw();
+}
+
+/* Show the state of a history search in place of the prompt. */
+static void show_search(char *text, size_t n) {
+	put("\r\033[K(reverse-i-search)`", 23);
+	put(text, n);
+	put("': ", 3);
+	put(buf, len);
+}
+
+/**
+ * Search the history backwards for the text typed, showing the newest line
+ * that contains it; the line found becomes the one being edited.  Returns
+ * the key that ended the search, for the caller to act on, or 0 if there is
+ * nothing more to do (cancelled with Ctrl-G or Ctrl-C).
+ */
+static int search(int fd) {
+	char text[SEARCH_MAX], *before = malloc(len + 1);
+	size_t n = 0, before_len = len, count = history_lines(), linelen;
+	long found = count, match;
+	unsigned char ch = 0;
+
+	if (before)
+		memcpy(before, buf, len);
+	entry = -1;
+	show_search(text, n);
+	while (1) {
+		ssize_t got = read(fd, &ch, 1);
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got <= 0) {
+			ch = 0;
+			break;
+		}
+
+		if (ch == CTRL('R') && n > 0) {
+			/* An older line with the same text */
+			match = history_find(text, n, found);
+		} else if ((ch == 127 || ch == CTRL('H')) && n > 0) {
+			/* Less text: look again from the newest line. */
+			match = --n ? history_find(text, n, count) : found;
+		} else if (ch >= ' ' && ch != 127 && n < SEARCH_MAX) {
+			/* More text: the line shown may still have it. */
+			text[n++] = ch;
+			match = history_find(text, n, found < (long)count ? found + 1 :
+			                     count);
+			if (match == -1)
+				n--;
+		} else if (ch == CTRL('R') || ch == 127 || ch == CTRL('H')) {
+			match = -1;
+		} else {
+			break;
+		}
+
+		if (match == -1) {
+			put("\a", 1);
+		} else if (match < (long)count) {
+			char *line = history_line(match, &linelen);
+			found = match;
+			set_line(line, linelen);
+		}
+		show_search(text, n);
+	}
+
+	if ((ch == CTRL('G') || ch == CTRL('C')) && before) {
+		set_line(before, before_len);
+		ch = 0;
+	}
+	redraw();
+	free(before);
+	return ch;
+}
+
+/* Print candidates in columns, below the line. */
+static void list_candidates(completions *c) {
+	size_t i, width = 0, col = 0;
+	for (i = 0; i < c->count; i++) {
+		size_t w = strlen(c->names[i]);
+		if (w > width)
+			width = w;
+	}
+	width += 2;
+	size_t columns = width < SCREEN_WIDTH ? SCREEN_WIDTH / width : 1;
+
+	put("\n", 1);
+	for (i = 0; i < c->count; i++) {
+		char *name = c->names[i];
+		size_t n = strlen(name);
+		put(name, n);
+		if (++col == columns || i + 1 == c->count) {
+			put("\n", 1);
+			col = 0;
+		} else {
+			while (n++ < width)
+				put(" ", 1);
+		}
+	}
+	redraw();
+}
+
+/* Complete the last word of the line. */
+static void complete(void) {
+	completions c;
+	buf[len] = '\0';
+	if (complete_word(buf, len, &c) == 0) {
+		put("\a", 1);
+		return;
+	}
+
+	/* Extend the word as far as all the candidates agree. */
+	size_t have = len - c.word_start, common = strlen(c.names[0]), i;
+	for (i = 1; i < c.count; i++) {
+		size_t j = 0;
+		while (j < common && c.names[i][j] == c.names[0][j])
+			j++;
+		common = j;
+	}
+	if (common > have)
+		insert(c.names[0] + have, common - have);
+
+	if (c.count == 1) {
+		/* Done with this word (unless it is a directory). */
+		if (common == 0 || c.names[0][common - 1] != '/')
+			insert(" ", 1);
+	} else if (common <= have) {
+		list_candidates(&c);
+	}
+	completions_free(&c);
+}
+
+/* Read a line from the terminal. */
+char *lineedit_read(int fd, size_t *linelen) {
+	struct termios saved, raw;
+	int have_termios = tcgetattr(fd, &saved) == 0;
+
+	if (have_termios) {
+		raw = saved;
+		raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+		raw.c_cc[VMIN] = 1;
+		raw.c_cc[VTIME] = 0;
+		tcsetattr(fd, TCSADRAIN, &raw);
+	}
+
+	len = 0;
+	entry = -1;
+	if (reserve(0) == -1)
+		return NULL;
+
+	char *line = NULL;
+	int pending = 0;             /* A key that ended a history search */
+	while (1) {
+		unsigned char ch = pending;
+		if (!pending) {
+			ssize_t n = read(fd, &ch, 1);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				/* End of input: hand back what there is, if anything. */
+				line = len ? buf : NULL;
+				break;
+			}
+		}
+		pending = 0;
+
+		if (ch == '\n' || ch == '\r') {
+			put("\n", 1);
+			line = buf;
+			break;
+		} else if (ch == CTRL('D')) {
+			if (len == 0) {
+				line = NULL;
+				break;
+			}
+		} else if (ch == '\t') {
+			complete();
+		} else if (ch == 127 || ch == CTRL('H')) {
+			erase(1);
+		} else if (ch == CTRL('U')) {
+			len = 0;
+			redraw();
+		} else if (ch == CTRL('W')) {
+			while (len > 0 && buf[len - 1] == ' ')
+				erase(1);
+			while (len > 0 && buf[len - 1] != ' ')
+				erase(1);
+		} else if (ch == CTRL('C')) {
+			put("^C\n", 3);
+			len = 0;
+			redraw();
+		} else if (ch == CTRL('L')) {
+			put("\033[H\033[2J", 7);
+			redraw();
+		} else if (ch == CTRL('R')) {
+			pending = search(fd);
+		} else if (ch == '\033') {
+			/* Escape sequences: ESC [ ... final byte, or ESC O x.  Up and
+			 * Down go through the history; the rest are skipped. */
+			unsigned char seq;
+			if (read(fd, &seq, 1) == 1 && (seq == '[' || seq == 'O')) {
+				while (read(fd, &seq, 1) == 1 && !(seq >= 0x40 && seq <= 0x7e))
+					;
+				if (seq == 'A' || seq == 'B')
+					browse(seq == 'A' ? -1 : 1);
+			}
+		} else if (ch >= ' ') {
+			insert((char*)&ch, 1);
+		}
+	}
+
+	if (have_termios)
+		tcsetattr(fd, TCSADRAIN, &saved);
+	if (line) {
+		buf[len] = '\0';
+		*linelen = len;
+	}
+	return line;
+}
@@ -0,0 +1,11 @@
+#ifndef __LINEEDIT_H__
+#define __LINEEDIT_H__
+
+#include <stddef.h>
+
+/* Read a line from a terminal (after the prompt has been printed), with
+ * basic editing, Tab completion and the history on Up, Down and Ctrl-R.  The line is valid until the next
+ * call; NULL at the end of the input (Ctrl-D on an empty line). */
+char *lineedit_read(int fd, size_t *len);
+
+#endif
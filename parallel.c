@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+
+#include "shell.h"
+#include "builtins.h"
+#include "input.h"
+#include "jobs.h"
+#include "parallel.h"
+
+/**
+ * A job scheduler in the shell: the command template is run once per
+ * argument, keeping up to N children in flight and starting the next one
+ * as soon as one exits.  The children's output is captured through pipes
+ * and written out a whole job at a time (--group, the default) or a whole
+ * line at a time (--line-buffer), so jobs don't garble each other's output;
+ * --ungroup lets it straight through.  The loop sleeps in poll() on the
+ * output pipes and on a pidfd per child.
+ */
+
+/* How the children's stdout is passed on */
+#define OUTPUT_GROUP  0
+#define OUTPUT_LINE   1
+#define OUTPUT_DIRECT 2
+
+/* Exit status when more jobs than this failed, like GNU parallel. */
+#define MAX_FAILED_STATUS 101
+
+/* How often to check on the children when pidfds are not available (ms). */
+#define POLL_INTERVAL 10
+
+typedef struct slot_t {
+	pid_t pid;               /* 0 if the slot is free */
+	int pidfd;               /* -1 if not available (or reaped) */
+	int out;                 /* Read end of its stdout, -1 at EOF */
+	int exited;
+	int status;
+	char *arg;
+	char *buf;               /* Captured output */
+	size_t len, size;
+} slot;
+
+typedef struct parallel_t {
+	char **template;         /* The command, with {} for the argument */
+	int has_placeholder;
+	int mode;
+	int fdout, fderr;
+	int childin;             /* stdin for the children */
+	char **args;             /* Arguments from the list, or NULL */
+	input in;                /* Arguments from stdin otherwise */
+	int njobs, nfailed;
+} parallel;
+
+/* Open a pidfd for a child, or -1 if the kernel can't. */
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Get the next argument, or NULL when there are no more. */
+static char *next_arg(parallel *p) {
+	if (p->args)
+		return *p->args ? strdup(*p->args++) : NULL;
+
+	size_t len;
+	char *line = input_read_line(&p->in, &len);
+	return line ? strdup(line) : NULL;
+}
+
+/* Replace every {} in a word with the argument. */
+static char *substitute(char *word, char *arg) {
+	size_t alen = strlen(arg), len = 0;
+	char *s, *d, *result;
+
+	for (s = word; *s; s++)
+		len += (s[0] == '{' && s[1] == '}') ? (s++, alen) : 1;
+	result = malloc(len + 1);
+	if (!result)
+		return NULL;
+	for (s = word, d = result; *s; s++) {
+		if (s[0] == '{' && s[1] == '}') {
+			memcpy(d, arg, alen);
+			d += alen;
+			s++;
+		} else {
+			*d++ = *s;
+		}
+	}
+	*d = '\0';
+	return result;
+}
+
+/* Start the command for an argument in a free slot. */
+static int start_job(parallel *p, slot *sl, char *arg) {
+	int n, i;
+	for (n = 0; p->template[n]; n++)
+		;
+
+	char **argv = calloc(n + 2, sizeof(char*));
+	if (!argv)
+		return -1;
+	for (i = 0; i < n; i++)
+		argv[i] = substitute(p->template[i], arg);
+	if (!p->has_placeholder)
+		argv[n] = strdup(arg);
+
+	int pfd[2] = { -1, -1 };
+	if (p->mode != OUTPUT_DIRECT && make_pipe(pfd) == -1) {
+		perror("parallel: pipe");
+		pfd[0] = pfd[1] = -1;
+	}
+
+	simple_command s = { .tokens = argv };
+	sl->pid = launch_nonbuiltin(&s, p->childin,
+	                            pfd[1] != -1 ? pfd[1] : p->fdout, p->fderr,
+	                            NULL);
+	if (pfd[1] != -1)
+		close(pfd[1]);
+	for (i = 0; argv[i] || i < n; i++)
+		free(argv[i]);
+	free(argv);
+
+	sl->arg = arg;
+	sl->out = pfd[0];
+	sl->len = 0;
+	sl->exited = 0;
+	sl->status = EXIT_FAILURE;
+	p->njobs++;
+	if (sl->pid == -1) {
+		/* Could not even start it: a failed job. */
+		sl->pid = -1;
+		sl->exited = 1;
+		sl->pidfd = -1;
+		return 0;
+	}
+	sl->pidfd = open_pidfd(sl->pid);
+	return 0;
+}
+
+/* Read what a job has written, passing on complete lines in line mode. */
+static void read_output(parallel *p, slot *sl) {
+	if (sl->size - sl->len < 4096) {
+		size_t newsize = sl->size ? sl->size * 2 : 8192;
+		char *newbuf = realloc(sl->buf, newsize);
+		if (!newbuf) {
+			close(sl->out);
+			sl->out = -1;
+			return;
+		}
+		sl->buf = newbuf;
+		sl->size = newsize;
+	}
+
+	ssize_t n = read(sl->out, sl->buf + sl->len, sl->size - sl->len);
+	if (n == -1 && errno == EINTR)
+		return;
+	if (n <= 0) {
+		close(sl->out);
+		sl->out = -1;
+		return;
+	}
+	sl->len += n;
+
+	if (p->mode == OUTPUT_LINE) {
+		char *nl = memrchr(sl->buf, '\n', sl->len);
+		if (nl) {
+			size_t done = nl - sl->buf + 1;
+			write_all(p->fdout, sl->buf, done);
+			memmove(sl->buf, sl->buf + done, sl->len - done);
+			sl->len -= done;
+		}
+	}
+}
+
+/* Reap a job's process if it has exited (or wait for it, with block). */
+static void reap(slot *sl, int block) {
+	int status;
+	if (sl->exited)
+		return;
+	pid_t pid = job_waitpid(sl->pid, &status, block ? 0 : WNOHANG);
+	if (pid == sl->pid) {
+		sl->exited = 1;
+		sl->status = WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+	} else if (pid == -1 && errno != EINTR) {
+		sl->exited = 1;
+	}
+}
+
+/* Free the slot of a job that is finished, after passing on its output. */
+static void finish_job(parallel *p, slot *sl) {
+	if (sl->len)
+		write_all(p->fdout, sl->buf, sl->len);
+	sl->len = 0;
+	if (sl->status) {
+		p->nfailed++;
+		dprintf(p->fderr, "parallel: exit %d: %s\n", sl->status, sl->arg);
+	}
+	if (sl->pidfd != -1)
+		close(sl->pidfd);
+	free(sl->arg);
+	sl->arg = NULL;
+	sl->pid = 0;
+}
+
+/* Run all the jobs, at most nslots at a time. */
+static void run(parallel *p, slot *slots, int nslots) {
+	struct pollfd *pfds = malloc(2 * nslots * sizeof(struct pollfd));
+	slot **owners = malloc(2 * nslots * sizeof(slot*));
+	int running = 0, more = 1, i;
+
+	if (!pfds || !owners) {
+		perror("parallel");
+		more = 0;
+	}
+
+	while (more || running) {
+		/* Keep all the slots full. */
+		for (i = 0; more && i < nslots; i++) {
+			if (slots[i].pid)
+				continue;
+			char *arg = next_arg(p);
+			if (!arg) {
+				more = 0;
+				break;
+			}
+			start_job(p, &slots[i], arg);
+			running++;
+		}
+		if (!running)
+			break;
+
+		/* Sleep until some output comes in or a child exits. */
+		int n = 0, timeout = -1;
+		for (i = 0; i < nslots; i++) {
+			slot *sl = &slots[i];
+			if (!sl->pid)
+				continue;
+			if (sl->out != -1) {
+				pfds[n].fd = sl->out;
+				pfds[n].events = POLLIN;
+				owners[n++] = sl;
+			}
+			if (!sl->exited) {
+				if (sl->pidfd != -1) {
+					pfds[n].fd = sl->pidfd;
+					pfds[n].events = POLLIN;
+					owners[n++] = sl;
+				} else {
+					timeout = POLL_INTERVAL;
+				}
+			}
+		}
+		if (n > 0 || timeout != -1) {
+			if (poll(pfds, n, timeout) == -1 && errno != EINTR) {
+				perror("parallel: poll");
+				break;
+			}
+		}
+
+		for (i = 0; i < n; i++) {
+			if (!pfds[i].revents)
+				continue;
+			if (pfds[i].fd == owners[i]->out)
+				read_output(p, owners[i]);
+			else
+				reap(owners[i], 1);
+		}
+
+		/* A job is finished once it has exited and closed its output. */
+		for (i = 0; i < nslots; i++) {
+			slot *sl = &slots[i];
+			if (!sl->pid)
+				continue;
+			if (sl->pidfd == -1)
+				reap(sl, 0);
+			if (sl->exited && sl->out == -1) {
+				finish_job(p, sl);
+				running--;
+			}
+		}
+	}
+
+	free(pfds);
+	free(owners);
+}
+
+/* Run a command once per argument, at most N at a time. */
+int execute_parallel(char **words, int fds[3]) {
+	parallel p;
+	int nslots = sysconf(_SC_NPROCESSORS_ONLN), i;
+
+	memset(&p, 0, sizeof(p));
+	p.mode = OUTPUT_GROUP;
+	p.fdout = fds[1];
+	p.fderr = fds[2];
+	p.childin = fds[0];
+
+	/* Options come first, then the command template. */
+	for (i = 1; words[i] && words[i][0] == '-'; i++) {
+		if (!strcmp(words[i], "-j") && words[i + 1]) {
+			nslots = atoi(words[++i]);
+		} else if (!strncmp(words[i], "-j", 2) && words[i][2]) {
+			nslots = atoi(words[i] + 2);
+		} else if (!strcmp(words[i], "--group") || !strcmp(words[i], "-g")) {
+			p.mode = OUTPUT_GROUP;
+		} else if (!strcmp(words[i], "--line-buffer")) {
+			p.mode = OUTPUT_LINE;
+		} else if (!strcmp(words[i], "--ungroup") || !strcmp(words[i], "-u")) {
+			p.mode = OUTPUT_DIRECT;
+		} else {
+			dprintf(fds[2], "parallel: unknown option %s\n", words[i]);
+			return 2;
+		}
+	}
+	if (nslots < 1)
+		nslots = 1;
+
+	p.template = words + i;
+	for (; words[i] && strcmp(words[i], ":::"); i++) {
+		if (strstr(words[i], "{}"))
+			p.has_placeholder = 1;
+	}
+	if (words[i]) {
+		/* The arguments follow the ::: */
+		words[i] = NULL;
+		p.args = words + i + 1;
+	} else {
+		/* One argument per line of stdin; the children don't get to
+		 * read it. */
+		input_from_fd(&p.in, fds[0]);
+		p.childin = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	}
+	if (!p.template[0]) {
+		dprintf(fds[2], "parallel: no command given\n");
+		return 2;
+	}
+
+	slot *slots = calloc(nslots, sizeof(slot));
+	if (!slots) {
+		perror("parallel");
+		return EXIT_FAILURE;
+	}
+
+	run(&p, slots, nslots);
+
+	for (i = 0; i < nslots; i++)
+		free(slots[i].buf);
+	free(slots);
+	if (!p.args) {
+		/* The descriptor belongs to the caller. */
+		p.in.fd = -1;
+		input_close(&p.in);
+		if (p.childin != -1)
+			close(p.childin);
+	}
+
+	dprintf(fds[2], "parallel: %d jobs, %d succeeded, %d failed\n",
+	        p.njobs, p.njobs - p.nfailed, p.nfailed);
+	return p.nfailed > MAX_FAILED_STATUS - 1 ? MAX_FAILED_STATUS : p.nfailed;
+}
@@ -0,0 +1,9 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+/* parallel [-j N] [--group|--line-buffer|--ungroup] command... [::: arg...]
+ * Run a command once per argument (from the list, or one per line of
+ * stdin), with at most N running at a time. */
+int execute_parallel(char **words, int fds[3]);
+
+#endif
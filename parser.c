@@ -1,23 +1,38 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include "parser.h"
 #include "shell.h"
+#include "arena.h"
+#include "vars.h"
+#include "placement.h"
+
+/* Determine which kind of token a token is */
+token_kind classify_token(char *token) {
+	switch (token[0]) {
+		case '|':
+			if (!token[1])
+				return TOKEN_PIPE;
+			return (token[1] == '|' && !token[2]) ? TOKEN_OR : TOKEN_WORD;
+		case '&':
+			if (!token[1])
+				return TOKEN_AMP;
+			return (token[1] == '&' && !token[2]) ? TOKEN_AND : TOKEN_WORD;
+		case ';':
+			return !token[1] ? TOKEN_SEMI : TOKEN_WORD;
+		default:
+			return TOKEN_WORD;
+	}
+}
 
 /* Determine if a token is a special operator (like '|') */
 int is_operator(char *token) {
-	/** 
-	 * Optional: edit this if you wish to parse other operators
-	 * like ";", "&&", etc.
-	 */
-	return !strcmp(token, "|") ||
-			!strcmp(token, "&") ||
-			!strcmp(token, ";") ||
-			!strcmp(token, "||") ||
-			!strcmp(token, "&&");
+	return classify_token(token) != TOKEN_WORD;
 }
 
 /* Determine if a command is builtin */
@@ -30,9 +45,60 @@ int is_builtin(char *token) {
 		return BUILTIN_SET;
 	if (!strcmp(token, "unset"))
 		return BUILTIN_UNSET;
+	if (!strcmp(token, "hash"))
+		return BUILTIN_HASH;
+	if (!strcmp(token, "cat"))
+		return BUILTIN_CAT;
+	if (!strcmp(token, "tee"))
+		return BUILTIN_TEE;
+	if (!strcmp(token, "jobs"))
+		return BUILTIN_JOBS;
+	if (!strcmp(token, "wait"))
+		return BUILTIN_WAIT;
+	if (!strcmp(token, "fg"))
+		return BUILTIN_FG;
+	if (!strcmp(token, "bg"))
+		return BUILTIN_BG;
+	if (!strcmp(token, "parallel"))
+		return BUILTIN_PARALLEL;
+	if (!strcmp(token, "history"))
+		return BUILTIN_HISTORY;
+	if (!strcmp(token, "cache"))
+		return BUILTIN_CACHE;
+	if (!strcmp(token, "break"))
+		return BUILTIN_BREAK;
+	if (!strcmp(token, "continue"))
+		return BUILTIN_CONTINUE;
+	if (!strcmp(token, "echo"))
+		return BUILTIN_ECHO;
+	if (!strcmp(token, "printf"))
+		return BUILTIN_PRINTF;
+	if (!strcmp(token, "test") || !strcmp(token, "["))
+		return BUILTIN_TEST;
+	if (!strcmp(token, "true") || !strcmp(token, ":"))
+		return BUILTIN_TRUE;
+	if (!strcmp(token, "false"))
+		return BUILTIN_FALSE;
 	return 0;
 }
 
+/* cat and tee stand in for the programs only when they are called without
+ * options (tee's -a aside, and a lone "-" is stdin); anything else is left
+ * to the programs, which know what the options mean. */
+static int builtin_takes(int builtin, char **tokens) {
+	int i;
+	if (builtin != BUILTIN_CAT && builtin != BUILTIN_TEE)
+		return builtin;
+	for (i = 1; tokens[i]; i++) {
+		if (tokens[i][0] != '-' || !tokens[i][1])
+			continue;
+		if (builtin == BUILTIN_TEE && i == 1 && !strcmp(tokens[i], "-a"))
+			continue;
+		return 0;
+	}
+	return builtin;
+}
+
 /* Determine if a path is relative or absolute (relative to root) */
 int is_relative(char* path) {
 	return (path[0] != '/'); 
@@ -52,25 +118,28 @@ int is_in_home(char *path, char *home) {
 	return 0;
 }
 
-/* Determine if a command is complex (has an operator like pipe '|') */
-int is_complex_command(char **tokens) {
-	
-	int i = 0;
-	while(tokens[i]) {		
-		if (is_operator(tokens[i]))
-			return 1;
-		i++;
-	}	
-	return 0;
-}
+/* Initial size of the token vector; it doubles whenever it fills up. */
+#define INITIAL_TOKENS 16
+
+/* Define our valid characters in variable names. */
+#define VALID_VAR_BEGIN(a) (isalpha(a) || (a) == '_')
+#define VALID_VAR(a) (isalnum(a) || (a) == '_')
 
 /* Parse a line into its tokens/words */
-void parse_line(char *line, char **tokens) {
+char **parse_line(char *line) {
 	
 	/* This flag indicates whether the current character is
 	 * in a double-quoted string (""). */
 	int in_str = 0;
 
+	/* How many $( we are inside */
+	int depth = 0;
+
+	size_t ntokens = 0, capacity = INITIAL_TOKENS;
+	char **tokens = malloc(capacity * sizeof(char*));
+	if (!tokens)
+		return NULL;
+
 	while (*line != '\0') {
 		/* Replace all whitespaces with \0 */
 		while (*line == ' ' || *line == '\t' || *line == '\n') { 
@@ -81,147 +150,533 @@ void parse_line(char *line, char **tokens) {
       			break;
 		}
 			
+		/* Make room for this token and the terminating NULL */
+		if (ntokens + 1 >= capacity) {
+			char **grown = realloc(tokens, 2 * capacity * sizeof(char*));
+			if (!grown) {
+				free(tokens);
+				return NULL;
+			}
+			tokens = grown;
+			capacity *= 2;
+		}
+
 		/* Store the position of the token in the line */
-		*tokens++ = line;
-		//printf("token: %s\n", *(tokens-1));
+		tokens[ntokens++] = line;
+		//printf("token: %s\n", tokens[ntokens-1]);
 		
-		/* Ignore non-whitespace, until next whitespace delimiter */
-		while (*line != '\0' && *line != ' ' &&
-		       *line != '\t' && *line != '\n')  {
-			if (*line == '"')
+		/* Ignore non-whitespace, until next whitespace delimiter (but
+		 * whitespace in a string or a $(...) is part of the token) */
+		while (*line != '\0' && (in_str || depth > 0 ||
+		       (*line != ' ' && *line != '\t' && *line != '\n')))  {
+			if (*line == '"') {
 				in_str = !in_str;
-			line++;
-			if (*line == ' ' && in_str)
+			} else if (*line == '$' && line[1] == '(') {
+				depth++;
 				line++;
+			} else if (*line == ')' && depth > 0) {
+				depth--;
+			}
+			line++;
+		}
+	}
+	tokens[ntokens] = NULL;
+	return tokens;
+}
+
+/**
+ * Recognize a redirection operator, which may start with a descriptor number
+ * (0-9): <, >, >>, <>, <<, &>, &>>, or n>&m, n<&m, n>&- and n<&-, which
+ * need no operand.  Fills in r (and sets *both for &>, which also sends
+ * stderr to the file).  Returns how many words the redirection takes, with
+ * its operand, or 0 if the token is not one.
+ */
+static int classify_redirection(char *token, redirect *r, int *both) {
+	char *op = token;
+	int fd = -1;
+
+	*both = 0;
+	if (*op == '&' && op[1] == '>') {
+		*both = 1;
+		op++;
+	} else if (*op >= '0' && *op <= '9' && (op[1] == '<' || op[1] == '>')) {
+		fd = *op++ - '0';
+	}
+	if (*op != '<' && *op != '>')
+		return 0;
+
+	r->type = REDIRECT_OPEN;
+	r->fd = (fd != -1) ? fd : (*op == '<') ? 0 : 1;
+	r->from = -1;
+	r->target = NULL;
+	if (!strcmp(op, "<")) {
+		r->flags = O_RDONLY;
+	} else if (!strcmp(op, ">")) {
+		r->flags = O_WRONLY | O_CREAT | O_TRUNC;
+	} else if (!strcmp(op, ">>")) {
+		r->flags = O_WRONLY | O_CREAT | O_APPEND;
+	} else if (!strcmp(op, "<>") && !*both) {
+		r->flags = O_RDWR | O_CREAT;
+	} else if (!strcmp(op, "<<") && fd == -1 && !*both) {
+		r->type = REDIRECT_HERE;
+	} else if (op[1] == '&' && !*both) {
+		/* n>&m or n>&-: everything is in this one word. */
+		char *end;
+		if (!strcmp(op + 2, "-")) {
+			r->type = REDIRECT_CLOSE;
+			return 1;
 		}
+		r->from = strtol(op + 2, &end, 10);
+		if (end == op + 2 || *end || r->from < 0)
+			return 0;
+		r->type = REDIRECT_DUP;
+		return 1;
+	} else {
+		return 0;
 	}
-	*tokens = '\0';
+	return 2;
 }
 
+/**
+ * Split the words of a simple command into its program and parameters
+ * (cmd->tokens) and the plan of its redirections (cmd->redirects), in one
+ * pass.  Returns -1 if a redirection is missing its operand.
+ */
 int extract_redirections(char** tokens, simple_command* cmd) {
-	
-	int i = 0;
-	int skipcnt = 0;
-	
-	while(tokens[i]) {
-		
-		int skip = 0;		
-		if (!strcmp(tokens[i], ">")) {
-			if(!tokens[i+1]) {
-				return -1;
-			}
-			cmd->out = tokens[i+1];
-			skipcnt += 2;
-			skip = 1;
-		}			
-		if (!strcmp(tokens[i], "<")) {
-			if(!tokens[i+1]) {
-				return -1;
-			}
-			cmd->in = tokens[i+1];
-			skipcnt += 2;
-			skip = 1;
-		}			
-		if (!strcmp(tokens[i], "2>")) {
-			if(!tokens[i+1]) {
-				return -1;
-			}
-			cmd->err = tokens[i+1];
-			skipcnt += 2;
-			skip = 1;
+	int n, i, j = 0, both;
+
+	for (n = 0; tokens[n]; n++)
+		;
+	/* Each word makes at most one step of the plan (&> file makes two). */
+	cmd->tokens = malloc((n + 1) * sizeof(char*));
+	cmd->redirects = malloc((n + 1) * sizeof(redirect));
+	cmd->nredirects = 0;
+	if (!cmd->tokens || !cmd->redirects) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		redirect *r = cmd->redirects + cmd->nredirects;
+		int words = classify_redirection(tokens[i], r, &both);
+		if (!words) {
+			cmd->tokens[j++] = tokens[i];
+			continue;
 		}
-		if (!strcmp(tokens[i], "&>")) {
-			if(!tokens[i+1]) {
+		if (words == 2) {
+			if (!tokens[i + 1])
 				return -1;
-			}
-			cmd->out = tokens[i+1];
-			cmd->err = tokens[i+1];
-			skipcnt += 2;
-			skip = 1;
+			r->target = tokens[++i];
 		}
-			
-		if(skip){   
-			i++;
+		cmd->nredirects++;
+		if (both) {
+			/* &> file is > file 2>&1: one open, then a copy. */
+			r[1].type = REDIRECT_DUP;
+			r[1].fd = 2;
+			r[1].from = 1;
+			r[1].target = NULL;
+			cmd->nredirects++;
 		}
-		
-		i++;
-	}
-	
-	cmd->tokens = malloc((i-skipcnt+1) * sizeof(char*));	
-	
-	int j = 0;
-	i = 0;
-	while(tokens[i]) {
-		if (!strcmp(tokens[i], "<") ||
-		    !strcmp(tokens[i], ">") ||
-		    !strcmp(tokens[i], "2>") ||
-		    !strcmp(tokens[i], "&>")) {
-			i += 2;
-		 } else {
-			cmd->tokens[j++] = tokens[i++];
-		 }
 	}
 	cmd->tokens[j] = NULL;
-	
 	return 0;
 }
 
-/* Construct command */
-command* construct_command(char** tokens) {
-	if (*tokens == NULL)
+/**
+ * The parser works on the token array in one pass: every token is classified
+ * once, and operators are replaced by NULL so that the words of each simple
+ * command end up NULL-terminated in place.  Then, by recursive descent,
+ *
+ *     list     := and_or ((';' | '&') and_or)* [';' | '&']
+ *     and_or   := timed (('&&' | '||') timed)*
+ *     timed    := ['time'] pipeline
+ *     pipeline := command ('|' command)*
+ *     command  := if | while | for | simple
+ *     if       := 'if' list 'then' list ('elif' list 'then' list)*
+ *                 ['else' list] 'fi'
+ *     while    := ('while' | 'until') list 'do' list 'done'
+ *     for      := 'for' name ['in' word*] ';' 'do' list 'done'
+ *
+ * && and || associate to the left, while the stages of a pipeline and the
+ * elements of a list are nested to the right, which is how they are run.
+ * The keywords are only recognized where a command starts.  Inside if,
+ * while and for, lists end at the next keyword, and may start with ';'
+ * (the lines of a script are joined with ';').
+ */
+typedef struct parser_t {
+	char **tokens;
+	token_kind *kinds;       /* Kind of each token, ending with TOKEN_END */
+	size_t pos;              /* The next token */
+	int depth;               /* How many if/while/for we are inside */
+	int *incomplete;         /* Set if the line ends inside one of them */
+} parser;
+
+/* How each kind of token is written, for error messages */
+static char *token_names[] = { "word", "|", "&&", "||", ";", "&", "newline" };
+
+/* Report an unexpected token, unless the line just ended early inside an
+ * if, while or for, and the caller wants to read more of it. */
+static command *syntax_error(parser *p) {
+	token_kind kind = p->kinds[p->pos];
+	if (kind == TOKEN_END && p->depth > 0 && p->incomplete) {
+		*p->incomplete = 1;
 		return NULL;
+	}
+	fprintf(stderr, "syntax error near unexpected token '%s'\n",
+	        kind == TOKEN_WORD ? p->tokens[p->pos] : token_names[kind]);
+	return NULL;
+}
+
+/* Whether the next token is the given keyword. */
+static int at_keyword(parser *p, char *keyword) {
+	return p->kinds[p->pos] == TOKEN_WORD &&
+	       !strcmp(p->tokens[p->pos], keyword);
+}
+
+/* Whether the next token is a keyword that ends a list. */
+static int at_end_keyword(parser *p) {
+	static char *keywords[] = { "then", "elif", "else", "fi", "do", "done" };
+	size_t i;
+	if (p->kinds[p->pos] != TOKEN_WORD)
+		return 0;
+	for (i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+		if (!strcmp(p->tokens[p->pos], keywords[i]))
+			return 1;
+	}
+	return 0;
+}
 
-	/* Initialize a new command */	
+/* Take the given keyword, or report a syntax error. */
+static int expect_keyword(parser *p, char *keyword) {
+	if (!at_keyword(p, keyword)) {
+		syntax_error(p);
+		return 0;
+	}
+	p->pos++;
+	return 1;
+}
+
+/* Allocate a node of the syntax tree. */
+static command *new_command(command_type type, command *cmd1, command *cmd2) {
 	command *cmd = malloc(sizeof(command));
-	cmd->cmd1 = NULL;
-	cmd->cmd2 = NULL;
+	if (!cmd) {
+		perror("malloc");
+		return NULL;
+	}
+	cmd->type = type;
+	cmd->cmd1 = cmd1;
+	cmd->cmd2 = cmd2;
+	cmd->cmd3 = NULL;
 	cmd->scmd = NULL;
+	cmd->name = NULL;
+	cmd->words = NULL;
+	return cmd;
+}
 
-	if (!is_complex_command(tokens)) {
-		
-		/* Simple command */
-		cmd->scmd = malloc(sizeof(simple_command));
-		cmd->scmd->in = NULL;
-		cmd->scmd->out = NULL;
-		cmd->scmd->err = NULL;
-		cmd->scmd->tokens = NULL;
-		
-		cmd->scmd->builtin = is_builtin(tokens[0]);
-		
-		int err = extract_redirections(tokens, cmd->scmd);
-		if (err == -1) {
-			printf("Error extracting redirections!\n");	
+/* simple := word+ */
+static command *parse_simple(parser *p) {
+	if (p->kinds[p->pos] != TOKEN_WORD || at_end_keyword(p))
+		return syntax_error(p);
+
+	char **words = p->tokens + p->pos;
+	while (p->kinds[p->pos] == TOKEN_WORD)
+		p->pos++;
+
+	command *cmd = new_command(COMMAND_SIMPLE, NULL, NULL);
+	if (!cmd)
+		return NULL;
+	cmd->scmd = malloc(sizeof(simple_command));
+	if (!cmd->scmd) {
+		perror("malloc");
+		free(cmd);
+		return NULL;
+	}
+	cmd->scmd->redirects = NULL;
+	cmd->scmd->nredirects = 0;
+	cmd->scmd->tokens = NULL;
+	/* Builtins and pin/nice/ionice prefixes are recognized once the words
+	 * are expanded (see expand_command). */
+	cmd->scmd->builtin = 0;
+	cmd->scmd->place = NULL;
+
+	int err = extract_redirections(words, cmd->scmd);
+	if (err == -1) {
+		printf("Error extracting redirections!\n");
+		release_command(cmd);
+		return NULL;
+	}
+	return cmd;
+}
+
+static command *parse_list(parser *p);
+
+/* A list inside an if, while or for, up to its next keyword. */
+static command *parse_inner_list(parser *p) {
+	while (p->kinds[p->pos] == TOKEN_SEMI)
+		p->pos++;
+	return parse_list(p);
+}
+
+/* The rest of an if, after 'if' or 'elif' (an elif is an if in the else
+ * part, ending at the same fi). */
+static command *parse_if(parser *p) {
+	command *cmd = new_command(COMMAND_IF, NULL, NULL);
+	if (!cmd)
+		return NULL;
+	if (!(cmd->cmd1 = parse_inner_list(p)) || !expect_keyword(p, "then") ||
+		!(cmd->cmd2 = parse_inner_list(p)))
+		goto fail;
+	if (at_keyword(p, "elif")) {
+		p->pos++;
+		if (!(cmd->cmd3 = parse_if(p)))
+			goto fail;
+		return cmd;
+	}
+	if (at_keyword(p, "else")) {
+		p->pos++;
+		if (!(cmd->cmd3 = parse_inner_list(p)))
+			goto fail;
+	}
+	if (!expect_keyword(p, "fi"))
+		goto fail;
+	return cmd;
+
+fail:
+	release_command(cmd);
+	return NULL;
+}
+
+/* The rest of a while or until loop, after the keyword. */
+static command *parse_while(parser *p, command_type type) {
+	command *cmd = new_command(type, NULL, NULL);
+	if (!cmd)
+		return NULL;
+	if (!(cmd->cmd1 = parse_inner_list(p)) || !expect_keyword(p, "do") ||
+		!(cmd->cmd2 = parse_inner_list(p)) || !expect_keyword(p, "done")) {
+		release_command(cmd);
+		return NULL;
+	}
+	return cmd;
+}
+
+/* The rest of a for loop, after 'for'. */
+static command *parse_for(parser *p) {
+	if (p->kinds[p->pos] != TOKEN_WORD || !VALID_VAR_BEGIN(*p->tokens[p->pos]))
+		return syntax_error(p);
+	char *name = p->tokens[p->pos], *c;
+	for (c = name; *c; c++) {
+		if (!VALID_VAR(*c))
+			return syntax_error(p);
+	}
+	p->pos++;
+
+	/* The words, up to the ';' (or the end of the line) */
+	size_t first = p->pos, n = 0, i;
+	if (at_keyword(p, "in")) {
+		first = ++p->pos;
+		while (p->kinds[p->pos] == TOKEN_WORD)
+			p->pos++;
+		n = p->pos - first;
+		if (p->kinds[p->pos] != TOKEN_SEMI)
+			return syntax_error(p);
+	}
+	while (p->kinds[p->pos] == TOKEN_SEMI)
+		p->pos++;
+
+	command *cmd = new_command(COMMAND_FOR, NULL, NULL);
+	if (!cmd)
+		return NULL;
+	cmd->name = name;
+	cmd->words = malloc((n + 1) * sizeof(char*));
+	if (!cmd->words) {
+		perror("malloc");
+		release_command(cmd);
+		return NULL;
+	}
+	for (i = 0; i < n; i++)
+		cmd->words[i] = p->tokens[first + i];
+	cmd->words[n] = NULL;
+
+	if (!expect_keyword(p, "do") || !(cmd->cmd2 = parse_inner_list(p)) ||
+		!expect_keyword(p, "done")) {
+		release_command(cmd);
+		return NULL;
+	}
+	return cmd;
+}
+
+/* command := if | while | for | simple */
+static command *parse_command(parser *p) {
+	command *cmd;
+	if (at_keyword(p, "if")) {
+		p->pos++;
+		p->depth++;
+		cmd = parse_if(p);
+	} else if (at_keyword(p, "while") || at_keyword(p, "until")) {
+		command_type type = at_keyword(p, "while") ?
+			COMMAND_WHILE : COMMAND_UNTIL;
+		p->pos++;
+		p->depth++;
+		cmd = parse_while(p, type);
+	} else if (at_keyword(p, "for")) {
+		p->pos++;
+		p->depth++;
+		cmd = parse_for(p);
+	} else {
+		return parse_simple(p);
+	}
+	p->depth--;
+	return cmd;
+}
+
+/* pipeline := command ('|' command)* */
+static command *parse_pipeline(parser *p) {
+	command *head = NULL, **tail = &head;
+
+	for (;;) {
+		command *stage = parse_command(p);
+		if (!stage)
+			break;
+		if (p->kinds[p->pos] != TOKEN_PIPE) {
+			*tail = stage;
+			return head;
+		}
+		p->pos++;
+		*tail = new_command(COMMAND_PIPELINE, stage, NULL);
+		if (!*tail) {
+			release_command(stage);
+			break;
+		}
+		tail = &(*tail)->cmd2;
+	}
+	if (head)
+		release_command(head);
+	return NULL;
+}
+
+/* timed := ['time'] pipeline */
+static command *parse_timed(parser *p) {
+	/* 'time' on its own is just a command. */
+	if (p->kinds[p->pos] != TOKEN_WORD || p->kinds[p->pos + 1] != TOKEN_WORD ||
+		strcmp(p->tokens[p->pos], "time"))
+		return parse_pipeline(p);
+
+	p->pos++;
+	command *pipeline = parse_pipeline(p);
+	command *cmd = pipeline ? new_command(COMMAND_TIME, pipeline, NULL) : NULL;
+	if (!cmd && pipeline)
+		release_command(pipeline);
+	return cmd;
+}
+
+/* and_or := timed (('&&' | '||') timed)* */
+static command *parse_and_or(parser *p) {
+	command *left = parse_timed(p);
+
+	while (left && (p->kinds[p->pos] == TOKEN_AND ||
+	                p->kinds[p->pos] == TOKEN_OR)) {
+		command_type type =
+			p->kinds[p->pos] == TOKEN_AND ? COMMAND_AND : COMMAND_OR;
+		p->pos++;
+		command *right = parse_timed(p);
+		command *node = right ? new_command(type, left, right) : NULL;
+		if (!node) {
+			release_command(left);
+			if (right)
+				release_command(right);
 			return NULL;
 		}
+		left = node;
 	}
-	else {
-		/* Complex command */
-		
-		char **t1 = tokens, **t2;
-		int i = 0;
-		while(tokens[i]) {
-			if(is_operator(tokens[i])) {
-				strncpy(cmd->oper, tokens[i], 2);
-				tokens[i] = NULL;
-				t2 = &(tokens[i+1]);
-				break;
-			}
-			i++;
+	return left;
+}
+
+/* list := and_or ((';' | '&') and_or)* [';' | '&'], up to the end of the
+ * line or a keyword */
+static command *parse_list(parser *p) {
+	command *head = NULL, **tail = &head;
+
+	for (;;) {
+		command *cmd = parse_and_or(p);
+		if (!cmd)
+			break;
+		token_kind kind = p->kinds[p->pos];
+		if (kind != TOKEN_SEMI && kind != TOKEN_AMP) {
+			/* The only thing that can follow is the end of the line, or
+			 * a keyword (checked by the caller). */
+			*tail = cmd;
+			return head;
 		}
-		
-		/* Recursively construct the rest of the commands */
-		cmd->cmd1 = construct_command(t1);
-		cmd->cmd2 = construct_command(t2);
+		p->pos++;
+		/* Blank lines inside an if, while or for */
+		while (p->depth > 0 && p->kinds[p->pos] == TOKEN_SEMI)
+			p->pos++;
+
+		/* A trailing ; changes nothing. */
+		if (kind == TOKEN_SEMI &&
+			(p->kinds[p->pos] == TOKEN_END || at_end_keyword(p))) {
+			*tail = cmd;
+			return head;
+		}
+		*tail = new_command(kind == TOKEN_AMP ?
+		                    COMMAND_BACKGROUND : COMMAND_SEQUENCE, cmd, NULL);
+		if (!*tail) {
+			release_command(cmd);
+			break;
+		}
+		tail = &(*tail)->cmd2;
+		if (p->kinds[p->pos] == TOKEN_END || at_end_keyword(p))
+			return head;
 	}
-	
+	if (head)
+		release_command(head);
+	return NULL;
+}
+
+/* Construct command */
+command* construct_command(char** tokens, int *incomplete) {
+	if (*tokens == NULL)
+		return NULL;
+
+	size_t n, i;
+	for (n = 0; tokens[n]; n++)
+		;
+
+	parser p = { tokens, malloc((n + 1) * sizeof(token_kind)), 0, 0,
+	             incomplete };
+	if (!p.kinds) {
+		perror("malloc");
+		return NULL;
+	}
+
+	/* Classify the tokens, and end each simple command at its operator. */
+	for (i = 0; i < n; i++) {
+		p.kinds[i] = classify_token(tokens[i]);
+		if (p.kinds[i] != TOKEN_WORD)
+			tokens[i] = NULL;
+	}
+	p.kinds[n] = TOKEN_END;
+
+	if (incomplete)
+		*incomplete = 0;
+	command *cmd = parse_list(&p);
+	/* Anything left over, like a 'fi' with no 'if' */
+	if (cmd && p.kinds[p.pos] != TOKEN_END) {
+		syntax_error(&p);
+		release_command(cmd);
+		cmd = NULL;
+	}
+	free(p.kinds);
 	return cmd;
 }
 
 /* Release resources */
 void release_command(command *cmd) {
 	
-	if(cmd->scmd && cmd->scmd->tokens) {
+	if(cmd->scmd) {
 		free(cmd->scmd->tokens);
+		free(cmd->scmd->redirects);
+		free(cmd->scmd);
 	}
 	if(cmd->cmd1) {
 		release_command(cmd->cmd1);
@@ -229,6 +684,46 @@ void release_command(command *cmd) {
 	if(cmd->cmd2) {
 		release_command(cmd->cmd2);		
 	}
+	if (cmd->cmd3)
+		release_command(cmd->cmd3);
+	free(cmd->words);
+	free(cmd);
+}
+
+/* Names of the kinds of commands, for print_command */
+static char *command_names[] = {
+	"Simple", "Pipeline", "And", "Or", "Sequence", "Background", "Time",
+	"If", "While", "Until", "For"
+};
+
+/* Operators of the kinds of commands, for command_string */
+static char *command_operators[] = {
+	"", "|", "&&", "||", ";", "&", "time", "if", "while", "until", "for"
+};
+
+/* Write a redirection back out as text. */
+static void write_redirect(FILE *f, redirect *r) {
+	/* The descriptor is left out where it is the default one. */
+	int input = (r->type == REDIRECT_OPEN) ? (r->flags & O_ACCMODE) != O_WRONLY
+	                                       : r->fd == 0;
+	if (r->fd != (input ? 0 : 1))
+		fprintf(f, "%d", r->fd);
+	switch (r->type) {
+		case REDIRECT_OPEN:
+			fprintf(f, "%s %s", (r->flags & O_ACCMODE) == O_RDWR ? "<>" :
+			        input ? "<" : (r->flags & O_APPEND) ? ">>" : ">",
+			        r->target);
+			break;
+		case REDIRECT_DUP:
+			fprintf(f, "%s&%d", input ? "<" : ">", r->from);
+			break;
+		case REDIRECT_CLOSE:
+			fprintf(f, "%s&-", input ? "<" : ">");
+			break;
+		case REDIRECT_HERE:
+			fprintf(f, "<< ...");
+			break;
+	}
 }
 
 /* Print command */
@@ -252,23 +747,26 @@ void print_command(command *cmd, int level) {
 			i++;
 		}
 		
-		if(cmd->scmd->in) {
-			printf("< %s ", cmd->scmd->in);
-		}
-
-		if(cmd->scmd->out) {
-			printf("> %s ", cmd->scmd->out);
-		}
-
-		if(cmd->scmd->err) {
-			printf("2> %s ", cmd->scmd->err);
+		for (i = 0; i < cmd->scmd->nredirects; i++) {
+			redirect *r = &cmd->scmd->redirects[i];
+			if (r->type == REDIRECT_HERE)
+				printf("<< (%zu bytes) ", strlen(r->target));
+			else
+				write_redirect(stdout, r);
+			printf(" ");
 		}
 			
 		printf("\n");
 		return;		 
 	}
 	
-	printf("Pipeline:\n");
+	printf("%s:", command_names[cmd->type]);
+	if (cmd->type == COMMAND_FOR) {
+		printf(" %s in", cmd->name);
+		for (i = 0; cmd->words[i]; i++)
+			printf(" %s", cmd->words[i]);
+	}
+	printf("\n");
 			
 	if(cmd->cmd1) {
 		print_command(cmd->cmd1, level+1);
@@ -277,15 +775,234 @@ void print_command(command *cmd, int level) {
 	if(cmd->cmd2) {
 		print_command(cmd->cmd2, level+1);
 	}
+
+	if (cmd->cmd3)
+		print_command(cmd->cmd3, level+1);
 	
 }
 
-/* Define our valid characters in variable names. */
-#define VALID_VAR_BEGIN(a) (isalpha(a) || (a) == '_')
-#define VALID_VAR(a) (isalnum(a) || (a) == '_')
+/* Write a command back out as text to a stream (see command_string). */
+static void write_command(FILE *f, command *cmd) {
+	if (cmd == NULL)
+		return;
+	if (cmd->scmd) {
+		int i;
+		if (cmd->scmd->place) {
+			for (i = 0; i < cmd->scmd->place->nwords; i++)
+				fprintf(f, "%s ", cmd->scmd->place->words[i]);
+		}
+		for (i = 0; cmd->scmd->tokens[i]; i++)
+			fprintf(f, i ? " %s" : "%s", cmd->scmd->tokens[i]);
+		for (i = 0; i < cmd->scmd->nredirects; i++) {
+			fprintf(f, " ");
+			write_redirect(f, &cmd->scmd->redirects[i]);
+		}
+		return;
+	}
+	if (cmd->type == COMMAND_TIME) {
+		fprintf(f, "time ");
+		write_command(f, cmd->cmd1);
+		return;
+	}
+	if (cmd->type == COMMAND_IF) {
+		fprintf(f, "if ");
+		write_command(f, cmd->cmd1);
+		fprintf(f, " ; then ");
+		write_command(f, cmd->cmd2);
+		/* An elif is an if in the else part. */
+		while (cmd->cmd3 && cmd->cmd3->type == COMMAND_IF && !cmd->cmd3->scmd) {
+			cmd = cmd->cmd3;
+			fprintf(f, " ; elif ");
+			write_command(f, cmd->cmd1);
+			fprintf(f, " ; then ");
+			write_command(f, cmd->cmd2);
+		}
+		if (cmd->cmd3) {
+			fprintf(f, " ; else ");
+			write_command(f, cmd->cmd3);
+		}
+		fprintf(f, " ; fi");
+		return;
+	}
+	if (cmd->type == COMMAND_WHILE || cmd->type == COMMAND_UNTIL ||
+		cmd->type == COMMAND_FOR) {
+		if (cmd->type == COMMAND_FOR) {
+			int i;
+			fprintf(f, "for %s in", cmd->name);
+			for (i = 0; cmd->words[i]; i++)
+				fprintf(f, " %s", cmd->words[i]);
+		} else {
+			fprintf(f, "%s ", command_operators[cmd->type]);
+			write_command(f, cmd->cmd1);
+		}
+		fprintf(f, " ; do ");
+		write_command(f, cmd->cmd2);
+		fprintf(f, " ; done");
+		return;
+	}
+	write_command(f, cmd->cmd1);
+	fprintf(f, cmd->cmd2 ? " %s " : " %s", command_operators[cmd->type]);
+	write_command(f, cmd->cmd2);
+}
+
+/* Write a command back out as text (e.g. for job listings). */
+char *command_string(command *cmd) {
+	char *text = NULL;
+	size_t size;
+	FILE *f = open_memstream(&text, &size);
+	if (!f)
+		return NULL;
+	write_command(f, cmd);
+	fclose(f);
+	return text;
+}
+
+/**
+ * Expand the $variables in a token into d, or if d is NULL just count how
+ * long the result would be.  Returns the length of the expanded token.
+ */
+static size_t expand_variables(char *s, char *d) {
+	size_t len = 0;
+
+	/* Add a character to the result (or just count it). */
+	#define EMIT(c) do { if (d) d[len] = (c); len++; } while (0)
+
+	while (*s) {
+		if (*s == '$') {
+			/* If the $ is followed by a valid variable name, */
+			if (VALID_VAR_BEGIN(*(s + 1))) {
+				/* we find the end of that name and copy the contents of
+				 * that variable into our final string. */
+				char *name = s + 1, *end = name;
+				while (VALID_VAR(*end))
+					end++;
+				char *value = var_get_n(name, end - name);
+				if (value) {
+					size_t vlen = strlen(value);
+					if (d)
+						memcpy(d + len, value, vlen);
+					len += vlen;
+				}
+				s = end - 1;
+			}
+		} else if (*s == '\\') {
+			switch (*(s + 1)) {
+				/* Substitute some escape sequences. */
+				case '$':
+					EMIT('$');
+					break;
+				case ' ':
+					EMIT(' ');
+					break;
+				case '\\':
+					EMIT('\\');
+					break;
+				default:
+					--s;
+					break;
+			}
+			++s;
+		} else {
+			EMIT(*s);
+		}
+		++s;
+	}
+	if (d)
+		d[len] = 0;
+	return len;
+}
+#undef EMIT
+
+/* Runs the command of a $(...), see parser.h */
+char *(*command_substitution)(char *text, size_t *len);
+
+/* Find the next $( in a string that isn't escaped, or NULL. */
+static char *find_substitution(char *s) {
+	for (; *s; s++) {
+		if (*s == '\\' && s[1])
+			s++;
+		else if (s[0] == '$' && s[1] == '(')
+			return s;
+	}
+	return NULL;
+}
+
+/* Find the ) that closes a $( (given what follows it), or NULL. */
+static char *find_closing_paren(char *s) {
+	int depth = 1;
+	for (; *s; s++) {
+		if (s[0] == '$' && s[1] == '(') {
+			depth++;
+			s++;
+		} else if (*s == ')' && --depth == 0) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+/* Expand the variables in the first len characters of s onto a stream. */
+static void expand_part(FILE *f, char *s, size_t len) {
+	char saved = s[len];
+	s[len] = '\0';
+	size_t n = expand_variables(s, NULL);
+	char *buf = malloc(n + 1);
+	if (buf) {
+		expand_variables(s, buf);
+		fwrite(buf, 1, n, f);
+		free(buf);
+	}
+	s[len] = saved;
+}
+
+/**
+ * Expand a token with $(...) in it: each substitution is replaced by the
+ * output of its command, as it is, and the rest of the token has its
+ * variables expanded.  Returns the new token, allocated from the arena, or
+ * NULL if out of memory.
+ */
+static char *substitute_commands(char *token, arena *strings) {
+	char *text = NULL;
+	size_t size = 0;
+	FILE *f = open_memstream(&text, &size);
+	if (!f)
+		return NULL;
+
+	char *s = token;
+	while (*s) {
+		char *open = find_substitution(s);
+		expand_part(f, s, open ? (size_t)(open - s) : strlen(s));
+		if (!open)
+			break;
+
+		char *close = find_closing_paren(open + 2);
+		if (!close) {
+			/* Not closed: leave it as it is. */
+			fputs(open, f);
+			break;
+		}
+		*close = '\0';
+		size_t len = 0;
+		char *output = command_substitution ?
+			command_substitution(open + 2, &len) : NULL;
+		*close = ')';
+		if (output) {
+			fwrite(output, 1, len, f);
+			free(output);
+		}
+		s = close + 1;
+	}
+	fclose(f);
+
+	char *result = text ? arena_alloc(strings, size + 1) : NULL;
+	if (result)
+		memcpy(result, text, size + 1);
+	free(text);
+	return result;
+}
 
-/* Remove double quotes from strings, and expand environment variables. */
-void process_tokens(char **tokens) {
+/* Remove double quotes from strings, and substitute escape sequences. */
+void unquote_tokens(char **tokens) {
 	/* For each token, we remove all the double quotes (if
 	 * they're escaped, replace them with plain double quotes). */
 	int i;
@@ -294,12 +1011,27 @@ void process_tokens(char **tokens) {
 		char *s, *d;
 		s = d = tokens[i];
 		while (*s) {
+			/* The text of a $(...) is left alone: it is processed when
+			 * its command runs. */
+			if (s[0] == '$' && s[1] == '(') {
+				char *close = find_closing_paren(s + 2);
+				size_t n = close ? (size_t)(close - s + 1) : strlen(s);
+				memmove(d, s, n);
+				d += n;
+				s += n;
+				continue;
+			}
 			/* Substitute any escape sequences we find here. */
 			if (*s == '\\') {
 				switch (*(s + 1)) {
 					case '"':
 						*d++ = '"';
 						break;
+					case '$':
+						/* Left for the variable expansion below. */
+						*d++ = '\\';
+						*d++ = '$';
+						break;
 					case 'a':
 						*d++ = '\a';
 						break;
@@ -336,55 +1068,107 @@ void process_tokens(char **tokens) {
 		}
 		*d = 0;
 	}
+}
 
-	/* For each token, build a new string where all the $variables are expanded. */
-	for (i = 0; tokens[i]; ++i) {
-		/* If there is no $, just move to the next token. */
-		if (!strchr(tokens[i], '$'))
-			continue;
+/**
+ * Expand a token: build a new string where all the $variables are expanded
+ * (finding out first how long the result is, so that it can be built in
+ * storage of exactly the right size), and the $(...) commands are run.
+ */
+char *expand_token(char *token, arena *strings) {
+	/* If there is no $, the token stays as it is. */
+	if (!strchr(token, '$'))
+		return token;
 
-		char newtok[1024];
-		char *s = tokens[i], *d = newtok;
-		while (*s) {
-			if (*s == '$') {
-				/* If the $ is followed by a valid variable name, */
-				if (VALID_VAR_BEGIN(*(s + 1))) {
-					char varname[128];
-					char *v = varname;
-					/* we capture that name and copy the contents of that variable
-					 * into our final string. */
-					while (VALID_VAR(*(s + 1)))
-						*v++ = *(s++ + 1);
-					*v = 0;
-					char *value = getenv(varname);
-					if (value) {
-						strcpy(d, getenv(varname));
-						d = strchr(newtok, 0);
-					}
-				}
-			} else if (*s == '\\') {
-				switch (*(s + 1)) {
-					/* Substitute some escape sequences. */
-					case '$':
-						*d++ = '$';
-						break;
-					case ' ':
-						*d++ = ' ';
-						break;
-					case '\\':
-						*d++ = '\\';
-						break;
-					default:
-						--s;
-						break;
-				}
-				++s;
-			} else {
-				*d++ = *s;
-			}
-			++s;
+	/* Commands are run once, while the token is put together. */
+	if (strstr(token, "$("))
+		return substitute_commands(token, strings);
+
+	char *newtok = arena_alloc(strings, expand_variables(token, NULL) + 1);
+	if (newtok)
+		expand_variables(token, newtok);
+	return newtok;
+}
+
+/* Copy a simple command with its words and file names expanded. */
+static simple_command *expand_simple(simple_command *s, arena *strings) {
+	simple_command *copy = arena_alloc(strings, sizeof(simple_command));
+	int i, n;
+
+	if (!copy)
+		return NULL;
+	*copy = *s;
+	for (n = 0; s->tokens[n]; n++)
+		;
+	copy->tokens = arena_alloc(strings, (n + 1) * sizeof(char*));
+	if (!copy->tokens)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		copy->tokens[i] = expand_token(s->tokens[i], strings);
+		if (!copy->tokens[i])
+			return NULL;
+	}
+	copy->tokens[n] = NULL;
+
+	/* Here-documents are taken literally. */
+	if (s->nredirects) {
+		copy->redirects = arena_alloc(strings, s->nredirects * sizeof(redirect));
+		if (!copy->redirects)
+			return NULL;
+		memcpy(copy->redirects, s->redirects, s->nredirects * sizeof(redirect));
+		for (i = 0; i < s->nredirects; i++) {
+			redirect *r = &copy->redirects[i];
+			if (r->type == REDIRECT_OPEN &&
+				!(r->target = expand_token(r->target, strings)))
+				return NULL;
 		}
-		*d = 0;
-		tokens[i] = newtok;
 	}
+
+	copy->tokens = placement_parse(copy->tokens, &copy->place, strings);
+	copy->builtin = copy->tokens[0] ?
+		builtin_takes(is_builtin(copy->tokens[0]), copy->tokens) : 0;
+	return copy;
 }
+
+/**
+ * Copy a command tree, expanding the words of its simple commands from left
+ * to right.  stage is the number of the pipeline stage the command is (or
+ * starts with), or -1 outside of pipelines, for SHSH_PIPELINE_PIN=spread.
+ */
+static command *expand_tree(command *cmd, arena *strings, int stage) {
+	command *copy = arena_alloc(strings, sizeof(command));
+	if (!copy)
+		return NULL;
+	*copy = *cmd;
+	if (cmd->scmd) {
+		copy->scmd = expand_simple(cmd->scmd, strings);
+		if (!copy->scmd)
+			return NULL;
+		if (stage >= 0 && placement_spread_enabled())
+			placement_spread(&copy->scmd->place, stage, strings);
+		return copy;
+	}
+
+	/* The parts of if, while and for are expanded each time they run. */
+	if (cmd->type == COMMAND_IF || cmd->type == COMMAND_WHILE ||
+		cmd->type == COMMAND_UNTIL || cmd->type == COMMAND_FOR)
+		return copy;
+
+	/* "a | b | c" is nested as "a | (b | c)". */
+	int first = -1, rest = -1;
+	if (cmd->type == COMMAND_PIPELINE) {
+		first = (stage < 0) ? 0 : stage;
+		rest = first + 1;
+	}
+	if (cmd->cmd1 && !(copy->cmd1 = expand_tree(cmd->cmd1, strings, first)))
+		return NULL;
+	if (cmd->cmd2 && !(copy->cmd2 = expand_tree(cmd->cmd2, strings, rest)))
+		return NULL;
+	return copy;
+}
+
+/* Copy a command tree with its words expanded, see parser.h. */
+command *expand_command(command *cmd, arena *strings) {
+	return expand_tree(cmd, strings, -1);
+}
+
@@ -2,6 +2,21 @@
 #define __PARSER_H__
 
 #include "shell.h"
+#include "arena.h"
+
+/* Kinds of tokens on a command line */
+typedef enum token_kind_t {
+	TOKEN_WORD,
+	TOKEN_PIPE,              /* | */
+	TOKEN_AND,               /* && */
+	TOKEN_OR,                /* || */
+	TOKEN_SEMI,              /* ; */
+	TOKEN_AMP,               /* & */
+	TOKEN_END                /* The end of the line */
+} token_kind;
+
+/* Determine which kind of token a token is */
+token_kind classify_token(char *token);
 
 /* Determine if a token is a special operator (like '|') */
 int is_operator(char *token); 
@@ -15,17 +30,21 @@ int is_relative(char* path);
 /* Determine if a path is inside the user's home directory. */
 int is_in_home(char *path, char *home);
 
-/* Determine if a command is complex (has an operator like pipe '|') */
-int is_complex_command(char **tokens);
+/* Parse a line into its tokens. Returns a NULL-terminated array of
+ * pointers into the line, which the caller frees, or NULL if out of memory. */
+char **parse_line(char *line);
 
-/* Parse a line into its tokens */
-void parse_line(char *line, char **tokens);
-
-/* Extract redirections of stdin, stdout, or stderr */
+/* Split off the redirections of a simple command (<, >, >>, <>, <<, &>,
+ * n>&m, n<&-...) into its plan of redirections */
 int extract_redirections(char** tokens, simple_command* cmd);
 
-/* Construct command */
-command* construct_command(char** tokens);
+/* Construct the syntax tree of a command line, with the usual shell
+ * precedence: | binds tightest, then && and ||, then ; and &, with if,
+ * while, until and for as commands.  The operator tokens are overwritten.
+ * Returns NULL (after reporting it) on a syntax error.  If incomplete is
+ * not NULL and the line just ends inside an if, while or for, nothing is
+ * reported and *incomplete is set instead, so more lines can be added. */
+command* construct_command(char** tokens, int *incomplete);
 
 /* Release resources */
 void release_command(command *cmd);
@@ -33,7 +52,29 @@ void release_command(command *cmd);
 /* Print command */
 void print_command(command *cmd, int level);
 
-/* Remove double quotes from strings and expand environment variables. */
-void process_tokens(char **tokens);
+/* Write a command back out as text. Returns a string the caller frees. */
+char *command_string(command *cmd);
+
+/* Remove double quotes from the tokens of a line and substitute escape
+ * sequences, in place.  This is done before the line is parsed. */
+void unquote_tokens(char **tokens);
+
+/* Expand the variables and $(...) commands in a token.  Returns the token
+ * itself if there is nothing to expand, a new one allocated from the arena,
+ * or NULL if out of memory. */
+char *expand_token(char *token, arena *strings);
+
+/* Copy a command tree (from construct_command) with the words and file
+ * names of its simple commands expanded, and their builtins and
+ * pin/nice/ionice prefixes recognized, for running it.  The tree itself is
+ * left as it is, so it can be run again later.  Everything is allocated from
+ * the arena.  Returns NULL if out of memory.  The shell expands one simple
+ * command or pipeline at a time, just before running it. */
+command *expand_command(command *cmd, arena *strings);
+
+/* Run the command of a $(...) and return its output (malloc'd, with the
+ * length in len), or NULL.  Set by the shell; without it, $(...) expands
+ * to nothing. */
+extern char *(*command_substitution)(char *text, size_t *len);
 
 #endif
@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "placement.h"
+#include "vars.h"
+
+/* From linux/ioprio.h, for ioprio_set (which has no glibc wrapper) */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT    1
+#define IOPRIO_CLASS_BE    2
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+/**
+ * Parse a list of CPUs, like taskset -c: "3", "0,2" or "4-7,12".
+ * Returns -1 if it is not one.
+ */
+static int parse_cpus(char *s, cpu_set_t *cpus) {
+	CPU_ZERO(cpus);
+	while (*s) {
+		char *end;
+		long first = strtol(s, &end, 10), last;
+		if (end == s || first < 0)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			s = end + 1;
+			last = strtol(s, &end, 10);
+			if (end == s || last < first)
+				return -1;
+		}
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; ++first)
+			CPU_SET(first, cpus);
+		if (*end == ',' && end[1])
+			end++;
+		else if (*end)
+			return -1;
+		s = end;
+	}
+	return CPU_COUNT(cpus) ? 0 : -1;
+}
+
+/* Parse a whole number (possibly negative).  Returns -1 if it is not one. */
+static int parse_int(char *s, int *n) {
+	char *end;
+	long value = strtol(s, &end, 10);
+	if (!*s || *end || value < -1000 || value > 1000)
+		return -1;
+	*n = value;
+	return 0;
+}
+
+/**
+ * Parse an I/O scheduling class, optionally with a level (0-7, where 0 is
+ * the most favoured): "idle", "best-effort:2" (or "be:2"), "realtime"
+ * (or "rt").  Returns -1 if it is not one.
+ */
+static int parse_ioprio(char *s, int *ioprio) {
+	static struct { char *name; int class; } classes[] = {
+		{ "idle", IOPRIO_CLASS_IDLE },
+		{ "best-effort", IOPRIO_CLASS_BE }, { "be", IOPRIO_CLASS_BE },
+		{ "realtime", IOPRIO_CLASS_RT }, { "rt", IOPRIO_CLASS_RT },
+	};
+	size_t i, len = strcspn(s, ":");
+	int level = 4;
+
+	if (s[len] == ':' && (parse_int(s + len + 1, &level) == -1 ||
+	                      level < 0 || level > 7))
+		return -1;
+	for (i = 0; i < sizeof(classes) / sizeof(classes[0]); ++i) {
+		if (strlen(classes[i].name) == len &&
+			!strncmp(s, classes[i].name, len)) {
+			/* The idle class has no levels. */
+			if (classes[i].class == IOPRIO_CLASS_IDLE)
+				level = 0;
+			*ioprio = IOPRIO_PRIO_VALUE(classes[i].class, level);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Take the prefixes off the front of a simple command's words:
+ * For example: words[0] = 'pin'    words[1] = '2-3'
+ *              words[2] = 'nice'   words[3] = '5'   (or '-5', '-n' '5')
+ *              words[4] = 'ionice' words[5] = 'idle'
+ *              words[6] = 'sort'   ...
+ */
+char **placement_parse(char **words, placement **place, arena *strings) {
+	placement p;
+	char **start = words;
+
+	*place = NULL;
+	p.set = 0;
+	/* Each prefix needs an argument and a command after it. */
+	while (words[0] && words[1]) {
+		char **arg = words + 1;
+		if (!strcmp(words[0], "pin") && arg[1] &&
+			parse_cpus(arg[0], &p.cpus) == 0) {
+			p.set |= PLACE_CPUS;
+		} else if (!strcmp(words[0], "nice")) {
+			/* As for nice(1), -N is the increment N (and --N is -N). */
+			char *n = arg[0];
+			if (!strcmp(n, "-n") && arg[1])
+				n = *++arg;
+			else if (n[0] == '-')
+				n++;
+			if (!arg[1] || parse_int(n, &p.nice) == -1)
+				break;
+			p.set |= PLACE_NICE;
+		} else if (!strcmp(words[0], "ionice") && arg[1] &&
+			parse_ioprio(arg[0], &p.ioprio) == 0) {
+			p.set |= PLACE_IOPRIO;
+		} else {
+			break;
+		}
+		words = arg + 1;
+	}
+	if (!p.set)
+		return words;
+
+	*place = arena_alloc(strings, sizeof(placement));
+	if (!*place) {
+		perror("arena_alloc");
+		return words;
+	}
+	p.words = start;
+	p.nwords = words - start;
+	**place = p;
+	return words;
+}
+
+/* Apply the settings to the calling process. */
+int placement_apply(placement *place) {
+	if (!place)
+		return 0;
+	if ((place->set & PLACE_CPUS) &&
+		sched_setaffinity(0, sizeof(cpu_set_t), &place->cpus) == -1) {
+		perror("pin");
+		return -1;
+	}
+	if (place->set & PLACE_NICE) {
+		/* Like nice(1), an increment we may not take is only a warning. */
+		errno = 0;
+		if (nice(place->nice) == -1 && errno)
+			perror("nice");
+	}
+	if ((place->set & PLACE_IOPRIO) &&
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, place->ioprio) == -1) {
+		perror("ionice");
+		return -1;
+	}
+	return 0;
+}
+
+/* Whether the stages of pipelines are spread across CPUs. */
+int placement_spread_enabled(void) {
+	char *mode = var_get("SHSH_PIPELINE_PIN");
+	return mode && !strcmp(mode, "spread");
+}
+
+/**
+ * Pin a stage of a pipeline to the stage'th CPU the shell may run on
+ * (wrapping around when there are more stages than CPUs), so that the
+ * stages do not keep migrating between the same cores.
+ */
+void placement_spread(placement **place, int stage, arena *strings) {
+	cpu_set_t allowed;
+	int cpu, n;
+
+	if (*place && ((*place)->set & PLACE_CPUS))
+		return;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 ||
+		!(n = CPU_COUNT(&allowed)))
+		return;
+	if (!*place) {
+		*place = arena_alloc(strings, sizeof(placement));
+		if (!*place) {
+			perror("arena_alloc");
+			return;
+		}
+		(*place)->set = 0;
+		(*place)->nwords = 0;
+	}
+
+	/* Find the (stage % n)th allowed CPU. */
+	stage %= n;
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, &allowed) && stage-- == 0)
+			break;
+	}
+	CPU_ZERO(&(*place)->cpus);
+	CPU_SET(cpu, &(*place)->cpus);
+	(*place)->set |= PLACE_CPUS;
+}
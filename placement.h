@@ -0,0 +1,49 @@
+#ifndef __PLACEMENT_H__
+#define __PLACEMENT_H__
+
+#include <sched.h>          /* cpu_set_t, with _GNU_SOURCE */
+
+#include "arena.h"
+
+/* Which settings of a placement are given */
+#define PLACE_CPUS   1
+#define PLACE_NICE   2
+#define PLACE_IOPRIO 4
+
+/**
+ * Where and how eagerly a command runs, from the prefixes in front of it:
+ *
+ *     pin 2-3 nice 5 ionice idle sort big.txt
+ *
+ * The settings are applied in the child before exec, so no taskset, nice
+ * or ionice process is needed in between.
+ */
+typedef struct placement_t {
+	int set;                 /* PLACE_* flags */
+	cpu_set_t cpus;          /* For pin */
+	int nice;                /* Added to the niceness, like nice(1) */
+	int ioprio;              /* Class and level, as for ioprio_set */
+	char **words;            /* The prefix words, to write them back */
+	int nwords;
+} placement;
+
+/* Take the pin/nice/ionice prefixes off the front of the words of a simple
+ * command.  Returns the words after them, with *place set to the settings
+ * (allocated from the arena, or NULL if there were none).  A prefix whose
+ * argument does not parse is left alone, to be run as a program. */
+char **placement_parse(char **words, placement **place, arena *strings);
+
+/* Apply the settings to the calling process (a child about to exec).
+ * Returns -1 (after reporting it) if one of them could not be applied. */
+int placement_apply(placement *place);
+
+/* Whether SHSH_PIPELINE_PIN=spread asks for the stages of pipelines to be
+ * spread across the CPUs the shell may run on. */
+int placement_spread_enabled(void);
+
+/* Pin the given stage of a pipeline to a CPU of its own (in turn from the
+ * shell's CPUs), unless the stage was already given CPUs.  A placement is
+ * allocated from the arena if the stage had none. */
+void placement_spread(placement **place, int stage, arena *strings);
+
+#endif
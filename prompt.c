@@ -0,0 +1,190 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pwd.h>
+
+#include "parser.h"
+#include "prompt.h"
+#include "vars.h"
+
+/**
+ * The PROMPT template is compiled once into a list of segments (literal
+ * text, username, hostname, working directory), and only compiled again
+ * when PROMPT changes.  The username and hostname are looked up once, and
+ * the working directory is handed to us by cd, so printing a prompt is
+ * just filling a buffer and one write().
+ */
+
+#define MAX_HOSTNAME 64
+
+/* Prompt used when PROMPT is not set. */
+#define DEFAULT_PROMPT "\\u@\\h:\\w$ "
+
+/* Kinds of segments */
+#define SEG_TEXT 0
+#define SEG_USER 1
+#define SEG_HOST 2
+#define SEG_CWD  3
+
+typedef struct prompt_segment_t {
+	int type;
+	size_t start, len;      /* SEG_TEXT: the text, in 'text' */
+} prompt_segment;
+
+static prompt_segment *segments;
+static size_t nsegments;
+static char *text;              /* Literal text of all the segments */
+static int compiled;
+
+static char *username, *homedir;
+static char host[MAX_HOSTNAME];
+static char *cwd;               /* Current directory, with ~ for home */
+
+static char *out;               /* The rendered prompt */
+static size_t outsize;
+
+/* Look up the things that don't change while the shell runs. */
+static void init_identity(void) {
+	struct passwd *pw = getpwuid(getuid());
+	username = strdup(pw ? pw->pw_name : "");
+	/* Get the home directory, so we can print the current directory
+	 * relative to it. */
+	homedir = strdup(pw ? pw->pw_dir : "");
+	gethostname(host, MAX_HOSTNAME - 1);
+}
+
+/* Add a segment to the list (merging literal text with the previous one). */
+static void add_segment(int type, size_t start) {
+	if (type == SEG_TEXT && nsegments &&
+		segments[nsegments - 1].type == SEG_TEXT) {
+		segments[nsegments - 1].len++;
+		return;
+	}
+	segments[nsegments].type = type;
+	segments[nsegments].start = start;
+	segments[nsegments].len = (type == SEG_TEXT);
+	nsegments++;
+}
+
+/* Compile the contents of the PROMPT environment variable into segments. */
+static void compile(void) {
+	char *pstr = var_get("PROMPT");
+	if (!pstr)
+		pstr = DEFAULT_PROMPT;
+
+	size_t len = strlen(pstr), i, ntext = 0;
+	free(segments);
+	free(text);
+	/* There can't be more segments, or more text, than characters. */
+	segments = malloc((len + 1) * sizeof(prompt_segment));
+	text = malloc(len + 1);
+	nsegments = 0;
+	if (!segments || !text)
+		return;
+
+	for (i = 0; i < len; ++i) {
+		if (pstr[i] == '\\') {
+			switch (pstr[++i]) {
+				case 'u':
+					add_segment(SEG_USER, 0);
+					break;
+				case 'h':
+					add_segment(SEG_HOST, 0);
+					break;
+				case 'w':
+					add_segment(SEG_CWD, 0);
+					break;
+				case 'e':
+					add_segment(SEG_TEXT, ntext);
+					text[ntext++] = '\033';
+					break;
+				default:
+					break;
+			}
+		} else {
+			add_segment(SEG_TEXT, ntext);
+			text[ntext++] = pstr[i];
+		}
+	}
+	compiled = 1;
+}
+
+/* Recompile the prompt template before it is next printed. */
+void prompt_invalidate(void) {
+	compiled = 0;
+}
+
+/* Tell the prompt what the current directory is. */
+void prompt_set_cwd(char *dir) {
+	if (!username)
+		init_identity();
+
+	/* Rewrite the current directory relative to the home directory (if possible). */
+	free(cwd);
+	if (*homedir && is_in_home(dir, homedir)) {
+		size_t hlen = strlen(homedir);
+		cwd = malloc(strlen(dir) - hlen + 2);
+		if (cwd) {
+			cwd[0] = '~';
+			strcpy(cwd + 1, dir + hlen);
+		}
+	} else {
+		cwd = strdup(dir);
+	}
+}
+
+/* Append a string to the rendered prompt. */
+static void append(size_t *used, char *s, size_t len) {
+	if (*used + len > outsize) {
+		size_t newsize = outsize ? outsize : 128;
+		while (newsize < *used + len)
+			newsize *= 2;
+		char *newout = realloc(out, newsize);
+		if (!newout)
+			return;
+		out = newout;
+		outsize = newsize;
+	}
+	memcpy(out + *used, s, len);
+	*used += len;
+}
+
+/* Print the prompt string. */
+void print_prompt(void) {
+	if (!username)
+		init_identity();
+	if (!compiled)
+		compile();
+	if (!cwd) {
+		char *dir = getcwd(NULL, 0);
+		prompt_set_cwd(dir ? dir : "");
+		free(dir);
+	}
+
+	size_t used = 0, i;
+	for (i = 0; i < nsegments; ++i) {
+		prompt_segment *seg = &segments[i];
+		switch (seg->type) {
+			case SEG_TEXT:
+				append(&used, text + seg->start, seg->len);
+				break;
+			case SEG_USER:
+				append(&used, username, strlen(username));
+				break;
+			case SEG_HOST:
+				append(&used, host, strlen(host));
+				break;
+			case SEG_CWD:
+				if (cwd)
+					append(&used, cwd, strlen(cwd));
+				break;
+		}
+	}
+
+	/* Anything else the shell printed goes first. */
+	fflush(stdout);
+	if (used && write(fileno(stdout), out, used) == -1)
+		perror("write");
+}
@@ -0,0 +1,14 @@
+#ifndef __PROMPT_H__
+#define __PROMPT_H__
+
+/* Print the prompt string. */
+void print_prompt(void);
+
+/* Recompile the prompt template before it is next printed (call this when
+ * the PROMPT variable has changed). */
+void prompt_invalidate(void);
+
+/* Tell the prompt what the current directory is. */
+void prompt_set_cwd(char *cwd);
+
+#endif
@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <spawn.h>
+
+#include "shell.h"
+#include "builtins.h"
+#include "redirect.h"
+
+/* If we write to any files, make sure that we set the permissions to 644. */
+#define MODE_644 (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+/* Descriptors opened in the shell are moved at least this high when a plan
+ * sets up descriptors above stderr, so that they cannot be overwritten by
+ * one of its steps before they are used. */
+#define FIRST_HIGH_FD 10
+
+/**
+ * Makes a descriptor to read a here-document from.  A body that fits in a
+ * pipe is written into one right away (so no writer has to stay around);
+ * a bigger one goes into an anonymous memfd file, rewound to the start.
+ * Either way nothing touches the file system and nothing can block.
+ * Returns the descriptor (close-on-exec), or -1 on failure.
+ */
+static int open_here(char *body) {
+	size_t len = strlen(body);
+	int pfd[2];
+
+	if (make_pipe(pfd) == 0) {
+		int capacity = fcntl(pfd[1], F_GETPIPE_SZ);
+		if (capacity > 0 && len <= (size_t)capacity &&
+			write_all(pfd[1], body, len) == 0) {
+			close(pfd[1]);
+			return pfd[0];
+		}
+		close(pfd[0]);
+		close(pfd[1]);
+	}
+
+	int fd = memfd_create("here-document", MFD_CLOEXEC);
+	if (fd == -1 || write_all(fd, body, len) == -1 ||
+		lseek(fd, 0, SEEK_SET) == -1) {
+		perror("here-document");
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Open the file of a redirection, or the here-document, close-on-exec.
+ * Returns -1 (after reporting it) on failure. */
+static int open_target(redirect *r) {
+	if (r->type == REDIRECT_HERE)
+		return open_here(r->target);
+	int fd = open(r->target, r->flags | O_CLOEXEC, MODE_644);
+	if (fd == -1)
+		perror(r->target);
+	return fd;
+}
+
+/* Make room for the descriptors the shell opens for a command. */
+static int files_init(redirect_files *files, simple_command *s) {
+	files->n = 0;
+	files->fds = NULL;
+	if (s->nredirects == 0)
+		return 0;
+	files->fds = malloc(s->nredirects * sizeof(int));
+	if (!files->fds) {
+		perror("malloc");
+		return -1;
+	}
+	return 0;
+}
+
+/* Carry out the redirections in a forked child. */
+int redirect_apply(simple_command *s) {
+	int i;
+	for (i = 0; i < s->nredirects; ++i) {
+		redirect *r = &s->redirects[i];
+		int fd;
+		switch (r->type) {
+			case REDIRECT_OPEN:
+			case REDIRECT_HERE:
+				fd = open_target(r);
+				if (fd == -1)
+					return -1;
+				/* Opened right where it belongs: keep it across exec. */
+				if (fd == r->fd) {
+					fcntl(fd, F_SETFD, 0);
+					break;
+				}
+				if (dup2(fd, r->fd) == -1) {
+					perror("dup2");
+					return -1;
+				}
+				close(fd);
+				break;
+			case REDIRECT_DUP:
+				if (r->from != r->fd && dup2(r->from, r->fd) == -1) {
+					fprintf(stderr, "%d: %s\n", r->from, strerror(errno));
+					return -1;
+				}
+				break;
+			case REDIRECT_CLOSE:
+				close(r->fd);
+				break;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Open the files in the shell and turn the plan into file actions.  Every
+ * step becomes one dup2 or close in the child, which posix_spawn runs in
+ * order; opening in the shell means a missing file is reported by name
+ * (and not taken for a missing program).
+ */
+int redirect_spawn_actions(simple_command *s,
+                           posix_spawn_file_actions_t *actions,
+                           redirect_files *files) {
+	int i, high = 0;
+
+	if (files_init(files, s) == -1)
+		return -1;
+	for (i = 0; i < s->nredirects; ++i) {
+		if (s->redirects[i].fd > 2)
+			high = 1;
+	}
+
+	for (i = 0; i < s->nredirects; ++i) {
+		redirect *r = &s->redirects[i];
+		int fd;
+		switch (r->type) {
+			case REDIRECT_OPEN:
+			case REDIRECT_HERE:
+				fd = open_target(r);
+				if (fd == -1) {
+					redirect_close(files);
+					return -1;
+				}
+				if (high && fd < FIRST_HIGH_FD) {
+					int moved = fcntl(fd, F_DUPFD_CLOEXEC, FIRST_HIGH_FD);
+					close(fd);
+					if (moved == -1) {
+						perror("fcntl");
+						redirect_close(files);
+						return -1;
+					}
+					fd = moved;
+				}
+				files->fds[files->n++] = fd;
+				posix_spawn_file_actions_adddup2(actions, fd, r->fd);
+				break;
+			case REDIRECT_DUP:
+				posix_spawn_file_actions_adddup2(actions, r->from, r->fd);
+				break;
+			case REDIRECT_CLOSE:
+				posix_spawn_file_actions_addclose(actions, r->fd);
+				break;
+		}
+	}
+	return 0;
+}
+
+/* The descriptors a plan can name: 0-9 */
+#define NPLAN_FDS 10
+
+/* Open the files in the shell and work out the descriptors of a builtin. */
+int redirect_open(simple_command *s, int fds[3], redirect_files *files) {
+	int map[NPLAN_FDS], i;
+
+	if (files_init(files, s) == -1)
+		return -1;
+	/* Follow where each descriptor ends up, without touching the shell's
+	 * own. */
+	for (i = 0; i < NPLAN_FDS; ++i)
+		map[i] = i;
+	for (i = 0; i < s->nredirects; ++i) {
+		redirect *r = &s->redirects[i];
+		int fd = -1;
+		switch (r->type) {
+			case REDIRECT_OPEN:
+			case REDIRECT_HERE:
+				fd = open_target(r);
+				if (fd == -1) {
+					redirect_close(files);
+					return -1;
+				}
+				files->fds[files->n++] = fd;
+				break;
+			case REDIRECT_DUP:
+				fd = (r->from < NPLAN_FDS) ? map[r->from] : r->from;
+				break;
+			case REDIRECT_CLOSE:
+				break;
+		}
+		if (r->fd < NPLAN_FDS)
+			map[r->fd] = fd;
+	}
+	for (i = 0; i < 3; ++i)
+		fds[i] = map[i];
+	return 0;
+}
+
+/* Close the files the shell opened for a command. */
+void redirect_close(redirect_files *files) {
+	int i;
+	for (i = 0; i < files->n; ++i)
+		close(files->fds[i]);
+	free(files->fds);
+	files->fds = NULL;
+	files->n = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef __REDIRECT_H__
+#define __REDIRECT_H__
+
+#include <spawn.h>
+
+#include "shell.h"
+
+/**
+ * Carrying out the plan of redirections of a simple command (see
+ * extract_redirections), either in a forked child or, for posix_spawn, as
+ * file actions with the files opened in the shell.  Builtins that run in
+ * the shell get the resulting stdin/stdout/stderr as descriptors instead.
+ */
+
+/* Descriptors that the shell opened for a command, to close after it has
+ * been launched (or has run, for a builtin) */
+typedef struct redirect_files_t {
+	int *fds;
+	int n;
+} redirect_files;
+
+/* Carry out the redirections in the calling process (a forked child).
+ * Returns -1, after reporting it, if a file could not be opened. */
+int redirect_apply(simple_command *s);
+
+/* Open the files of the redirections in the shell (close-on-exec), into
+ * files, and add the dup2/close steps to actions.  Returns -1 (with nothing
+ * left open) if a file could not be opened. */
+int redirect_spawn_actions(simple_command *s,
+                           posix_spawn_file_actions_t *actions,
+                           redirect_files *files);
+
+/* Open the files of the redirections in the shell, into files, and set
+ * fds[0..2] to the descriptors a builtin should use for stdin, stdout and
+ * stderr (-1 where closed).  Returns -1 (with nothing left open) if a file
+ * could not be opened. */
+int redirect_open(simple_command *s, int fds[3], redirect_files *files);
+
+/* Close the files opened by redirect_spawn_actions or redirect_open. */
+void redirect_close(redirect_files *files);
+
+#endif
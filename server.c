@@ -0,0 +1,606 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "server.h"
+#include "vars.h"
+#include "hash.h"
+
+/**
+ * One thread serves every connection from an epoll loop.  A request runs in
+ * a forked child, which writes its output (when captured) and, as it exits,
+ * its directory and variables into memfds; a pidfd of the child tells the
+ * loop when it is done, so the server never blocks in wait and needs no
+ * thread or signal handler per child.
+ */
+
+/* Events taken from epoll at a time */
+#define MAX_EVENTS 64
+
+/* How much to read from a connection at a time */
+#define READ_CHUNK 65536
+
+/* What an epoll event is about */
+typedef enum watch_type_t {
+	WATCH_LISTENER,
+	WATCH_SOCKET,
+	WATCH_CHILD
+} watch_type;
+
+typedef struct watch_t {
+	watch_type type;
+	struct connection_t *conn;
+} watch;
+
+/* A growable byte buffer */
+typedef struct buffer_t {
+	char *data;
+	size_t used, size;
+} buffer;
+
+typedef struct connection_t {
+	int fd;
+	watch sock, child;         /* Events of the socket and of the child */
+	unsigned events;           /* What the socket is watched for */
+	buffer in;                 /* Requests read but not started yet */
+	buffer out;                /* Responses not sent yet */
+	size_t sent;               /* How much of out has gone */
+	int eof;                   /* The client has stopped sending */
+	int gone;                  /* The client has gone away altogether */
+	int dead;                  /* Dropped, to be freed */
+	char *state;               /* Directory and variables, see write_state */
+	size_t state_len;
+
+	/* The request being run */
+	pid_t pid;                 /* 0 if there is none */
+	int pidfd;
+	int capture;
+	int files[3];              /* memfds for its stdout, stderr and state */
+
+	struct connection_t *next, *prev;
+} connection;
+
+static int epfd = -1, listen_fd = -1;
+static watch listener = { WATCH_LISTENER, NULL };
+static connection *connections;
+static connection *dropped;   /* Freed once the current events are handled */
+
+/* Runs the text of a request, in the child */
+static int (*run_text)(char *text);
+
+/* The server's own directory and variables, where connections start */
+static char *initial_state;
+static size_t initial_state_len;
+
+/* In a child: where to leave the directory and variables on exit, and the
+ * child itself (the subshells it forks inherit the atexit handler) */
+static int state_fd = -1;
+static pid_t state_pid;
+
+/* Add data to a buffer.  Returns -1 if out of memory. */
+static int buffer_append(buffer *b, char *data, size_t len) {
+	if (b->used + len > b->size) {
+		size_t size = b->size ? b->size : 4096;
+		while (size < b->used + len)
+			size *= 2;
+		char *grown = realloc(b->data, size);
+		if (!grown)
+			return -1;
+		b->data = grown;
+		b->size = size;
+	}
+	memcpy(b->data + b->used, data, len);
+	b->used += len;
+	return 0;
+}
+
+/* Write one variable of the state. */
+static void write_var(char *entry, int exported, void *arg) {
+	FILE *f = arg;
+	fputc(exported ? 'x' : 'l', f);
+	fputs(entry, f);
+	fputc('\0', f);
+}
+
+/**
+ * Write the directory and the variables of the shell: the directory, then
+ * for each variable 'x' (exported) or 'l' and its "NAME=value", each ending
+ * in '\0'.
+ */
+static void write_state(FILE *f) {
+	char *cwd = getcwd(NULL, 0);
+	fputs(cwd ? cwd : "/", f);
+	fputc('\0', f);
+	free(cwd);
+	vars_walk(write_var, f);
+}
+
+/* On the exit of a child (whether at the end of the request or by the exit
+ * builtin), leave its state for the server. */
+static void save_state(void) {
+	if (state_fd == -1 || getpid() != state_pid)
+		return;
+	FILE *f = fdopen(state_fd, "w");
+	if (f) {
+		write_state(f);
+		fclose(f);
+	}
+}
+
+/* Take on the directory and variables of a connection (in the child, on
+ * its own copy of them). */
+static void load_state(char *state, size_t len) {
+	char *end = state + len, *p, *path = var_get("PATH");
+
+	path = path ? strdup(path) : NULL;
+	if (chdir(state) == -1)
+		perror(state);
+	vars_clear();
+	for (p = state + strlen(state) + 1; p < end; p += strlen(p) + 1) {
+		char *eq = strchr(p + 1, '=');
+		if (!eq)
+			continue;
+		*eq = '\0';
+		var_set(p + 1, eq + 1, *p == 'x');
+		*eq = '=';
+	}
+
+	/* Commands are found again under another PATH or directory. */
+	char *now = var_get("PATH");
+	if (!path || !now || strcmp(path, now))
+		hash_clear();
+	hash_cwd_changed();
+	free(path);
+}
+
+/* Read all of a memfd.  Returns a malloc'd buffer, or NULL. */
+static char *read_memfd(int fd, size_t *len) {
+	struct stat st;
+	char *data;
+	*len = 0;
+	if (fstat(fd, &st) == -1 || !(data = malloc(st.st_size + 1)))
+		return NULL;
+	while (*len < (size_t)st.st_size) {
+		ssize_t n = pread(fd, data + *len, st.st_size - *len, *len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		*len += n;
+	}
+	return data;
+}
+
+/* Close the memfds of a request. */
+static void close_files(connection *c) {
+	int i;
+	for (i = 0; i < 3; ++i) {
+		if (c->files[i] != -1)
+			close(c->files[i]);
+		c->files[i] = -1;
+	}
+}
+
+/* Watch the socket of a connection for what it is waiting for: requests,
+ * until the client stops sending, and room for the responses not sent. */
+static void watch_socket(connection *c) {
+	unsigned events = (c->eof ? 0 : EPOLLIN) |
+	                  (c->sent < c->out.used ? EPOLLOUT : 0);
+	if (c->gone || events == c->events)
+		return;
+	struct epoll_event ev = { events, { .ptr = &c->sock } };
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+		perror("epoll_ctl");
+	c->events = events;
+}
+
+/* Send as much of the responses as the socket takes.  Returns -1 if the
+ * client cannot be written to any more. */
+static int send_responses(connection *c) {
+	while (c->sent < c->out.used) {
+		ssize_t n = send(c->fd, c->out.data + c->sent, c->out.used - c->sent,
+		                 MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n == -1)
+			return -1;
+		c->sent += n;
+	}
+	if (c->sent == c->out.used)
+		c->sent = c->out.used = 0;
+	watch_socket(c);
+	return 0;
+}
+
+/* Queue a response.  Returns -1 if it cannot be sent. */
+static int respond(connection *c, int status, char *out, size_t out_len,
+                   char *err, size_t err_len) {
+	char header[SERVER_HEADER_MAX];
+	int n = snprintf(header, sizeof(header), "%d %zu %zu\n",
+	                 status, out_len, err_len);
+	if (buffer_append(&c->out, header, n) == -1 ||
+		buffer_append(&c->out, out, out_len) == -1 ||
+		buffer_append(&c->out, err, err_len) == -1)
+		return -1;
+	return send_responses(c);
+}
+
+/* Stop serving a connection.  It is freed once the events at hand have
+ * been handled, as some of them may still point at it. */
+static void drop(connection *c) {
+	if (c->dead)
+		return;
+	if (c->pid) {
+		/* The request still runs; the connection goes when it ends. */
+		c->gone = c->eof = 1;
+		epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+		return;
+	}
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		connections = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	c->dead = 1;
+	c->next = dropped;
+	dropped = c;
+}
+
+/* Run a request, in the child.  Does not return. */
+static void run_child(connection *c, char *text, size_t len) {
+	connection *other;
+	int i;
+
+	/* Nothing of the server's is of use here. */
+	close(epfd);
+	close(listen_fd);
+	for (other = connections; other; other = other->next) {
+		close(other->fd);
+		if (other == c)
+			continue;
+		if (other->pid)
+			close(other->pidfd);
+		for (i = 0; i < 3; ++i) {
+			if (other->files[i] != -1)
+				close(other->files[i]);
+		}
+	}
+
+	int null = open("/dev/null", O_RDONLY);
+	if (null != -1 && null != STDIN_FILENO) {
+		dup2(null, STDIN_FILENO);
+		close(null);
+	}
+	if (c->capture) {
+		dup2(c->files[0], STDOUT_FILENO);
+		dup2(c->files[1], STDERR_FILENO);
+	}
+	state_fd = c->files[2];
+	state_pid = getpid();
+	load_state(c->state, c->state_len);
+	atexit(save_state);
+
+	char *copy = strndup(text, len);
+	int status = copy ? run_text(copy) : EXIT_FAILURE;
+	fflush(stdout);
+	exit(status);
+}
+
+/* Fork the child for a request.  Returns -1 if it could not be started. */
+static int launch(connection *c, char *text, size_t len) {
+	int i;
+
+	c->files[2] = memfd_create("state", MFD_CLOEXEC);
+	if (c->capture) {
+		c->files[0] = memfd_create("stdout", MFD_CLOEXEC);
+		c->files[1] = memfd_create("stderr", MFD_CLOEXEC);
+	}
+	for (i = 0; i < 3; ++i) {
+		if (c->files[i] == -1 && (i == 2 || c->capture)) {
+			perror("memfd_create");
+			close_files(c);
+			return -1;
+		}
+	}
+
+	/* Children leave with exit, which flushes what they inherit. */
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		close_files(c);
+		return -1;
+	} else if (pid == 0) {
+		run_child(c, text, len);
+	}
+
+	c->pidfd = syscall(SYS_pidfd_open, pid, 0);
+	struct epoll_event ev = { EPOLLIN, { .ptr = &c->child } };
+	if (c->pidfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, c->pidfd, &ev) == -1) {
+		perror("pidfd");
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		if (c->pidfd != -1)
+			close(c->pidfd);
+		close_files(c);
+		return -1;
+	}
+	c->pid = pid;
+	return 0;
+}
+
+/**
+ * Start the next request of a connection, if none is running and one has
+ * come in whole, and drop the connection once the client is done with it.
+ * A bad request drops it too, as the rest can no longer be framed.
+ */
+static void next_request(connection *c) {
+	if (c->pid || c->dead)
+		return;
+
+	size_t scan = c->in.used < SERVER_HEADER_MAX ? c->in.used
+	                                             : SERVER_HEADER_MAX;
+	char *nl = c->in.used ? memchr(c->in.data, '\n', scan) : NULL;
+	if (!nl) {
+		if (c->in.used >= SERVER_HEADER_MAX) {
+			fprintf(stderr, "server: bad request header\n");
+			drop(c);
+		} else if (c->eof && c->sent == c->out.used) {
+			drop(c);
+		}
+		return;
+	}
+
+	char mode[16];
+	size_t len;
+	int end = 0;
+	*nl = '\0';
+	int fields = sscanf(c->in.data, "%15s %zu%n", mode, &len, &end);
+	*nl = '\n';
+	if (fields != 2 || c->in.data + end != nl || len > SERVER_REQUEST_MAX ||
+		(strcmp(mode, SERVER_RUN) && strcmp(mode, SERVER_CAPTURE))) {
+		fprintf(stderr, "server: bad request header\n");
+		drop(c);
+		return;
+	}
+	size_t header = nl + 1 - c->in.data;
+	if (c->in.used < header + len) {
+		/* The rest has not come in yet, and never will after EOF. */
+		if (c->eof)
+			drop(c);
+		return;
+	}
+
+	c->capture = !strcmp(mode, SERVER_CAPTURE);
+	if (launch(c, c->in.data + header, len) == -1) {
+		char *msg = "server: could not run the request\n";
+		if (respond(c, 126, NULL, 0, msg, strlen(msg)) == -1) {
+			drop(c);
+			return;
+		}
+	}
+	memmove(c->in.data, c->in.data + header + len,
+	        c->in.used - header - len);
+	c->in.used -= header + len;
+	if (!c->pid)
+		next_request(c);
+}
+
+/* The child of a request has ended: send back its status and output, and
+ * keep its directory and variables for the next request. */
+static void finish_request(connection *c) {
+	int st;
+	pid_t pid = waitpid(c->pid, &st, WNOHANG);
+	if (pid == 0 || (pid == -1 && errno == EINTR))
+		return;
+	int status = pid == -1 ? EXIT_FAILURE :
+	             WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->pidfd, NULL);
+	close(c->pidfd);
+	c->pid = 0;
+
+	/* Nothing is left if it was killed. */
+	size_t len;
+	char *state = read_memfd(c->files[2], &len);
+	if (state && len) {
+		free(c->state);
+		c->state = state;
+		c->state_len = len;
+	} else {
+		free(state);
+	}
+
+	size_t out_len = 0, err_len = 0;
+	char *out = NULL, *err = NULL;
+	if (c->capture) {
+		out = read_memfd(c->files[0], &out_len);
+		err = read_memfd(c->files[1], &err_len);
+	}
+	close_files(c);
+
+	if (c->gone)
+		drop(c);
+	else if (respond(c, status, out, out_len, err, err_len) == -1)
+		drop(c);
+	else
+		next_request(c);
+	free(out);
+	free(err);
+}
+
+/* Read what the client sent. */
+static void read_requests(connection *c) {
+	char chunk[READ_CHUNK];
+	for (;;) {
+		ssize_t n = recv(c->fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0) {
+			c->eof = 1;
+			break;
+		}
+		if (buffer_append(&c->in, chunk, n) == -1) {
+			perror("server");
+			drop(c);
+			return;
+		}
+	}
+	watch_socket(c);
+	next_request(c);
+}
+
+/* Take the new connections. */
+static void accept_connections(void) {
+	for (;;) {
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return;
+		}
+		connection *c = calloc(1, sizeof(connection));
+		char *state = malloc(initial_state_len);
+		if (!c || !state) {
+			perror("server");
+			free(c);
+			free(state);
+			close(fd);
+			continue;
+		}
+		memcpy(state, initial_state, initial_state_len);
+		c->fd = fd;
+		c->sock.type = WATCH_SOCKET;
+		c->sock.conn = c;
+		c->child.type = WATCH_CHILD;
+		c->child.conn = c;
+		c->events = EPOLLIN;
+		c->state = state;
+		c->state_len = initial_state_len;
+		c->files[0] = c->files[1] = c->files[2] = -1;
+
+		struct epoll_event ev = { EPOLLIN, { .ptr = &c->sock } };
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			perror("epoll_ctl");
+			free(c->state);
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->next = connections;
+		if (connections)
+			connections->prev = c;
+		connections = c;
+	}
+}
+
+/* Free the connections dropped while handling events. */
+static void free_dropped(void) {
+	while (dropped) {
+		connection *c = dropped;
+		dropped = c->next;
+		free(c->in.data);
+		free(c->out.data);
+		free(c->state);
+		free(c);
+	}
+}
+
+/* Serve requests on a Unix socket, see server.h. */
+int server_listen(char *path, int (*run)(char *text)) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct epoll_event events[MAX_EVENTS];
+	struct stat st;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return 2;
+	}
+	strcpy(addr.sun_path, path);
+	run_text = run;
+
+	FILE *f = open_memstream(&initial_state, &initial_state_len);
+	if (!f) {
+		perror("open_memstream");
+		return EXIT_FAILURE;
+	}
+	write_state(f);
+	fclose(f);
+
+	/* A socket left behind by an earlier server is replaced. */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd == -1 ||
+		bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+		listen(listen_fd, SOMAXCONN) == -1) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = { EPOLLIN, { .ptr = &listener } };
+	if (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+		perror("epoll");
+		return EXIT_FAILURE;
+	}
+
+	for (;;) {
+		int i, n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return EXIT_FAILURE;
+		}
+		for (i = 0; i < n; ++i) {
+			watch *w = events[i].data.ptr;
+			connection *c = w->conn;
+			if (w->type == WATCH_LISTENER) {
+				accept_connections();
+				continue;
+			}
+			if (c->dead)
+				continue;
+			if (w->type == WATCH_CHILD) {
+				finish_request(c);
+				continue;
+			}
+			if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+				drop(c);
+				continue;
+			}
+			if ((events[i].events & EPOLLOUT) && send_responses(c) == -1) {
+				drop(c);
+				continue;
+			}
+			if (events[i].events & EPOLLIN)
+				read_requests(c);
+			else
+				next_request(c);
+		}
+		free_dropped();
+	}
+}
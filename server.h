@@ -0,0 +1,44 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <stddef.h>
+
+/**
+ * Daemon mode (shell --listen PATH): command lines come in over a Unix
+ * socket instead of from a terminal or a script, so running one costs a
+ * fork of a shell that is already set up rather than starting a new one.
+ *
+ * A request is a header line and the text of the command:
+ *
+ *     capture 11\n
+ *     cd /tmp ; ls
+ *
+ * The mode is "capture" (send the output back) or "run" (the output goes
+ * where the server's own goes), and the number is the length of the text,
+ * which may hold several lines.  The response is the exit status and the
+ * lengths of the output, followed by stdout and then stderr:
+ *
+ *     0 24 0\n
+ *     ...24 bytes of stdout...
+ *
+ * Every connection has a directory and variables of its own, which start
+ * out as the server's; a cd or set in one request is seen by the next one
+ * on the same connection.  Requests on a connection are run one after the
+ * other, while those of different connections run at the same time.
+ */
+
+/* Modes of a request */
+#define SERVER_RUN     "run"
+#define SERVER_CAPTURE "capture"
+
+/* Longest header line, and the largest request taken */
+#define SERVER_HEADER_MAX  64
+#define SERVER_REQUEST_MAX (16 << 20)
+
+/* Listen on a Unix socket at path and run the requests that come in, by
+ * calling run on their text in a forked copy of the shell (with the
+ * connection's directory and variables), until killed.  Returns only on
+ * failure to set up, with an exit status. */
+int server_listen(char *path, int (*run)(char *text));
+
+#endif
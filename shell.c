@@ -1,15 +1,34 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <spawn.h>
 #include <string.h>
+#include <time.h>
 #include <mcheck.h>
-#include <pwd.h>
 
 #include "parser.h"
+#include "hash.h"
+#include "builtins.h"
+#include "input.h"
+#include "prompt.h"
+#include "jobs.h"
+#include "parallel.h"
+#include "vars.h"
+#include "trace.h"
+#include "history.h"
+#include "lineedit.h"
+#include "placement.h"
+#include "redirect.h"
+#include "cache.h"
+#include "server.h"
 #include "shell.h"
 
 /**
@@ -19,73 +38,481 @@
  
  */
 
-#define MAX_DIRNAME 100
-#define MAX_HOSTNAME 64
-#define MAX_COMMAND 1024
-#define MAX_TOKEN 128
+
+extern char **environ;
 
 /* Functions to implement, see below after main */
 int execute_cd(char** words);
 int execute_nonbuiltin(simple_command *s);
 int execute_simple_command(simple_command *cmd);
+int execute_io_builtin(simple_command *cmd);
 int execute_complex_command(command *cmd);
 
+pid_t launch_command(command *c, int fdin, int fdout, process_group *group);
+int execute_pipeline(command *c);
+int execute_timed(command *c);
+char *capture_output(char *text, size_t *len);
+
+int execute_exit(char **words);
 int execute_set(char **words);
 int execute_unset(char **words);
+int execute_hash(char **words);
+int execute_break(char **words);
 
-void print_prompt(void);
+void init_cwd(void);
 
-int main(int argc, char** argv) {
-	
-	char command_line[MAX_COMMAND];  /* The command */
-	char *tokens[MAX_TOKEN];         /* Command tokens (program name, 
+/* Exit status of the last command line. */
+static int last_status = 0;
+
+/* Read a line of input: from the terminal with editing and completion when
+ * someone is typing, otherwise straight from the input. */
+static char *read_line(input *in, int interactive, size_t *len) {
+	if (interactive)
+		return lineedit_read(fileno(stdin), len);
+	return input_read_line(in, len);
+}
+
+/* Make a copy of a string in an arena. */
+static char *arena_strdup(arena *a, char *s, size_t len) {
+	char *copy = arena_alloc(a, len + 1);
+	if (copy) {
+		memcpy(copy, s, len);
+		copy[len] = '\0';
+	}
+	return copy;
+}
+
+/* Put a token into the token vector at position i. Returns the vector
+ * (which may have moved), or NULL if out of memory. */
+static char **insert_token(char **tokens, int i, char *token) {
+	int n;
+	for (n = 0; tokens[n]; n++)
+		;
+	char **grown = realloc(tokens, (n + 2) * sizeof(char*));
+	if (!grown) {
+		free(tokens);
+		return NULL;
+	}
+	memmove(grown + i + 1, grown + i, (n - i + 1) * sizeof(char*));
+	grown[i] = token;
+	return grown;
+}
+
+/**
+ * Reads the bodies of the here-documents on a command line ("<<EOF" or
+ * "<< EOF") from the lines that follow it, up to the delimiter, and turns
+ * here-strings ("<<< word") into bodies as well, so that each of them ends
+ * up as a "<<" token followed by its text.  Bodies are taken literally,
+ * while the word of a here-string is expanded.  *found is set if there were
+ * any.  Returns the tokens (the vector may have moved), or NULL if out of
+ * memory.
+ */
+static char **read_here_documents(char **tokens, arena *strings, input *in,
+                                  int interactive, int *found) {
+	int i, copied = 0;
+
+	*found = 0;
+	for (i = 0; tokens && tokens[i]; i++) {
+		if (strncmp(tokens[i], "<<", 2))
+			continue;
+		*found = 1;
+
+		/* Reading more input reuses the buffer the tokens point into, so
+		 * move them out of the way first. */
+		if (!copied) {
+			int j;
+			for (j = 0; tokens[j]; j++) {
+				tokens[j] = arena_strdup(strings, tokens[j], strlen(tokens[j]));
+				if (!tokens[j]) {
+					free(tokens);
+					return NULL;
+				}
+			}
+			copied = 1;
+		}
+
+		int here_string = tokens[i][2] == '<';
+		char *word = tokens[i] + (here_string ? 3 : 2);
+		if (*word) {
+			/* "<<EOF" or "<<<word": split off the operand. */
+			tokens = insert_token(tokens, i + 1, word);
+			if (!tokens)
+				return NULL;
+		} else if (!tokens[i + 1]) {
+			/* Missing operand: let the parser complain. */
+			tokens[i] = "<<";
+			break;
+		}
+		tokens[i] = "<<";
+		word = tokens[++i];
+
+		if (here_string) {
+			/* The word, and a newline. */
+			word = expand_token(word, strings);
+			size_t wlen = word ? strlen(word) : 0;
+			char *body = word ? arena_alloc(strings, wlen + 2) : NULL;
+			if (!body) {
+				free(tokens);
+				return NULL;
+			}
+			memcpy(body, word, wlen);
+			strcpy(body + wlen, "\n");
+			tokens[i] = body;
+			continue;
+		}
+
+		/* Collect lines up to the delimiter. */
+		char *body = NULL;
+		size_t bsize = 0, len;
+		FILE *f = open_memstream(&body, &bsize);
+		if (!f) {
+			free(tokens);
+			return NULL;
+		}
+		while (1) {
+			if (interactive) {
+				printf("> ");
+				fflush(stdout);
+			}
+			char *line = read_line(in, interactive, &len);
+			if (!line) {
+				fprintf(stderr, "warning: here-document ended by end of "
+				        "input (wanted '%s')\n", word);
+				break;
+			}
+			if (!strcmp(line, word))
+				break;
+			fwrite(line, 1, len, f);
+			fputc('\n', f);
+		}
+		fclose(f);
+		tokens[i] = arena_strdup(strings, body ? body : "", body ? bsize : 0);
+		free(body);
+		if (!tokens[i]) {
+			free(tokens);
+			return NULL;
+		}
+	}
+	return tokens;
+}
+
+/**
+ * Builds the tree of a line, reading more lines while it ends inside an
+ * if, while or for; they are joined to it with ';' tokens.  construct_command
+ * overwrites operators, so every attempt is made on a fresh copy of the
+ * vector.  The lines that are read are kept in the arena, with their
+ * here-documents.  *tokens is replaced by the vector the tree was built
+ * from, and *joined is set if more lines were read.
+ */
+static command *construct_lines(char ***tokens, arena *strings, input *in,
+                                int interactive, int *joined) {
+	size_t n, m;
+	int incomplete, here;
+	command *cmd;
+
+	for (n = 0; (*tokens)[n]; n++)
+		;
+	char **all = malloc((n + 1) * sizeof(char*));
+	if (!all) {
+		perror("malloc");
+		return NULL;
+	}
+	memcpy(all, *tokens, (n + 1) * sizeof(char*));
+
+	*joined = 0;
+	while (!(cmd = construct_command(*tokens, &incomplete)) && incomplete) {
+		if (interactive) {
+			printf("> ");
+			fflush(stdout);
+		}
+		size_t len;
+		char *line = read_line(in, interactive, &len);
+		if (!line) {
+			fprintf(stderr, "syntax error: unexpected end of input\n");
+			break;
+		}
+		*joined = 1;
+		char *copy = arena_strdup(strings, line, len);
+		char **more = copy ? parse_line(copy) : NULL;
+		if (more) {
+			unquote_tokens(more);
+			more = read_here_documents(more, strings, in, interactive, &here);
+		}
+		if (!more) {
+			perror("parse_line");
+			break;
+		}
+
+		/* Blank lines add nothing. */
+		for (m = 0; more[m]; m++)
+			;
+		char **grown = realloc(all, (n + m + 2) * sizeof(char*));
+		char **retry = grown ? realloc(*tokens, (n + m + 2) * sizeof(char*))
+		                     : NULL;
+		if (!retry) {
+			perror("realloc");
+			free(grown ? grown : all);
+			free(more);
+			return NULL;
+		}
+		all = grown;
+		*tokens = retry;
+		if (m) {
+			all[n++] = ";";
+			memcpy(all + n, more, m * sizeof(char*));
+			n += m;
+			all[n] = NULL;
+		}
+		free(more);
+		memcpy(*tokens, all, (n + 1) * sizeof(char*));
+	}
+	free(all);
+	return cmd;
+}
+
+/**
+ * Parses a command line (len characters) that is not in the cache.  The
+ * tokens are made from a copy of the line, which the cache keeps along
+ * with the tree; a line with here-documents is not cached, as it goes with
+ * the input that follows it, and neither is an if, while or for that takes
+ * up more than one line.  If the line is not cached, *text and *tokens
+ * are left for the caller to free (with the tree), else they are set to
+ * NULL.  Returns the tree, or NULL for an empty line or a syntax error.
+ */
+static command *parse_command(char *line, size_t len, arena *strings,
+                              input *in, int interactive,
+                              char **text, char ***tokens) {
+	int here, joined = 0;
+
+	*tokens = NULL;
+	*text = malloc(len + 1);
+	if (*text) {
+		memcpy(*text, line, len + 1);
+		*tokens = parse_line(*text);
+	}
+	if (!*tokens) {
+		perror("parse_line");
+		free(*text);
+		return NULL;
+	}
+	unquote_tokens(*tokens);
+	*tokens = read_here_documents(*tokens, strings, in, interactive, &here);
+	if (!*tokens) {
+		perror("here-document");
+		free(*text);
+		return NULL;
+	}
+
+	/* Check for empty command */
+	command *cmd = NULL;
+	if (**tokens) {
+		/* Construct chain of commands, if multiple commands */
+		cmd = construct_lines(tokens, strings, in, interactive, &joined);
+		/* A syntax error, already reported */
+		if (!cmd)
+			last_status = 2;
+	}
+	if (!cmd) {
+		free(*tokens);
+		free(*text);
+		*tokens = NULL;
+		return NULL;
+	}
+
+	if (!here && !joined && cache_insert(line, len, *text, *tokens, cmd) == 0) {
+		*text = NULL;
+		*tokens = NULL;
+	}
+	return cmd;
+}
+
+/**
+ * Reads command lines from the input and runs them, until it ends (or the
+ * exit builtin is run).  The exit status of the last one is left in
+ * last_status.
+ */
+static void run_input(input *in, int interactive) {
+	char *command_line;              /* The command */
+	size_t len;
+	char **tokens;                   /* Command tokens (program name, 
 					  * parameters, pipe, etc.) */
+	arena strings = { NULL };        /* Storage for expanded tokens */
 
 	while (1) {
 
+		/* Collect finished background jobs (and report them) */
+		jobs_update();
+
 		/* Display prompt */		
-		print_prompt();
+		if (interactive) {
+			print_prompt();
+		}
 
-		/* Read the command line */
-		fgets(command_line, MAX_COMMAND, stdin);
-		/* Strip the new line character */
-		if (command_line[strlen(command_line) - 1] == '\n') {
-			command_line[strlen(command_line) - 1] = '\0';
+		/* Read the command line, however long it is */
+		command_line = read_line(in, interactive, &len);
+		if (!command_line) {
+			if (interactive)
+				printf("\n");
+			break;
 		}
 		
-		/* Parse the command into tokens */
-		parse_line(command_line, tokens);
-		process_tokens(tokens);
+		/* Remember it, before parsing takes the line apart */
+		if (interactive)
+			history_add(command_line, len);
 
-		/* Check for empty command */
-		if (!(*tokens)) {
+		/* Find the command parsed already, or parse it */
+		long long start = trace_now();
+		arena_reset(&strings);
+		char *text = NULL;
+		tokens = NULL;
+		command *cmd = cache_lookup(command_line, len);
+		if (!cmd)
+			cmd = parse_command(command_line, len, &strings, in, interactive,
+			                    &text, &tokens);
+		trace_span("parse", "shell", start, NULL);
+		if (!cmd)
 			continue;
-		}
-		
-		/* Construct chain of commands, if multiple commands */
-		command *cmd = construct_command(tokens);
+
+		/* Run it; the words of each command are expanded as it comes up,
+		 * so they see what the commands before it did. */
 		//print_command(cmd, 0);
+		start = trace_now();
+		int exitcode = execute_complex_command(cmd);
+		if (exitcode == -1) {
+			break;
+		}
+		last_status = exitcode;
+		if (trace_enabled()) {
+			char *shown = command_string(cmd);
+			trace_span("command", "shell", start, shown);
+			free(shown);
+		}
+		/* Unless the cache has taken it over */
+		if (tokens) {
+			release_command(cmd);
+			free(tokens);
+			free(text);
+		}
+	}
 
-		int exitcode = 0;
-		if (cmd->scmd) {
-			exitcode = execute_simple_command(cmd->scmd);
-			if (exitcode == -1) {
-				break;
-			}
+	arena_free(&strings);
+}
+
+/* Runs the command lines of a request to the server, in the forked copy of
+ * the shell that serves it (see server.h). */
+static int run_request(char *text) {
+	input in;
+
+	/* The directory is the connection's own. */
+	init_cwd();
+	if (input_from_string(&in, text) == -1) {
+		perror("request");
+		return EXIT_FAILURE;
+	}
+	last_status = 0;
+	run_input(&in, 0);
+	input_close(&in);
+	return last_status;
+}
+
+int main(int argc, char** argv) {
+	
+	input in;                        /* Where the commands come from */
+	int interactive = 0;             /* Whether to show a prompt */
+
+	vars_init(environ);
+	trace_init();
+	command_substitution = capture_output;
+	init_cwd();
+
+	/* Serve requests on a socket, run a -c string, a script file, or
+	 * whatever comes in on stdin. */
+	if (argc > 1 && !strcmp(argv[1], "--listen")) {
+		if (argc < 3) {
+			fprintf(stderr, "%s: --listen: option requires an argument\n",
+			        argv[0]);
+			return 2;
 		}
-		else {
-			exitcode = execute_complex_command(cmd);
-			if (exitcode == -1) {
-				break;
-			}
+		jobs_init(0);
+		return server_listen(argv[2], run_request);
+	} else if (argc > 1 && !strcmp(argv[1], "-c")) {
+		if (argc < 3) {
+			fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+			return 2;
 		}
-		release_command(cmd);
+		if (input_from_string(&in, argv[2]) == -1) {
+			perror(argv[0]);
+			return EXIT_FAILURE;
+		}
+	} else if (argc > 1) {
+		int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			perror(argv[1]);
+			return 127;
+		}
+		input_from_fd(&in, fd);
+	} else {
+		input_from_fd(&in, fileno(stdin));
+		/* Only prompt when someone is typing at us. */
+		interactive = isatty(fileno(stdin));
 	}
-    
-	return 0;
+
+	jobs_init(interactive);
+	run_input(&in, interactive);
+	input_close(&in);
+	return last_status;
 }
 
 
+/* The current directory the way the user got there (through symlinks,
+ * like $PWD), kept up to date by cd. */
+static char *current_dir;
+
+/* Find out the current directory: $PWD if it really is where we are,
+ * or else the physical path from getcwd. */
+void init_cwd(void) {
+	char *pwd = var_get("PWD");
+	struct stat a, b;
+	if (pwd && !is_relative(pwd) &&
+		stat(pwd, &a) == 0 && stat(".", &b) == 0 &&
+		a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+		current_dir = strdup(pwd);
+	else
+		current_dir = getcwd(NULL, 0);
+
+	if (current_dir) {
+		var_set("PWD", current_dir, 1);
+		prompt_set_cwd(current_dir);
+	}
+}
+
+/* Remove ".", ".." and repeated slashes from an absolute path, in place,
+ * without looking at the file system. */
+static void canonicalize_path(char *path) {
+	char *src = path, *dst = path;
+	while (*src) {
+		while (*src == '/')
+			src++;
+		if (!*src)
+			break;
+		char *end = strchrnul(src, '/');
+		size_t len = end - src;
+		if (len == 2 && src[0] == '.' && src[1] == '.') {
+			/* Drop the last component we kept. */
+			while (dst > path && *--dst != '/')
+				;
+		} else if (len != 1 || src[0] != '.') {
+			*dst++ = '/';
+			memmove(dst, src, len);
+			dst += len;
+		}
+		src = end;
+	}
+	if (dst == path)
+		*dst++ = '/';
+	*dst = '\0';
+}
+
 /**
  * Changes directory to a path specified in the words argument;
  * For example: words[0] = "cd"
@@ -94,6 +521,8 @@ int main(int argc, char** argv) {
  * working directory, and absolute paths relative to root,
  * e.g., relative path:  cd csc209/assignment3/
  *       absolute path:  cd /u/bogdan/csc209/assignment3/
+ * Like other shells, ".." goes back the way we came (even through a
+ * symlink), and PWD and OLDPWD are kept up to date.
  */
 int execute_cd(char** words) {
 	/* Check that 'words' is a valid string of tokens, i.e.
@@ -104,25 +533,85 @@ int execute_cd(char** words) {
 		return EXIT_FAILURE;
 
 	/* If we only have 1 token "cd", change to the user's home directory. */
-	char *dir = words[1] ? words[1] : getenv("HOME");
+	char *dir = words[1] ? words[1] : var_get("HOME");
+	if (!dir) {
+		fprintf(stderr, "cd: HOME not set\n");
+		return 1;
+	}
 
 	/* If the command is 'cd -', return to the previous working directory. */
-	if (!strcmp(dir, "-"))
-		dir = getenv("OLDPWD");
+	if (!strcmp(dir, "-")) {
+		dir = var_get("OLDPWD");
+		if (!dir) {
+			fprintf(stderr, "cd: OLDPWD not set\n");
+			return 1;
+		}
+	}
 
-	/* Change the directory, returning -1 if it fails. */
-	int ret = chdir(dir);
-	if (ret == -1) {
-		perror("cd");
-		return 1;
+	/* Work out the new directory from the current one. */
+	char *target = NULL;
+	if (!is_relative(dir)) {
+		target = strdup(dir);
+	} else if (current_dir) {
+		target = malloc(strlen(current_dir) + strlen(dir) + 2);
+		if (target)
+			sprintf(target, "%s/%s", current_dir, dir);
 	}
-	return ret;
+	if (target)
+		canonicalize_path(target);
+
+	/* Change the directory, returning 1 if it fails.  If the logical path
+	 * doesn't work, try the path as given and ask where we ended up. */
+	if (!target || chdir(target) == -1) {
+		free(target);
+		if (chdir(dir) == -1) {
+			perror("cd");
+			return 1;
+		}
+		target = getcwd(NULL, 0);
+	}
+
+	if (current_dir)
+		var_set("OLDPWD", current_dir, 1);
+	free(current_dir);
+	current_dir = target;
+	if (current_dir) {
+		var_set("PWD", current_dir, 1);
+		prompt_set_cwd(current_dir);
+	}
+	hash_cwd_changed();
+	return 0;
+}
+
+/* Exits the shell, with the status specified in the words argument:
+ * For example: words[0] = 'exit'
+ *              words[1] = '2'   (optional; by default, the status of
+ *                                the last command line)
+ */
+int execute_exit(char **words) {
+	int status = last_status;
+	if (words && words[0] && words[1])
+		status = atoi(words[1]);
+	fflush(stdout);
+	exit(status);
+}
+
+/* Drops what the shell worked out from a variable that has just been set
+ * or unset: commands may resolve differently under a new search path, and
+ * the prompt is rebuilt from its template. */
+static void var_changed(char *name) {
+	if (!strcmp(name, "PATH"))
+		hash_clear();
+	if (!strcmp(name, "PROMPT"))
+		prompt_invalidate();
 }
 
-/* Sets an environment variable specified in the words argument:
+/* Sets a shell variable specified in the words argument:
  * For example: words[0] = 'set'
- *              words[1] = 'PROMPT'
- *              words[2] = '"$ "'
+ *              words[1] = '-l'    (optional; keep it out of the
+ *                                  environment of commands)
+ *              words[2] = 'PROMPT'
+ *              words[3] = '"$ "'
  */
 int execute_set(char **words) {
 	/* Check that 'words' is a valid string of tokens, i.e.
@@ -132,6 +621,13 @@ int execute_set(char **words) {
 		strcmp(words[0], "set"))
 		return EXIT_FAILURE;
 
+	/* Variables are exported unless they are set with -l. */
+	int exported = 1;
+	if (words[1] && !strcmp(words[1], "-l")) {
+		exported = 0;
+		words++;
+	}
+
 	/* If we don't have a variable name (or a value), do nothing. */
 	if (!words[1])
 		return EXIT_SUCCESS;
@@ -140,22 +636,24 @@ int execute_set(char **words) {
 	char *name = words[1], *value = words[2];
 	/* If we don't have a value, just print the value of the variable. */
 	if (!value) {
-		value = getenv(name);
+		value = var_get(name);
 		if (value)
-			printf("%s = %s\n", name, value);
+			printf("%s = %s%s\n", name, value,
+			       var_exported(name) ? "" : " (local)");
 		else
 			printf("%s is not set.\n", name);
 		return EXIT_SUCCESS;
 	}
-	if (setenv(name, value, 1) == -1) {
-		perror("setenv");
+	if (var_set(name, value, exported) == -1) {
+		fprintf(stderr, "set: cannot set %s\n", name);
 		return EXIT_FAILURE;
 	}
+	var_changed(name);
 	return EXIT_SUCCESS;
 }
 
 
-/* Unsets an environment variable specified in the words argument:
+/* Unsets a shell variable specified in the words argument:
  * For example: words[0] = 'unset'
  *              words[1] = 'PROMPT'
  */
@@ -173,15 +671,40 @@ int execute_unset(char **words) {
 
 	/* Get the variable name. */
 	char *name = words[1];
-	if (getenv(name) == NULL) {
+	if (var_unset(name) == -1) {
 		printf("%s is not set.\n", name);
 		return EXIT_FAILURE;
 	}
-	if (unsetenv(name) == -1) {
-		perror("unsetenv");
+	var_changed(name);
+	return EXIT_SUCCESS;
+}
+
+/* Inspects or clears the table of command locations:
+ * For example: words[0] = 'hash'        (list the cached commands)
+ *              words[1] = '-r'          (forget all of them)
+ *              words[1] = 'ls'          (look up and cache ls)
+ */
+int execute_hash(char **words) {
+	if (words == NULL ||
+		words[0] == NULL ||
+		strcmp(words[0], "hash"))
 		return EXIT_FAILURE;
+
+	if (!words[1]) {
+		hash_print();
+		return EXIT_SUCCESS;
 	}
-	return EXIT_SUCCESS;
+
+	int i, ret = EXIT_SUCCESS;
+	for (i = 1; words[i]; ++i) {
+		if (!strcmp(words[i], "-r")) {
+			hash_clear();
+		} else if (!hash_lookup(words[i])) {
+			fprintf(stderr, "hash: %s: not found\n", words[i]);
+			ret = EXIT_FAILURE;
+		}
+	}
+	return ret;
 }
 
 /**
@@ -193,12 +716,17 @@ int execute_unset(char **words) {
  * followed by a NULL token. 
  */
 int execute_command(char **tokens) {
-	/* Execute the command here. */
-	execvp(tokens[0], tokens);
+	/* Execute the command here, from the location cached by the shell. */
+	char *path = hash_lookup(tokens[0]);
+	trace_instant("exec", "process", tokens[0]);
+	if (path)
+		execve(path, tokens, vars_environ());
+	else
+		errno = ENOENT;
 	/* If the command executed properly, it should NOT get to this point.
 	 * If it does, something went wrong; we just print the error here. */
 	perror(tokens[0]);
-	exit(EXIT_FAILURE);
+	_exit(EXIT_FAILURE);
 }
 
 
@@ -206,42 +734,224 @@ int execute_command(char **tokens) {
  * Executes a non-builtin command.
  */
 int execute_nonbuiltin(simple_command *s) {
-	/* If we write to any files, make sure that we set the permissions to 644. */
-	#define MODE_644 (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+	/* Move to the CPUs and priorities of any pin/nice/ionice prefixes. */
+	if (placement_apply(s->place) == -1)
+		return -1;
+	/* Set up the redirections, in order. */
+	if (redirect_apply(s) == -1)
+		return -1;
+
+	/* Finally execute the command. */
+	return execute_command(s->tokens);
+}
+
+
+/**
+ * Determine which backend launches external programs. posix_spawn is the
+ * default; setting SHSH_SPAWN=fork selects the old fork() + execvp() path.
+ */
+static int use_fork_backend(void) {
+	char *backend = var_get("SHSH_SPAWN");
+	return backend && !strcmp(backend, "fork");
+}
 
-	/* If 'in' is set, open the file to read stdin from. */
-	if (s->in) {
-		int infd = open(s->in, O_RDONLY);
-		if (infd == -1 ||
-			dup2(infd, fileno(stdin)) == -1) {
-			perror(s->in);
-			return infd;
+/**
+ * Launches a non-builtin command by forking, connecting its stdin/stdout/
+ * stderr to fdin/fdout/fderr (-1 to inherit the shell's), then applying the
+ * redirections and exec'ing in the child.  Returns the child's pid, or -1 on failure.
+ */
+static pid_t fork_nonbuiltin(simple_command *s, int fdin, int fdout,
+                             int fderr, process_group *group) {
+	long long start = trace_now();
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	} else if (pid == 0) {
+		job_child_setup(group);
+		if ((fdin != -1 && dup2(fdin, fileno(stdin)) == -1) ||
+			(fdout != -1 && dup2(fdout, fileno(stdout)) == -1) ||
+			(fderr != -1 && dup2(fderr, fileno(stderr)) == -1)) {
+			perror("dup2");
+			_exit(EXIT_FAILURE);
 		}
-		close(infd);
+		execute_nonbuiltin(s);
+		_exit(EXIT_FAILURE);
 	}
-	/* If 'out' is set, open the file to write stdout to. */
-	if (s->out) {
-		int outfd = open(s->out, O_CREAT | O_WRONLY | O_TRUNC, MODE_644);
-		if (outfd == -1 ||
-			dup2(outfd, fileno(stdout)) == -1) {
-			perror(s->out);
-			return outfd;
+	trace_span("fork", "process", start, s->tokens[0]);
+	job_launched(group, pid);
+	return pid;
+}
+
+/**
+ * Launches a non-builtin command with posix_spawn, which lets the C library
+ * use vfork/CLONE_VM instead of copying the shell's page tables.  The
+ * redirection files are opened here in the parent (close-on-exec), so errors
+ * are reported with the file name, and the child only has to carry out the
+ * dup2 and close steps of the plan.
+ * Returns the child's pid, or -1 on failure.
+ */
+pid_t launch_nonbuiltin(simple_command *s, int fdin, int fdout, int fderr,
+                        process_group *group) {
+	if (!s->tokens[0]) {
+		fprintf(stderr, "incomplete command\n");
+		return -1;
+	}
+	/* Anything the shell has printed must come out before the program's
+	 * output (and must not be copied into a forked child). */
+	fflush(stdout);
+	/* posix_spawn cannot set the CPUs or priorities of the child, and
+	 * changing the shell's own around it cannot always be undone (a raised
+	 * niceness stays), so commands with pin/nice/ionice are forked. */
+	if (use_fork_backend() || s->place) {
+		/* Resolve the command here so the parent's cache gets filled. */
+		hash_lookup(s->tokens[0]);
+		return fork_nonbuiltin(s, fdin, fdout, fderr, group);
+	}
+
+	redirect_files files;
+	pid_t pid = -1;
+	int err, retried = 0;
+
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_init(&actions);
+	/* The pipes first: the redirections of the command override them. */
+	if (fdin != -1)
+		posix_spawn_file_actions_adddup2(&actions, fdin, fileno(stdin));
+	if (fdout != -1)
+		posix_spawn_file_actions_adddup2(&actions, fdout, fileno(stdout));
+	if (fderr != -1)
+		posix_spawn_file_actions_adddup2(&actions, fderr, fileno(stderr));
+	if (redirect_spawn_actions(s, &actions, &files) == -1) {
+		posix_spawn_file_actions_destroy(&actions);
+		return -1;
+	}
+	posix_spawnattr_init(&attr);
+	job_spawn_setup(&attr, &actions, group);
+	long long start = trace_now();
+	while (1) {
+		/* Exec the cached location directly instead of walking PATH. */
+		char *path = hash_lookup(s->tokens[0]);
+		if (!path) {
+			err = ENOENT;
+			break;
 		}
-		close(outfd);
+		err = posix_spawn(&pid, path, &actions, &attr, s->tokens,
+		                  vars_environ());
+		/* If the program has moved since it was cached, look again once. */
+		if (err != ENOENT || retried++ || !hash_forget(s->tokens[0]))
+			break;
 	}
-	/* If 'err' is set, open the file to write stderr to. */
-	if (s->err) {
-		int errfd = open(s->err, O_CREAT | O_WRONLY | O_TRUNC, MODE_644);
-		if (errfd == -1 ||
-			dup2(errfd, fileno(stderr)) == -1) {
-			perror(s->err);
-			return errfd;
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	if (err == ENOSYS) {
+		/* No usable spawn implementation; fall back to forking. */
+		pid = fork_nonbuiltin(s, fdin, fdout, fderr, group);
+	} else if (err) {
+		fprintf(stderr, "%s: %s\n", s->tokens[0], strerror(err));
+		pid = -1;
+	} else {
+		trace_span("spawn", "process", start, s->tokens[0]);
+		job_launched(group, pid);
+	}
+
+	redirect_close(&files);
+	return pid;
+}
+
+/**
+ * Launches a command (simple and expanded, or complex) with its stdin/stdout
+ * connected to fdin/fdout (-1 to inherit).  External programs are spawned directly; other
+ * commands run in a forked copy of the shell.  Returns the pid to wait for,
+ * or -1 on failure.
+ */
+pid_t launch_command(command *c, int fdin, int fdout, process_group *group) {
+	if (c->scmd && !c->scmd->builtin)
+		return launch_nonbuiltin(c->scmd, fdin, fdout, -1, group);
+
+	/* Children leave with _exit, so that they neither flush the parent's
+	 * buffered output a second time nor rewind a shared stdin offset. */
+	fflush(stdout);
+	long long start = trace_now();
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	} else if (pid == 0) {
+		job_child_setup(group);
+		if ((fdin != -1 && dup2(fdin, fileno(stdin)) == -1) ||
+			(fdout != -1 && dup2(fdout, fileno(stdout)) == -1)) {
+			perror("dup2");
+			_exit(EXIT_FAILURE);
+		}
+		/* Apply any pin/nice/ionice of a builtin here, in the copy. */
+		if (c->scmd && c->scmd->place) {
+			if (placement_apply(c->scmd->place) == -1)
+				_exit(EXIT_FAILURE);
+			c->scmd->place = NULL;
 		}
-		close(errfd);
+		/* A simple command comes expanded; anything else expands its
+		 * commands as it runs them. */
+		int status = c->scmd ? execute_simple_command(c->scmd) :
+		                       execute_complex_command(c);
+		fflush(stdout);
+		_exit(status);
 	}
+	trace_span("fork", "process", start, "subshell");
+	job_launched(group, pid);
+	return pid;
+}
 
-	/* Finally execute the command. */
-	return execute_command(s->tokens);
+/**
+ * Executes a builtin that does I/O (cat, tee, echo, test...) right in the
+ * shell.  Instead of redirecting the shell's own stdin/stdout, the builtin
+ * is handed the redirection files as descriptors to use, so nothing has to
+ * be saved and restored around it.  Even true and false come here, for
+ * what their redirections create (": > file" empties a file).
+ */
+int execute_io_builtin(simple_command *cmd) {
+	redirect_files files;
+	int fds[3], ret;
+
+	if (redirect_open(cmd, fds, &files) == -1)
+		return EXIT_FAILURE;
+
+	/* Anything the shell has buffered must come out before the data. */
+	fflush(stdout);
+	switch (cmd->builtin) {
+		case BUILTIN_CAT:
+			ret = execute_cat(cmd->tokens, fds);
+			break;
+		case BUILTIN_TEE:
+			ret = execute_tee(cmd->tokens, fds);
+			break;
+		case BUILTIN_HISTORY:
+			ret = execute_history(cmd->tokens, fds);
+			break;
+		case BUILTIN_ECHO:
+			ret = execute_echo(cmd->tokens, fds);
+			break;
+		case BUILTIN_PRINTF:
+			ret = execute_printf(cmd->tokens, fds);
+			break;
+		case BUILTIN_TEST:
+			ret = execute_test(cmd->tokens, fds);
+			break;
+		case BUILTIN_TRUE:
+			ret = EXIT_SUCCESS;
+			break;
+		case BUILTIN_FALSE:
+			ret = EXIT_FAILURE;
+			break;
+		default:
+			ret = execute_parallel(cmd->tokens, fds);
+			break;
+	}
+
+	redirect_close(&files);
+	return ret;
 }
 
 
@@ -249,6 +959,21 @@ int execute_nonbuiltin(simple_command *s) {
  * Executes a simple command (no pipes).
  */
 int execute_simple_command(simple_command *cmd) {
+	/* A builtin with pin/nice/ionice runs in a forked copy of the shell,
+	 * so that the shell itself keeps its CPUs and priorities.  Under job
+	 * control, so do cat, tee and parallel, which can run for as long as
+	 * their input lasts: the shell ignores Ctrl-C and Ctrl-Z, but the
+	 * copy is a foreground job of its own that gets them. */
+	process_group group, *g = job_group(&group, 1);
+	int long_running = cmd->builtin == BUILTIN_CAT ||
+	                   cmd->builtin == BUILTIN_TEE ||
+	                   cmd->builtin == BUILTIN_PARALLEL;
+	if (cmd->builtin && (cmd->place || (g && long_running))) {
+		command job = { .scmd = cmd, .type = COMMAND_SIMPLE };
+		pid_t pid = launch_command(&job, -1, -1, g);
+		return job_wait_foreground(&pid, 1, g, &job);
+	}
+
 	/* Call the appropriate function if the command is a builtin. */
 	switch (cmd->builtin) {
 		case BUILTIN_CD:
@@ -257,262 +982,559 @@ int execute_simple_command(simple_command *cmd) {
 			return execute_set(cmd->tokens);
 		case BUILTIN_UNSET:
 			return execute_unset(cmd->tokens);
+		case BUILTIN_HASH:
+			return execute_hash(cmd->tokens);
+		case BUILTIN_CACHE:
+			return execute_cache(cmd->tokens);
+		case BUILTIN_CAT:
+		case BUILTIN_TEE:
+		case BUILTIN_PARALLEL:
+		case BUILTIN_HISTORY:
+		case BUILTIN_ECHO:
+		case BUILTIN_PRINTF:
+		case BUILTIN_TEST:
+		case BUILTIN_TRUE:
+		case BUILTIN_FALSE:
+			return execute_io_builtin(cmd);
+		case BUILTIN_JOBS:
+			return execute_jobs(cmd->tokens);
+		case BUILTIN_WAIT:
+			return execute_wait(cmd->tokens);
+		case BUILTIN_FG:
+			return execute_fg(cmd->tokens);
+		case BUILTIN_BG:
+			return execute_bg(cmd->tokens);
 		case BUILTIN_EXIT:
-			exit(EXIT_SUCCESS);
+			return execute_exit(cmd->tokens);
+		case BUILTIN_BREAK:
+		case BUILTIN_CONTINUE:
+			return execute_break(cmd->tokens);
 	}
 
-	/* Otherwise, we fork a new process to execute the command. */
-	int pid = fork();
+	/* Otherwise, we launch a new process to execute the command, and wait
+	 * for it (unless it gets stopped and becomes a job). */
+	command job = { .scmd = cmd, .type = COMMAND_SIMPLE };
+	pid_t pid = launch_nonbuiltin(cmd, -1, -1, -1, g);
+	return job_wait_foreground(&pid, 1, g, &job);
+}
+
+
+/**
+ * Executes a pipeline.  The parser nests "a | b | c" as "a | (b | c)"; here
+ * the stages are collected into a flat list, connected with N-1 pipes and
+ * launched directly by this shell, then all reaped in one loop.  Returns
+ * the exit status of the last stage.
+ */
+int execute_pipeline(command *c) {
+	/* Count the stages. */
+	int n = 1, i;
+	command *p;
+	for (p = c; p->type == COMMAND_PIPELINE; p = p->cmd2)
+		n++;
+
+	pid_t *pids = malloc(n * sizeof(pid_t));
+	if (!pids) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < n; ++i)
+		pids[i] = -1;
+
+	/* Launch every stage reading from the previous pipe and writing to the
+	 * next one.  All pipe ends are close-on-exec, and the shell closes its
+	 * copies as soon as they are handed on, so each reader sees EOF.  The
+	 * stages make up one job, in one process group. */
+	process_group group, *g = job_group(&group, 1);
+	int fdin = -1;
+	for (i = 0, p = c; i < n; ++i) {
+		command *stage = (i < n - 1) ? p->cmd1 : p;
+		int pfd[2] = { -1, -1 };
+		if (i < n - 1 && make_pipe(pfd) == -1) {
+			perror("pipe");
+			break;
+		}
+		pids[i] = launch_command(stage, fdin, pfd[1], g);
+		if (fdin != -1)
+			close(fdin);
+		if (pfd[1] != -1)
+			close(pfd[1]);
+		fdin = pfd[0];
+		if (i < n - 1)
+			p = p->cmd2;
+	}
+	if (fdin != -1)
+		close(fdin);
+
+	/* Reap all the stages we launched; the last one decides the status. */
+	int status = job_wait_foreground(pids, n, g, c);
+	free(pids);
+	return status;
+}
+
+
+/* Whether running a command would change the state of the shell (its
+ * directory, variables, jobs...), so that it must run in a subshell when
+ * its output is captured. */
+static int changes_shell_state(command *c) {
+	if (!c)
+		return 0;
+	switch (c->type) {
+		case COMMAND_SIMPLE: {
+			/* The words are not expanded yet. */
+			int builtin = c->scmd->tokens[0] ?
+				is_builtin(c->scmd->tokens[0]) : 0;
+			switch (builtin) {
+				case BUILTIN_CD:
+				case BUILTIN_EXIT:
+				case BUILTIN_SET:
+				case BUILTIN_UNSET:
+				case BUILTIN_HASH:
+				case BUILTIN_WAIT:
+				case BUILTIN_FG:
+				case BUILTIN_BG:
+				case BUILTIN_BREAK:
+				case BUILTIN_CONTINUE:
+					return 1;
+			}
+			return 0;
+		}
+		case COMMAND_PIPELINE:
+			/* Every stage runs in a process of its own anyway. */
+			return 0;
+		case COMMAND_BACKGROUND:
+		case COMMAND_FOR:
+			/* for sets its variable */
+			return 1;
+		default:
+			return changes_shell_state(c->cmd1) ||
+			       changes_shell_state(c->cmd2) ||
+			       changes_shell_state(c->cmd3);
+	}
+}
+
+/* Initial size of the buffer for captured output; it doubles as needed. */
+#define CAPTURE_BUFFER 4096
+
+/* Run a command in a forked copy of the shell, reading its output from a
+ * pipe into a buffer that doubles as it fills. */
+static char *capture_subshell(command *c, size_t *len) {
+	int pfd[2];
+	if (make_pipe(pfd) == -1) {
+		perror("pipe");
+		return NULL;
+	}
+	pid_t pid = fork();
 	if (pid == -1) {
 		perror("fork");
-		return EXIT_FAILURE;
+		close(pfd[0]);
+		close(pfd[1]);
+		return NULL;
 	} else if (pid == 0) {
-		return execute_nonbuiltin(cmd);
-	} else {
-		int status;
-		if (wait(&status) == -1) {
-			perror("wait");
-			return EXIT_FAILURE;
-		} else {
-			if (WIFEXITED(status))
-				return WEXITSTATUS(status);
-			else
-				return EXIT_FAILURE;
+		job_child_setup(NULL);
+		if (dup2(pfd[1], fileno(stdout)) == -1)
+			_exit(EXIT_FAILURE);
+		int status = execute_complex_command(c);
+		fflush(stdout);
+		_exit(status);
+	}
+	close(pfd[1]);
+
+	size_t size = CAPTURE_BUFFER, used = 0;
+	char *buf = malloc(size);
+	ssize_t n = 0;
+	while (buf) {
+		if (used == size) {
+			char *grown = realloc(buf, size * 2);
+			if (!grown)
+				break;
+			buf = grown;
+			size *= 2;
 		}
+		n = read(pfd[0], buf + used, size - used);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		used += n;
 	}
+	close(pfd[0]);
+	job_wait_foreground(&pid, 1, NULL, c);
+	*len = used;
+	return buf;
 }
 
+/* Run a command right here with stdout going into a memfd (which can't
+ * fill up while the shell itself is the writer), then read it back in
+ * one go. */
+static char *capture_in_process(command *c, size_t *len) {
+	int fd = memfd_create("substitution", MFD_CLOEXEC);
+	int saved = fcntl(fileno(stdout), F_DUPFD_CLOEXEC, 0);
+	if (fd == -1 || saved == -1 || dup2(fd, fileno(stdout)) == -1) {
+		perror("$(...)");
+		if (fd != -1)
+			close(fd);
+		if (saved != -1)
+			close(saved);
+		return NULL;
+	}
+
+	execute_complex_command(c);
+	fflush(stdout);
+	dup2(saved, fileno(stdout));
+	close(saved);
+
+	struct stat st;
+	char *buf = NULL;
+	if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1))) {
+		ssize_t n = pread(fd, buf, st.st_size, 0);
+		*len = n > 0 ? n : 0;
+	}
+	close(fd);
+	return buf;
+}
 
 /**
- * Executes a complex command.  A complex command is two commands chained 
- * together with a pipe operator.
+ * Runs the command of a $(...) substitution and returns its output,
+ * without the trailing newlines (in a malloc'd buffer, with the length in
+ * len), or NULL on failure.  Builtins that would change the shell's state
+ * (cd, set...) run in a subshell; anything else runs right here, so
+ * external commands are spawned directly and builtins need no fork.
  */
-int execute_complex_command(command *c) {
-	/* If this is a simple command, just run it, except if it's a
-	 * builtin, in which case we just ignore it. */
-	if (c->scmd) {
-		if (c->scmd->builtin)
-			return 0;
-		execute_nonbuiltin(c->scmd);
-		return 0;
+char *capture_output(char *text, size_t *len) {
+	char *line = strdup(text), **tokens = NULL, *output = NULL;
+	command *cmd = NULL;
+
+	*len = 0;
+	if (line)
+		tokens = parse_line(line);
+	if (tokens && *tokens) {
+		unquote_tokens(tokens);
+		cmd = construct_command(tokens, NULL);
+	}
+	if (cmd) {
+		/* What the shell printed so far must not end up in the output. */
+		fflush(stdout);
+		if (changes_shell_state(cmd))
+			output = capture_subshell(cmd, len);
+		else
+			output = capture_in_process(cmd, len);
+		release_command(cmd);
 	}
+	free(tokens);
+	free(line);
 
-	/** 
-	 * Optional: if you wish to handle more than just the 
-	 * pipe operator '|' (the '&&', ';' etc. operators), then 
-	 * you can add more options here. 
-	 */
-	if (!strcmp(c->oper, "|")) {
-		/* Do not execute if one of the commands was incomplete. */
-		if (c->cmd1 == NULL || c->cmd2 == NULL) {
-			fprintf(stderr, "incomplete command\n");
+	while (output && *len > 0 && output[*len - 1] == '\n')
+		(*len)--;
+	return output;
+}
+
+/* Seconds between two times. */
+static double seconds(struct timeval *from, struct timeval *to) {
+	return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+/**
+ * Runs a pipeline under 'time', and reports on stderr how long it took and
+ * what it used: the resources of its processes are added up by wait4 as
+ * they are reaped, and those of the shell itself (for builtins) are taken
+ * from getrusage before and after.
+ */
+int execute_timed(command *c) {
+	struct rusage children, before, after, *outer;
+	struct timespec start, end;
+	int status;
+
+	memset(&children, 0, sizeof(children));
+	outer = job_collect_usage(&children);
+	getrusage(RUSAGE_SELF, &before);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	status = execute_complex_command(c);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_SELF, &after);
+	job_collect_usage(outer);
+
+	double real = (end.tv_sec - start.tv_sec) +
+	              (end.tv_nsec - start.tv_nsec) / 1e9;
+	double user = seconds(&before.ru_utime, &after.ru_utime) +
+	              children.ru_utime.tv_sec + children.ru_utime.tv_usec / 1e6;
+	double sys = seconds(&before.ru_stime, &after.ru_stime) +
+	             children.ru_stime.tv_sec + children.ru_stime.tv_usec / 1e6;
+	long maxrss = children.ru_maxrss ? children.ru_maxrss : after.ru_maxrss;
+	long voluntary = children.ru_nvcsw + after.ru_nvcsw - before.ru_nvcsw;
+	long involuntary = children.ru_nivcsw + after.ru_nivcsw - before.ru_nivcsw;
+
+	fflush(stdout);
+	fprintf(stderr, "\nreal\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n"
+	        "maxrss\t%ld KiB\nctxsw\t%ld voluntary, %ld involuntary\n",
+	        real, user, sys, maxrss, voluntary, involuntary);
+	return status;
+}
+
+/* How many loops we are in, and how many of them a break or continue is
+ * leaving (for a continue, the last one goes on with its next round). */
+static int loop_depth, leaving, continuing;
+
+/**
+ * Leaves the innermost loop (or the n innermost ones), or goes on with its
+ * next round:
+ * For example: words[0] = 'break'  (or 'continue')
+ *              words[1] = '2'      (optional; how many loops)
+ */
+int execute_break(char **words) {
+	long n = 1;
+	if (words == NULL || words[0] == NULL)
+		return EXIT_FAILURE;
+	if (words[1]) {
+		char *end;
+		n = strtol(words[1], &end, 10);
+		if (!*words[1] || *end || n < 1) {
+			fprintf(stderr, "%s: %s: loop count out of range\n",
+			        words[0], words[1]);
 			return EXIT_FAILURE;
 		}
+	}
+	if (loop_depth == 0) {
+		fprintf(stderr, "%s: only meaningful in a loop\n", words[0]);
+		return EXIT_SUCCESS;
+	}
+	leaving = (n > loop_depth) ? loop_depth : n;
+	continuing = !strcmp(words[0], "continue");
+	return EXIT_SUCCESS;
+}
 
-		/* Create a pipe to communicate between the two processes. */
-		int pfd[2];
-		if (pipe(pfd) == -1) {
-			perror("pipe");
-			return EXIT_FAILURE;
+/* Once a part of a loop was cut short by a break or continue: whether the
+ * loop stops, or (for a continue of this loop) goes on with the next round. */
+static int loop_stops(void) {
+	if (--leaving == 0 && continuing) {
+		continuing = 0;
+		return 0;
+	}
+	return 1;
+}
+
+/* Runs an if: the then part if the test succeeds, otherwise the else part
+ * (an elif is an if in the else part). */
+static int execute_if(command *c) {
+	int status = 0;
+
+	if (execute_complex_command(c->cmd1) == 0) {
+		if (!leaving)
+			status = execute_complex_command(c->cmd2);
+	} else if (c->cmd3 && !leaving) {
+		status = execute_complex_command(c->cmd3);
+	}
+	return status;
+}
+
+/* Runs a while (or until) loop: the body, for as long as the test
+ * succeeds (or fails).  Returns the status of the body the last time. */
+static int execute_while(command *c) {
+	int status = 0;
+
+	loop_depth++;
+	for (;;) {
+		int test = execute_complex_command(c->cmd1);
+		if (leaving) {
+			if (loop_stops())
+				break;
+			continue;
 		}
-			
-		/* Fork for the first process. */
-		int pid = fork();
-		if (pid == -1) {
-			perror("fork");
-			return EXIT_FAILURE;
-		} else if (pid == 0) {
-			/* Set the first process's stdout to write to the pipe. */
-			close(fileno(stdout));
-			close(pfd[0]);
-			if (dup2(pfd[1], fileno(stdout)) == -1) {
-				perror("dup2");
-				return EXIT_FAILURE;
+		if ((test == 0) != (c->type == COMMAND_WHILE))
+			break;
+		status = execute_complex_command(c->cmd2);
+		if (leaving && loop_stops())
+			break;
+	}
+	loop_depth--;
+	return status;
+}
+
+/**
+ * Expands the words of a for loop, once.  What came out of a $variable or
+ * $(...) is split at blanks (so "for f in $(ls)" goes over the files),
+ * while a plain word stays one value.  Returns a malloc'd vector (with the
+ * values in the arena), or NULL if out of memory.
+ */
+static char **expand_for_words(char **words, arena *strings) {
+	size_t n = 0, size = 16, i;
+	char **values = malloc(size * sizeof(char*));
+
+	for (i = 0; values && words[i]; i++) {
+		char *value = expand_token(words[i], strings), *s;
+		if (!value) {
+			free(values);
+			return NULL;
+		}
+		/* A new copy was made if anything was expanded. */
+		int split = (value != words[i]);
+		for (s = value; ; ) {
+			if (split) {
+				s += strspn(s, " \t\n");
+				if (!*s)
+					break;
 			}
-			close(pfd[1]);
-			/* Execute the first half of the pipe. */
-			execute_complex_command(c->cmd1);
-			exit(EXIT_FAILURE);
-		} else {
-			/* Fork for the second process. */
-			int pid2 = fork();
-			if (pid2 == -1) {
-				perror("fork");
-				return EXIT_FAILURE;
-			} else if (pid2 == 0) {
-				/* Set the second process's stdin to read from the pipe. */
-				close(fileno(stdin));
-				close(pfd[1]);
-				if (dup2(pfd[0], fileno(stdin)) == -1) {
-					perror("dup2");
-					return EXIT_FAILURE;
+			if (n + 2 > size) {
+				char **grown = realloc(values, (size *= 2) * sizeof(char*));
+				if (!grown) {
+					free(values);
+					return NULL;
 				}
-				close(pfd[0]);
-				/* Execute the second half of the pipe. */
-				execute_complex_command(c->cmd2);
-				exit(EXIT_FAILURE);
-			} else {
-				int status1, status2;
-				close(pfd[0]);
-				close(pfd[1]);
-				/* Wait for both programs to exit, then return the exit status
-				 * of the second one. Kill if at least one of them did not exit. */
-				waitpid(pid, &status1, 0);
-				waitpid(pid2, &status2, 0);
-				if (WIFEXITED(status1) && WIFEXITED(status2))
-					return WEXITSTATUS(status2);
-				else
-					return EXIT_FAILURE;
+				values = grown;
 			}
+			values[n++] = s;
+			if (!split)
+				break;
+			s += strcspn(s, " \t\n");
+			if (!*s)
+				break;
+			*s++ = '\0';
 		}
-		
-	} else if (!strcmp(c->oper, "&")) {
-		/* Do not execute if the left half is missing. */
-		if (c->cmd1 == NULL) {
-			fprintf(stderr, "incomplete command\n");
-			return EXIT_FAILURE;
+	}
+	if (values)
+		values[n] = NULL;
+	return values;
+}
+
+/* Runs a for loop: the body once for each of the words, with the variable
+ * set to it.  Returns the status of the body the last time. */
+static int execute_for(command *c) {
+	arena words = { NULL };
+	int status = 0, i;
+
+	char **values = expand_for_words(c->words, &words);
+	if (!values) {
+		perror("for");
+		arena_free(&words);
+		return EXIT_FAILURE;
+	}
+
+	loop_depth++;
+	for (i = 0; values[i]; i++) {
+		if (var_set(c->name, values[i], var_exported(c->name)) == -1) {
+			perror(c->name);
+			status = EXIT_FAILURE;
+			break;
 		}
+		var_changed(c->name);
+		status = execute_complex_command(c->cmd2);
+		if (leaving && loop_stops())
+			break;
+	}
+	loop_depth--;
+	free(values);
+	arena_free(&words);
+	return status;
+}
 
-		/* Fork for the first process. */
-		int pid = fork();
-		if (pid == -1) {
-			perror("fork");
-			return EXIT_FAILURE;
-		} else if (pid == 0) {
-			/* Execute the first command. */
-			execute_complex_command(c->cmd1);
-			exit(EXIT_FAILURE);
-		} else {
-			if (c->cmd2 == NULL) {
-				return 0;
-			}
+/* Arenas for the words of the commands being run, one for each level of
+ * $(...) (whose commands are run while the words around them are being
+ * expanded); they are kept from one command to the next. */
+#define EXPAND_LEVELS 8
+static arena expand_arenas[EXPAND_LEVELS];
+static int expand_level;
 
-			/* Fork for the second process. */
-			int pid2 = fork();
-			if (pid2 == -1) {
-				perror("fork");
+/**
+ * Runs a simple command or a pipeline: its words are expanded just before
+ * it starts, so they see what the commands before it did.
+ */
+static int execute_expanded(command *c) {
+	arena own = { NULL };
+	arena *strings = expand_level < EXPAND_LEVELS ?
+		&expand_arenas[expand_level] : &own;
+	int status = EXIT_FAILURE;
+
+	expand_level++;
+	command *run = expand_command(c, strings);
+	if (!run)
+		perror("expand_command");
+	else if (run->scmd)
+		status = execute_simple_command(run->scmd);
+	else
+		status = execute_pipeline(run);
+	expand_level--;
+	arena_reset(strings);
+	arena_free(&own);
+	return status;
+}
+
+/**
+ * Executes a complex command: the syntax tree of a command line, with
+ * simple commands, pipelines, if, while and for joined by &&, ||, ; and &.
+ * The tree is the one parsed (it is left as it is, so it can be run again);
+ * the words of each command are expanded when it runs, so "false && echo
+ * $(date)" runs no date, and "set X 1 ; echo $X" prints 1.
+ */
+int execute_complex_command(command *c) {
+	int status;
+
+	switch (c->type) {
+		case COMMAND_SIMPLE:
+		case COMMAND_PIPELINE:
+			/* Builtins run right here in the shell, so e.g.
+			 * "cd dir && make" changes our directory. */
+			return execute_expanded(c);
+
+		case COMMAND_TIME:
+			return execute_timed(c->cmd1);
+
+		case COMMAND_IF:
+			return execute_if(c);
+
+		case COMMAND_WHILE:
+		case COMMAND_UNTIL:
+			return execute_while(c);
+
+		case COMMAND_FOR:
+			return execute_for(c);
+
+		case COMMAND_BACKGROUND: {
+			/* Launch the first command; it runs in the background, and is
+			 * kept in the job table until it is reaped.  A simple command
+			 * is expanded here, so a program can be spawned directly;
+			 * anything else expands its own commands in the subshell. */
+			process_group group, *g = job_group(&group, 0);
+			arena strings = { NULL };
+			command *run = c->cmd1;
+			if (run->scmd && !(run = expand_command(run, &strings)))
+				perror("expand_command");
+			pid_t pid = run ? launch_command(run, -1, -1, g) : -1;
+			arena_free(&strings);
+			if (pid == -1)
 				return EXIT_FAILURE;
-			} else if (pid2 == 0) {
-				/* Execute the second command. */
-				execute_complex_command(c->cmd2);
-				exit(EXIT_FAILURE);
-			} else {
-				int status;
-				/* Wait for only the second program to exit. The first
-				 * one is running in the background. */
-				waitpid(pid2, &status, 0);
-				return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
-			}
-		}
-	} else if (!strcmp(c->oper, ";") || !strcmp(c->oper, "&&") || !strcmp(c->oper, "||")) {
-		/* These three operators work in a similar way, so we can use
-		 * the same code to implement them, with only a few changes. */
+			job_add_background(&pid, 1, g, c->cmd1);
+			/* A loop may start many of these before the line is done; reap
+			 * the ones that have finished as it goes. */
+			jobs_reap();
+			if (c->cmd2 == NULL)
+				return 0;
 
-		/* Do not execute if one of the commands was incomplete. */
-		if (c->cmd1 == NULL || c->cmd2 == NULL) {
-			fprintf(stderr, "incomplete command\n");
-			return EXIT_FAILURE;
+			/* Run the rest of the list in the foreground. */
+			return execute_complex_command(c->cmd2);
 		}
 
-		/* Fork for the first process. */
-		int pid = fork();
-		if (pid == -1) {
-			perror("fork");
-			return EXIT_FAILURE;
-		} else if (pid == 0) {
-			/* Execute the first command. */
-			execute_complex_command(c->cmd1);
-			exit(EXIT_FAILURE);
-		} else {
-			/* This time, we check the wait for the first process to end
-			 * before we execute the second one. */
-			int status;
-			if (wait(&status) == -1) {
-				perror("wait");
-				return EXIT_FAILURE;
-			}
-			if (!WIFEXITED(status))
-				return EXIT_FAILURE;
+		case COMMAND_SEQUENCE:
+		case COMMAND_AND:
+		case COMMAND_OR:
+			/* Run both sides in this shell (only external programs get a
+			 * process of their own), finishing the first one before the
+			 * second one starts. */
+			status = execute_complex_command(c->cmd1);
 
-			status = WEXITSTATUS(status);
-			/* Exit after running the first process if:
+			/* Stop after the first command if:
 			 *  (a) it failed and our command had a &&; or
 			 *  (b) it succeeded and our command had a ||. */
-			if (!strcmp(c->oper, "&&") && status)
+			if (c->type == COMMAND_AND && status)
 				return status;
-			if (!strcmp(c->oper, "||") && !status)
+			if (c->type == COMMAND_OR && !status)
+				return status;
+			/* A break or continue skips the rest of the loop's body. */
+			if (leaving)
 				return status;
 
-			/* Fork for the second process. */
-			int pid2 = fork();
-			if (pid2 == -1) {
-				perror("fork");
-				return EXIT_FAILURE;
-			} else if (pid2 == 0) {
-				/* Execute the second command. */
-				execute_complex_command(c->cmd2);
-				exit(EXIT_FAILURE);
-			} else {
-				int status;
-				/* Wait for it to exit. */
-				waitpid(pid2, &status, 0);
-				return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
-			}
-		}
+			/* Run the second command. */
+			return execute_complex_command(c->cmd2);
 	}
 	return 0;
 }
-
-/* Print the prompt string. */
-void print_prompt(void) {
-	/* Get the username. */
-	struct passwd *pw = getpwuid(getuid());
-	char *username = pw->pw_name;
-	/* Get the home directory (from the HOME environment variable),
-	 * so we can print the current directory relative to it. */
-	char *homedir = pw->pw_dir;
-
-	/* Get the computer's hostname. */
-	char host[MAX_HOSTNAME];
-	gethostname(host, MAX_HOSTNAME - 1);
-
-	/* Get the current directory. */
-	char cwd[MAX_DIRNAME];
-	getcwd(cwd, MAX_DIRNAME - 1);
-
-	/* Rewrite the current directory relative to the home directory (if possible). */
-	char *cwd2 = cwd;
-	if (is_in_home(cwd, homedir)) {
-		cwd2 += strlen(homedir) - 1;
-		*cwd2 = '~';
-	}
-
-	/* Build the prompt string from the contents of the PROMPT environment variable. */
-	char *pstr = getenv("PROMPT");
-	if (!pstr)
-		pstr = "\\u@\\h:\\w$ ";
-	int i;
-	for (i = 0; i < strlen(pstr); ++i) {
-		if (pstr[i] == '\\') {
-			switch (pstr[++i]) {
-				case 'u':
-					printf("%s", username);
-					break;
-				case 'h':
-					printf("%s", host);
-					break;
-				case 'w':
-					printf("%s", cwd2);
-					break;
-				case 'e':
-					printf("\033");
-					break;
-				default:
-					break;
-			}
-		} else {
-			printf("%c", pstr[i]);
-		}
-	}
-}
-
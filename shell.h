@@ -1,27 +1,96 @@
 #ifndef _SHELL_H
 #define _SHELL_H
 
+#include <sys/types.h>
+
 /* built-in commands */
 #define BUILTIN_CD   1
 #define BUILTIN_EXIT 2
 #define BUILTIN_SET  3
 #define BUILTIN_UNSET 4
+#define BUILTIN_HASH  5
+#define BUILTIN_CAT   6
+#define BUILTIN_TEE   7
+#define BUILTIN_JOBS  8
+#define BUILTIN_WAIT  9
+#define BUILTIN_FG    10
+#define BUILTIN_BG    11
+#define BUILTIN_PARALLEL 12
+#define BUILTIN_HISTORY  13
+#define BUILTIN_CACHE    14
+#define BUILTIN_BREAK    15
+#define BUILTIN_CONTINUE 16
+#define BUILTIN_ECHO     17
+#define BUILTIN_PRINTF   18
+#define BUILTIN_TEST     19
+#define BUILTIN_TRUE     20
+#define BUILTIN_FALSE    21
+
+/* Kinds of redirections */
+typedef enum redirect_type_t {
+	REDIRECT_OPEN,           /* n< file, n> file, n>> file, n<> file */
+	REDIRECT_DUP,            /* n>&m, n<&m */
+	REDIRECT_CLOSE,          /* n>&-, n<&- */
+	REDIRECT_HERE            /* << text, from a here-document or here-string */
+} redirect_type;
+
+/* One step of the redirections of a command, which are carried out in
+ * order: "> out 2>&1" opens out as 1, then makes 2 a copy of 1. */
+typedef struct redirect_t {
+	redirect_type type;
+	int fd;                  /* The descriptor that is set up */
+	int flags;               /* For REDIRECT_OPEN: the flags for open() */
+	int from;                /* For REDIRECT_DUP: the descriptor copied */
+	char *target;            /* The file name, or the text of a here-document */
+} redirect;
+
+struct placement_t;
 
 typedef struct simple_command_t {
-	char *in, *out, *err;    /* Files for redirection, optional */
+	redirect *redirects;     /* Redirections, in order */
+	int nredirects;
 	char **tokens;           /* Program and its parameters */
 	int builtin;             /* Builtin commands, e.g., cd */
+	struct placement_t *place; /* CPUs and priorities from pin/nice/ionice
+	                            * prefixes, optional */
 } simple_command;
 
+/* Kinds of nodes in the syntax tree of a command line */
+typedef enum command_type_t {
+	COMMAND_SIMPLE,          /* scmd: a program or builtin */
+	COMMAND_PIPELINE,        /* cmd1 | cmd2, where cmd2 may be a pipeline */
+	COMMAND_AND,             /* cmd1 && cmd2 */
+	COMMAND_OR,              /* cmd1 || cmd2 */
+	COMMAND_SEQUENCE,        /* cmd1 ; cmd2 */
+	COMMAND_BACKGROUND,      /* cmd1 & cmd2, where cmd2 is optional */
+	COMMAND_TIME,            /* time cmd1 */
+	COMMAND_IF,              /* if cmd1; then cmd2; else cmd3; fi, where cmd3
+	                          * is optional (and an if for elif) */
+	COMMAND_WHILE,           /* while cmd1; do cmd2; done */
+	COMMAND_UNTIL,           /* until cmd1; do cmd2; done */
+	COMMAND_FOR              /* for name in words; do cmd2; done */
+} command_type;
+
 typedef struct command_t {
-	/*  Two commands piped between each other. 
+	/*  Two commands joined by an operator.
 	 *  Each command can contain multiple commands itself */
 	struct command_t *cmd1, *cmd2;  
 
-	simple_command* scmd; /* Simple command, no pipe */
-	char oper[2];   /* In this assignment, consider only "|".
-	                Optional: implement other operators: ";", "&&", etc. */
+	simple_command* scmd; /* Simple command, no operator */
+	command_type type;
+
+	struct command_t *cmd3;  /* For if: the else part, optional */
+	char *name;              /* For for: the variable */
+	char **words;            /* For for: the words, before expansion */
 } command;
 
+struct process_group_t;
+
+/* Start an external command with the given stdin/stdout/stderr (-1 to
+ * inherit), in a process group (or NULL).  Returns its pid, or -1 on
+ * failure. */
+pid_t launch_nonbuiltin(simple_command *s, int fdin, int fdout, int fderr,
+                        struct process_group_t *group);
+
 #endif
 
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Builtins that stand in for programs: they must behave like the programs
+# they replace, and must not break on unusual arguments.
+# Usage: tests/builtins.sh   (run from the top of the tree, after 'make';
+# exits non-zero on failure)
+
+SHELL_BIN=$(realpath "${SHELL_BIN:-./shell}")
+DIR=$(mktemp -d)
+failed=0
+trap 'rm -rf "$DIR"' EXIT
+
+# check <name> <expected output> <lines run by the shell>
+check() {
+	local out
+	out=$(cd "$DIR" && printf '%s\n' "$3" | "$SHELL_BIN" 2>&1)
+	if [ "$out" = "$2" ]; then
+		echo "ok    $1"
+	else
+		echo "FAIL  $1: expected '$2', got '$out'"
+		failed=1
+	fi
+}
+
+ZEROS=$(printf '%060d' 0)
+check "printf with the longest flags and width" \
+	"printf: %${ZEROS}d: invalid format" "printf %${ZEROS}d 5"
+check "printf with a width just short of the limit" \
+	"$(printf "%${ZEROS:1}d" 5)" "printf %${ZEROS:1}d 5"
+check "cat with an option runs the program" "     1	abc" "echo abc > f
+cat -n f"
+check "cat -A runs the program" 'abc$' "echo abc | cat -A"
+check "tee -a appends" "abc
+def" "echo abc > t
+echo def | tee -a t > /dev/null
+cat t"
+check "tee --help is not a file name" "no file" "tee --help > /dev/null
+test -e --help || echo no file"
+BASE=$(nice)
+check "nice -N is an increment, as for nice(1)" "$((BASE + 5))" "nice -5 nice"
+check "nice -n N" "$((BASE + 2))" "nice -n 2 nice"
+exit $failed
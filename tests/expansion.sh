@@ -0,0 +1,41 @@
+#!/bin/bash
+# The words of a command are expanded just before it runs: they see what
+# the commands before them on the line did, and a command that does not
+# run has nothing of its words expanded.
+# Usage: tests/expansion.sh   (run from the top of the tree, after 'make';
+# exits non-zero on failure)
+
+SHELL_BIN=$(realpath "${SHELL_BIN:-./shell}")
+DIR=$(mktemp -d)
+failed=0
+trap 'rm -rf "$DIR"' EXIT
+
+# check <name> <expected output> <lines run by the shell>
+check() {
+	local out
+	out=$(cd "$DIR" && printf '%s\n' "$3" | "$SHELL_BIN" 2>&1)
+	if [ "$out" = "$2" ]; then
+		echo "ok    $1"
+	else
+		echo "FAIL  $1: expected '$2', got '$out'"
+		failed=1
+	fi
+}
+
+check "a variable set earlier on the line" "x=1" "set -l X 1 ; echo x=\$X"
+check "a variable set on the left of &&" "x=2" "set -l X 2 && echo x=\$X"
+check "\$(...) of a command that is skipped" "no file" \
+	"false && echo \$(touch f)
+test -e f || echo no file"
+check "\$(...) of a branch not taken" "no file" \
+	"if false ; then echo \$(touch f) ; fi
+true || echo \$(touch f)
+test -e f || echo no file"
+check "a pipeline sees the variables" "a b" \
+	"set -l X a ; echo \$X b | cat"
+check "a background command sees the variables" "bg" \
+	"set -l X bg ; echo \$X > out &
+wait ; cat out"
+check "a loop body, command by command" "1
+2" "for i in 1 2 ; do set -l Y \$i ; echo \$Y ; done"
+exit $failed
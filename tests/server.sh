@@ -0,0 +1,49 @@
+#!/bin/bash
+# Daemon mode: the directory and variables of a connection carry over from
+# one request to the next, and only from the request itself, not from the
+# subshells it forks ($(...) and pipeline stages that run exit).
+# Usage: tests/server.sh   (run from the top of the tree, after 'make';
+# exits non-zero on failure)
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+CLIENT_BIN=${CLIENT_BIN:-./client}
+DIR=$(mktemp -d)
+SOCK="$DIR/sock"
+START=$(pwd -P)
+failed=0
+
+"$SHELL_BIN" --listen "$SOCK" > /dev/null 2>&1 &
+SERVER=$!
+trap 'kill $SERVER; rm -rf "$DIR"' EXIT
+while [ ! -S "$SOCK" ]; do
+	sleep 0.01
+done
+
+# check <name> <expected output> <lines sent over one connection>
+check() {
+	local out
+	out=$(printf '%s\n' "$3" | "$CLIENT_BIN" "$SOCK")
+	if [ "$out" = "$2" ]; then
+		echo "ok    $1"
+	else
+		echo "FAIL  $1: expected '$2', got '$out'"
+		failed=1
+	fi
+}
+
+check "cd carries over" "/tmp" "cd /tmp
+pwd"
+check "set carries over" "x=42" "set -l X 42
+echo x=\$X"
+check "exit in \$(...) leaves the session alone" "$START" \
+	"set -l Y \$(cd /tmp ; exit)
+pwd"
+check "exit in a pipeline stage leaves the session alone" "$START" \
+	"if cd /usr ; then exit 3 ; fi | cat
+pwd"
+check "set in a pipeline stage leaves the session alone" "x=" \
+	"set -l X 1 | cat
+echo x=\$X"
+check "exit of the request itself keeps its state" "/usr" "cd /usr ; exit 3
+pwd"
+exit $failed
@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "trace.h"
+#include "vars.h"
+
+/**
+ * Tracing in the Chrome trace-event format (chrome://tracing, Perfetto):
+ * with SHSH_TRACE=file.json, the shell records when it parses, forks,
+ * spawns, execs and waits, as a JSON array of events.  Every event goes
+ * out in a single write() to a file opened with O_APPEND, so forked
+ * copies of the shell (pipeline stages, subshells) can add their own
+ * events to the same file without any buffering getting duplicated.
+ */
+
+/* Longest detail string recorded for an event */
+#define MAX_DETAIL 256
+
+static int trace_fd = -1;
+static pid_t trace_pid;          /* The shell that started the trace */
+
+/* The time in microseconds, on the same clock in every process. */
+static long long now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Write a string into buf as JSON string contents, truncated to fit. */
+static void json_escape(char *buf, size_t size, char *s) {
+	size_t len = 0;
+	for (; *s && len < MAX_DETAIL && len + 7 < size; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			buf[len++] = '\\';
+			buf[len++] = c;
+		} else if (c < 0x20) {
+			len += sprintf(buf + len, "\\u%04x", c);
+		} else {
+			buf[len++] = c;
+		}
+	}
+	buf[len] = '\0';
+}
+
+/* Write one event, ending with a comma so the next can follow.  Spans
+ * have a duration; instant events (dur < 0) don't. */
+static void emit(char *name, char *category, char *phase, long long ts,
+                 long long dur, char *detail) {
+	char event[MAX_DETAIL * 6 + 256], args[MAX_DETAIL * 6 + 32] = "";
+	char duration[32] = "";
+	int len;
+
+	if (dur >= 0)
+		snprintf(duration, sizeof(duration), "\"dur\":%lld,", dur);
+	if (detail) {
+		char escaped[MAX_DETAIL * 6 + 8];
+		json_escape(escaped, sizeof(escaped), detail);
+		snprintf(args, sizeof(args), ",\"args\":{\"detail\":\"%s\"}",
+		         escaped);
+	}
+	len = snprintf(event, sizeof(event),
+	               "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\","
+	               "\"ts\":%lld,%s\"pid\":%d,\"tid\":%d%s},\n",
+	               name, category, phase, ts, duration, getpid(), getpid(),
+	               args);
+	if (len > 0 && (size_t)len < sizeof(event) &&
+		write(trace_fd, event, len) == -1)
+		return;
+}
+
+/* Close the array when the shell that started the trace exits. */
+static void trace_finish(void) {
+	char end[128];
+	int len;
+	if (trace_fd == -1 || getpid() != trace_pid)
+		return;
+	len = snprintf(end, sizeof(end),
+	               "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	               "\"args\":{\"name\":\"shsh\"}}]\n", trace_pid);
+	if (write(trace_fd, end, len) == -1)
+		return;
+	close(trace_fd);
+	trace_fd = -1;
+}
+
+/* Start writing a trace to the file named by SHSH_TRACE. */
+void trace_init(void) {
+	char *file = var_get("SHSH_TRACE");
+	if (!file || !*file)
+		return;
+
+	trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+	                0644);
+	if (trace_fd == -1) {
+		perror(file);
+		return;
+	}
+	trace_pid = getpid();
+	if (write(trace_fd, "[\n", 2) == -1) {
+		perror(file);
+		close(trace_fd);
+		trace_fd = -1;
+		return;
+	}
+	atexit(trace_finish);
+}
+
+/* Whether a trace is being written. */
+int trace_enabled(void) {
+	return trace_fd != -1;
+}
+
+/* The start time of a span. */
+long long trace_now(void) {
+	return trace_fd != -1 ? now_us() : 0;
+}
+
+/* Record a span from start until now. */
+void trace_span(char *name, char *category, long long start, char *detail) {
+	if (trace_fd == -1)
+		return;
+	emit(name, category, "X", start, now_us() - start, detail);
+}
+
+/* Record an instant event. */
+void trace_instant(char *name, char *category, char *detail) {
+	if (trace_fd == -1)
+		return;
+	emit(name, category, "i", now_us(), -1, detail);
+}
@@ -0,0 +1,21 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/* Start writing a trace to the file named by SHSH_TRACE, if it is set. */
+void trace_init(void);
+
+/* Whether a trace is being written. */
+int trace_enabled(void);
+
+/* The time to pass to trace_span as the start of a span, in microseconds
+ * (0 when not tracing). */
+long long trace_now(void);
+
+/* Record a span of the given category from start until now, with an
+ * optional detail (e.g. the command). */
+void trace_span(char *name, char *category, long long start, char *detail);
+
+/* Record an instant event. */
+void trace_instant(char *name, char *category, char *detail);
+
+#endif
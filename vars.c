@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vars.h"
+
+/**
+ * The shell's variables, in a hash table owned by the shell instead of the
+ * process environment, which getenv can only search linearly.  Each
+ * variable is stored as its "NAME=value" string, so the environment handed
+ * to exec is just an array of pointers to the exported ones; it is kept
+ * until an exported variable changes.
+ */
+
+/* Initial number of buckets; must be a power of two. */
+#define INITIAL_BUCKETS 256
+
+typedef struct var_t {
+	char *entry;                /* "NAME=value" */
+	size_t name_len;
+	size_t hash;
+	int exported;
+	struct var_t *next;
+} var;
+
+static var **buckets;
+static size_t nbuckets, nvars, nexported;
+
+/* The environment for commands, and whether it needs rebuilding. */
+static char **envp;
+static int envp_stale = 1;
+
+/* FNV-1a hash of the first len characters of a string. */
+static size_t hash_name(char *s, size_t len) {
+	size_t h = 2166136261u;
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Double the number of buckets and rehash all the variables. */
+static void grow(void) {
+	size_t newsize = nbuckets ? nbuckets * 2 : INITIAL_BUCKETS;
+	var **newbuckets = calloc(newsize, sizeof(var*));
+	if (!newbuckets)
+		return;
+
+	size_t i;
+	for (i = 0; i < nbuckets; ++i) {
+		var *v = buckets[i], *next;
+		for (; v; v = next) {
+			next = v->next;
+			size_t b = v->hash & (newsize - 1);
+			v->next = newbuckets[b];
+			newbuckets[b] = v;
+		}
+	}
+	free(buckets);
+	buckets = newbuckets;
+	nbuckets = newsize;
+}
+
+/* Find the bucket link pointing at a variable (or at the NULL at the end of
+ * its chain, if it is not set). */
+static var **find(char *name, size_t len, size_t h) {
+	if (!nbuckets)
+		grow();
+	if (!nbuckets)
+		return NULL;
+	var **link = &buckets[h & (nbuckets - 1)];
+	for (; *link; link = &(*link)->next) {
+		var *v = *link;
+		if (v->hash == h && v->name_len == len &&
+			!memcmp(v->entry, name, len))
+			break;
+	}
+	return link;
+}
+
+/* Set a variable from a "NAME=value" string the table takes over. */
+static int store(char *entry, size_t len, int exported) {
+	size_t h = hash_name(entry, len);
+	var **link = find(entry, len, h);
+	if (!link) {
+		free(entry);
+		return -1;
+	}
+
+	var *v = *link;
+	if (v) {
+		free(v->entry);
+		if (v->exported || exported)
+			envp_stale = 1;
+		nexported += exported - v->exported;
+	} else {
+		v = malloc(sizeof(var));
+		if (!v) {
+			free(entry);
+			return -1;
+		}
+		v->name_len = len;
+		v->hash = h;
+		v->next = NULL;
+		*link = v;
+		nvars++;
+		nexported += exported;
+		if (exported)
+			envp_stale = 1;
+	}
+	v->entry = entry;
+	v->exported = exported;
+
+	if (nvars > nbuckets)
+		grow();
+	return 0;
+}
+
+/* Import the process environment as exported variables. */
+void vars_init(char **env) {
+	for (; *env; env++) {
+		char *eq = strchr(*env, '=');
+		char *entry = eq ? strdup(*env) : NULL;
+		if (entry)
+			store(entry, eq - *env, 1);
+	}
+}
+
+/* Look up a variable named by the first len characters of name. */
+char *var_get_n(char *name, size_t len) {
+	if (!nvars)
+		return NULL;
+	var **link = find(name, len, hash_name(name, len));
+	return (link && *link) ? (*link)->entry + len + 1 : NULL;
+}
+
+/* Look up a variable. */
+char *var_get(char *name) {
+	return var_get_n(name, strlen(name));
+}
+
+/* Set a variable. */
+int var_set(char *name, char *value, int exported) {
+	size_t len = strlen(name), vlen = strlen(value);
+	if (len == 0 || strchr(name, '='))
+		return -1;
+
+	char *entry = malloc(len + vlen + 2);
+	if (!entry)
+		return -1;
+	memcpy(entry, name, len);
+	entry[len] = '=';
+	memcpy(entry + len + 1, value, vlen + 1);
+	return store(entry, len, exported);
+}
+
+/* Remove a variable. */
+int var_unset(char *name) {
+	size_t len = strlen(name);
+	var **link = nvars ? find(name, len, hash_name(name, len)) : NULL;
+	if (!link || !*link)
+		return -1;
+
+	var *v = *link;
+	*link = v->next;
+	if (v->exported) {
+		nexported--;
+		envp_stale = 1;
+	}
+	nvars--;
+	free(v->entry);
+	free(v);
+	return 0;
+}
+
+/* Whether a variable is passed on to commands. */
+int var_exported(char *name) {
+	size_t len = strlen(name);
+	var **link = nvars ? find(name, len, hash_name(name, len)) : NULL;
+	return link && *link && (*link)->exported;
+}
+
+/* The environment for commands. */
+char **vars_environ(void) {
+	if (!envp_stale && envp)
+		return envp;
+
+	static char *empty[] = { NULL };
+	char **newenvp = realloc(envp, (nexported + 1) * sizeof(char*));
+	if (!newenvp)
+		return empty;
+	envp = newenvp;
+
+	size_t i, n = 0;
+	for (i = 0; i < nbuckets; ++i) {
+		var *v;
+		for (v = buckets[i]; v; v = v->next) {
+			if (v->exported)
+				envp[n++] = v->entry;
+		}
+	}
+	envp[n] = NULL;
+	envp_stale = 0;
+	return envp;
+}
+
+/* Call visit on every variable, as its "NAME=value" string. */
+void vars_walk(void (*visit)(char *entry, int exported, void *arg),
+               void *arg) {
+	size_t i;
+	for (i = 0; i < nbuckets; ++i) {
+		var *v;
+		for (v = buckets[i]; v; v = v->next)
+			visit(v->entry, v->exported, arg);
+	}
+}
+
+/* Remove all the variables. */
+void vars_clear(void) {
+	size_t i;
+	for (i = 0; i < nbuckets; ++i) {
+		var *v = buckets[i], *next;
+		for (; v; v = next) {
+			next = v->next;
+			free(v->entry);
+			free(v);
+		}
+		buckets[i] = NULL;
+	}
+	nvars = nexported = 0;
+	envp_stale = 1;
+}
@@ -0,0 +1,37 @@
+#ifndef __VARS_H__
+#define __VARS_H__
+
+#include <stddef.h>
+
+/* Import the process environment as exported variables. */
+void vars_init(char **envp);
+
+/* Look up a variable. Returns its value, or NULL if it is not set. */
+char *var_get(char *name);
+
+/* Look up a variable named by the first len characters of name. */
+char *var_get_n(char *name, size_t len);
+
+/* Set a variable; exported ones are passed on to commands. Returns -1 if
+ * the name is not valid or we are out of memory. */
+int var_set(char *name, char *value, int exported);
+
+/* Remove a variable. Returns -1 if it was not set. */
+int var_unset(char *name);
+
+/* Whether a variable is passed on to commands. */
+int var_exported(char *name);
+
+/* The environment for commands: a NULL-terminated array of "NAME=value"
+ * strings, rebuilt only after the exported variables have changed. */
+char **vars_environ(void);
+
+/* Call visit on every variable, as its "NAME=value" string (valid until
+ * the variable changes), in no particular order. */
+void vars_walk(void (*visit)(char *entry, int exported, void *arg),
+               void *arg);
+
+/* Remove all the variables. */
+void vars_clear(void);
+
+#endif